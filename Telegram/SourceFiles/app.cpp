@@ -49,6 +49,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "window/themes/window_theme.h"
 #include "window/notifications_manager.h"
 #include "platform/platform_notifications_manager.h"
+#include "data/data_messages_index.h"
 
 namespace {
 	App::LaunchState _launchState = App::Launched;
@@ -125,12 +126,6 @@ namespace {
 	EmojiImagesMap MainEmojiMap;
 	QMap<int, EmojiImagesMap> OtherEmojiMap;
 
-	int32 serviceImageCacheSize = 0;
-
-	using LastPhotosList = QLinkedList<PhotoData*>;
-	LastPhotosList lastPhotos;
-	using LastPhotosMap = QHash<PhotoData*, LastPhotosList::iterator>;
-	LastPhotosMap lastPhotosMap;
 }
 
 namespace App {
@@ -1614,7 +1609,6 @@ namespace {
 		}
 		PhotosData::const_iterator i = ::photosData.constFind(photo);
 		PhotoData *result;
-		LastPhotosMap::iterator inLastIter = lastPhotosMap.end();
 		if (i == ::photosData.cend()) {
 			if (convert) {
 				result = convert;
@@ -1631,18 +1625,6 @@ namespace {
 				updateImage(result->medium, medium);
 				updateImage(result->full, full);
 			}
-			inLastIter = lastPhotosMap.find(result);
-		}
-		if (inLastIter == lastPhotosMap.end()) { // insert new one
-			if (lastPhotos.size() == MaxPhotosInMemory) {
-				lastPhotos.front()->forget();
-				lastPhotosMap.remove(lastPhotos.front());
-				lastPhotos.pop_front();
-			}
-			lastPhotosMap.insert(result, lastPhotos.insert(lastPhotos.end(), result));
-		} else {
-			lastPhotos.erase(inLastIter.value()); // move to back
-			(*inLastIter) = lastPhotos.insert(lastPhotos.end(), result);
 		}
 		return result;
 	}
@@ -1897,17 +1879,9 @@ namespace {
 		return i.value();
 	}
 
-	void forgetMedia() {
-		lastPhotos.clear();
-		lastPhotosMap.clear();
-		for_const (auto photo, ::photosData) {
-			photo->forget();
-		}
+	void forgetDocumentsData() {
 		for_const (auto document, ::documentsData) {
-			document->forget();
-		}
-		for_const (auto location, ::locationsData) {
-			location->thumb->forget();
+			document->forgetData();
 		}
 	}
 
@@ -2012,6 +1986,7 @@ namespace {
 			}
 		}
 		AuthSession::Current().notifications().clearFromItem(item);
+		AuthSession::Current().messagesIndex().remove(item);
 		if (Global::started() && !App::quitting()) {
 			Global::RefItemRemoved().notify(item, true);
 		}
@@ -2109,8 +2084,6 @@ namespace {
 		::gameItems.clear();
 		::sharedContactItems.clear();
 		::gifItems.clear();
-		lastPhotos.clear();
-		lastPhotosMap.clear();
 		::self = nullptr;
 		Global::RefSelfChanged().notify(true);
 	}
@@ -2129,6 +2102,10 @@ namespace {
 		}
 	}
 
+	bool historyHasDependent(HistoryItem *dependency) {
+		return ::dependentItems.contains(dependency);
+	}
+
 	void historyRegRandom(uint64 randomId, const FullMsgId &itemId) {
 		randomData.insert(randomId, itemId);
 	}
@@ -2327,8 +2304,6 @@ namespace {
 
 		clearStorageImages();
 		cSetServerBackgrounds(WallPapers());
-
-		serviceImageCacheSize = imageCacheSize();
 	}
 
 	void deinitMedia() {
@@ -2433,11 +2408,7 @@ namespace {
 	}
 
 	void checkImageCacheSize() {
-		int64 nowImageCacheSize = imageCacheSize();
-		if (nowImageCacheSize > serviceImageCacheSize + MemoryForImageCache) {
-			App::forgetMedia();
-			serviceImageCacheSize = imageCacheSize();
-		}
+		Image::forgetUnused(MemoryForImageCache);
 	}
 
 	bool isValidPhone(QString phone) {
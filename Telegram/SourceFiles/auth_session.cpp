@@ -28,6 +28,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "window/notifications_manager.h"
 #include "platform/platform_specific.h"
 #include "calls/calls_instance.h"
+#include "data/data_messages_index.h"
 
 namespace {
 
@@ -130,7 +131,8 @@ AuthSession::AuthSession(UserId userId)
 , _api(std::make_unique<ApiWrap>())
 , _calls(std::make_unique<Calls::Instance>())
 , _downloader(std::make_unique<Storage::Downloader>())
-, _notifications(std::make_unique<Window::Notifications::System>(this)) {
+, _notifications(std::make_unique<Window::Notifications::System>(this))
+, _messagesIndex(std::make_unique<Data::MessagesIndex>()) {
 	Expects(_userId != 0);
 	_saveDataTimer.setCallback([this] {
 		Local::writeUserSettings();
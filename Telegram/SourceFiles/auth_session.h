@@ -36,6 +36,10 @@ namespace Calls {
 class Instance;
 } // namespace Calls
 
+namespace Data {
+class MessagesIndex;
+} // namespace Data
+
 class ApiWrap;
 
 enum class EmojiPanelTab {
@@ -167,6 +171,10 @@ public:
 		return *_calls;
 	}
 
+	Data::MessagesIndex &messagesIndex() {
+		return *_messagesIndex;
+	}
+
 	void checkAutoLock();
 	void checkAutoLockIn(TimeMs time);
 
@@ -184,5 +192,6 @@ private:
 	const std::unique_ptr<Calls::Instance> _calls;
 	const std::unique_ptr<Storage::Downloader> _downloader;
 	const std::unique_ptr<Window::Notifications::System> _notifications;
+	const std::unique_ptr<Data::MessagesIndex> _messagesIndex;
 
 };
@@ -20,6 +20,51 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 */
 #include "base/runtime_composer.h"
 
+namespace {
+
+// Lookups of already created metadata read this table without locking,
+// slots are filled only under the mutex and never change after that.
+constexpr auto kMetadataCacheSize = 256;
+QAtomicPointer<const RuntimeComposerMetadata> MetadataCache[kMetadataCacheSize];
+
+constexpr auto kPoolSizeStep = std::size_t(16);
+constexpr auto kPoolMaxSize = std::size_t(1024);
+constexpr auto kPoolSizeClasses = kPoolMaxSize / kPoolSizeStep;
+constexpr auto kPoolKeptBytes = std::size_t(4 * 1024 * 1024); // per thread
+
+struct BlocksPool {
+	std::vector<void*> free[kPoolSizeClasses];
+	std::size_t kept = 0;
+
+	~BlocksPool() {
+		for (auto &list : free) {
+			for (auto block : list) {
+				::operator delete(block);
+			}
+		}
+	}
+};
+
+QThreadStorage<BlocksPool*> *BlocksPools() {
+	// Intentionally leaked, some composers outlive the static objects on quit.
+	static auto result = new QThreadStorage<BlocksPool*>();
+	return result;
+}
+
+BlocksPool *CurrentBlocksPool() {
+	auto pools = BlocksPools();
+	if (!pools->hasLocalData()) {
+		pools->setLocalData(new BlocksPool());
+	}
+	return pools->localData();
+}
+
+int MetadataCacheSlot(uint64 mask) {
+	return int((mask ^ (mask >> 29)) * 0x9E3779B97F4A7C15ULL >> 56) % kMetadataCacheSize;
+}
+
+} // namespace
+
 struct RuntimeComposerMetadatasMap {
 	QMap<uint64, RuntimeComposerMetadata*> data;
 	~RuntimeComposerMetadatasMap() {
@@ -30,6 +75,16 @@ struct RuntimeComposerMetadatasMap {
 };
 
 const RuntimeComposerMetadata *GetRuntimeComposerMetadata(uint64 mask) {
+	auto slot = MetadataCacheSlot(mask);
+	for (auto i = 0; i != kMetadataCacheSize; ++i) {
+		auto cached = MetadataCache[(slot + i) % kMetadataCacheSize].loadAcquire();
+		if (!cached) {
+			break;
+		} else if (cached->equals(mask)) {
+			return cached;
+		}
+	}
+
 	static RuntimeComposerMetadatasMap RuntimeComposerMetadatas;
 	static QMutex RuntimeComposerMetadatasMutex;
 
@@ -41,9 +96,53 @@ const RuntimeComposerMetadata *GetRuntimeComposerMetadata(uint64 mask) {
 
 		i = RuntimeComposerMetadatas.data.insert(mask, meta);
 	}
+	for (auto j = 0; j != kMetadataCacheSize; ++j) {
+		auto &entry = MetadataCache[(slot + j) % kMetadataCacheSize];
+		auto cached = entry.loadAcquire();
+		if (!cached) {
+			entry.storeRelease(i.value());
+			break;
+		} else if (cached == i.value()) {
+			break;
+		}
+	}
 	return i.value();
 }
 
+void *RuntimeComposerAllocate(std::size_t size) {
+	if (!size || size > kPoolMaxSize) {
+		return ::operator new(size);
+	}
+	auto index = (size - 1) / kPoolSizeStep;
+	auto pool = CurrentBlocksPool();
+	auto &list = pool->free[index];
+	if (list.empty()) {
+		return ::operator new((index + 1) * kPoolSizeStep);
+	}
+	auto result = list.back();
+	list.pop_back();
+	pool->kept -= (index + 1) * kPoolSizeStep;
+	return result;
+}
+
+void RuntimeComposerFree(void *data, std::size_t size) {
+	if (!data) {
+		return;
+	} else if (!size || size > kPoolMaxSize) {
+		::operator delete(data);
+		return;
+	}
+	auto index = (size - 1) / kPoolSizeStep;
+	auto blockSize = (index + 1) * kPoolSizeStep;
+	auto pool = CurrentBlocksPool();
+	if (pool->kept + blockSize > kPoolKeptBytes) {
+		::operator delete(data);
+		return;
+	}
+	pool->free[index].push_back(data);
+	pool->kept += blockSize;
+}
+
 const RuntimeComposerMetadata *RuntimeComposer::ZeroRuntimeComposerMetadata = GetRuntimeComposerMetadata(0);
 
 RuntimeComponentWrapStruct RuntimeComponentWraps[64];
@@ -146,14 +146,26 @@ private:
 
 const RuntimeComposerMetadata *GetRuntimeComposerMetadata(uint64 mask);
 
+// Small blocks are recycled through per-thread free lists of size classes,
+// both the composers themselves and their components data use them.
+void *RuntimeComposerAllocate(std::size_t size);
+void RuntimeComposerFree(void *data, std::size_t size);
+
 class RuntimeComposer {
 public:
+	static void *operator new(std::size_t size) {
+		return RuntimeComposerAllocate(size);
+	}
+	static void operator delete(void *data, std::size_t size) {
+		RuntimeComposerFree(data, size);
+	}
+
 	RuntimeComposer(uint64 mask = 0) : _data(zerodata()) {
 		if (mask) {
 			const RuntimeComposerMetadata *meta = GetRuntimeComposerMetadata(mask);
 			int size = sizeof(meta) + meta->size;
 
-			auto data = operator new(size);
+			auto data = RuntimeComposerAllocate(size);
 			t_assert(data != nullptr);
 
 			_data = data;
@@ -175,6 +187,7 @@ public:
 								RuntimeComponentWraps[i].Destruct(_dataptrunsafe(offset));
 							}
 						}
+						RuntimeComposerFree(_data, size);
 						throw;
 					}
 				}
@@ -192,7 +205,7 @@ public:
 					RuntimeComponentWraps[i].Destruct(_dataptrunsafe(offset));
 				}
 			}
-			operator delete(_data);
+			RuntimeComposerFree(_data, sizeof(meta) + meta->size);
 		}
 	}
 
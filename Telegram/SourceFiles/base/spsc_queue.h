@@ -0,0 +1,108 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop version of Telegram messaging app, see https://telegram.org
+
+Telegram Desktop is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+It is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+In addition, as a special exception, the copyright holders give permission
+to link the code of portions of this program with the OpenSSL library.
+
+Full license: https://github.com/telegramdesktop/tdesktop/blob/master/LICENSE
+Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
+*/
+#pragma once
+
+#include <atomic>
+
+namespace base {
+
+// Unbounded lock-free queue for a single producer and a single consumer thread.
+//
+// The producer only touches the tail node and the consumer only touches the
+// head node, they meet through the atomic next pointers. The producer thread
+// may change over time if the switch is synchronized some other way.
+template <typename T>
+class spsc_queue {
+public:
+	spsc_queue() : _head(new node()), _tail(_head) {
+	}
+	spsc_queue(const spsc_queue &other) = delete;
+	spsc_queue &operator=(const spsc_queue &other) = delete;
+
+	// Producer side.
+	void push(T &&value) {
+		auto added = new node(std::move(value));
+		_tail->next.store(added, std::memory_order_release);
+		_tail = added;
+		_size.fetch_add(1, std::memory_order_release);
+	}
+
+	// Consumer side.
+	bool pop(T &result) {
+		auto next = _head->next.load(std::memory_order_acquire);
+		if (!next) {
+			return false;
+		}
+		result = std::move(next->value);
+		delete _head;
+		_head = next;
+		_size.fetch_sub(1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, enumerates the values without removing them.
+	template <typename Callback>
+	void enumerate(Callback &&callback) const {
+		for (auto i = _head->next.load(std::memory_order_acquire); i; i = i->next.load(std::memory_order_acquire)) {
+			callback(static_cast<const T&>(i->value));
+		}
+	}
+
+	// Any side, the result may be outdated right away.
+	int size() const {
+		return _size.load(std::memory_order_acquire);
+	}
+	bool empty() const {
+		return (size() == 0);
+	}
+
+	// Consumer side, while the producer is not pushing.
+	void clear() {
+		auto value = T();
+		while (pop(value)) {
+		}
+	}
+
+	~spsc_queue() {
+		while (_head) {
+			auto next = _head->next.load(std::memory_order_relaxed);
+			delete _head;
+			_head = next;
+		}
+	}
+
+private:
+	struct node {
+		node() = default;
+		explicit node(T &&value) : value(std::move(value)) {
+		}
+
+		std::atomic<node*> next = { nullptr };
+		T value;
+	};
+
+	node *_head = nullptr; // consumer
+	node *_tail = nullptr; // producer
+	std::atomic<int> _size = { 0 };
+
+};
+
+} // namespace base
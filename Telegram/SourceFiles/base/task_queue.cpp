@@ -338,15 +338,16 @@ void TaskQueue::ProcessMainTasks() { // static
 	}
 }
 
-void TaskQueue::ProcessMainTasks(TimeMs max_time_spent) { // static
+bool TaskQueue::ProcessMainTasks(TimeMs max_time_spent) { // static
 	t_assert(std::this_thread::get_id() == MainThreadId);
 
 	auto start_time = getms();
 	while (ProcessOneMainTask()) {
 		if (getms() >= start_time + max_time_spent) {
-			break;
+			return true;
 		}
 	}
+	return false;
 }
 
 bool TaskQueue::ProcessOneMainTask() { // static
@@ -54,7 +54,9 @@ public:
 	void Put(Task &&task);
 
 	static void ProcessMainTasks();
-	static void ProcessMainTasks(TimeMs max_time_spent);
+
+	// Returns true if it has stopped because of the time limit.
+	static bool ProcessMainTasks(TimeMs max_time_spent);
 
 	~TaskQueue();
 
@@ -325,13 +325,12 @@ enum {
     DocumentUploadPartSize4 = 512 * 1024, // 512kb for large document ( <= 1500mb )
     UploadRequestInterval = 500, // one part each half second, if not uploaded faster
 
-	MaxPhotosInMemory = 50, // try to clear some memory after 50 photos are created
 	NoUpdatesTimeout = 60 * 1000, // if nothing is received in 1 min we ping
 	NoUpdatesAfterSleepTimeout = 60 * 1000, // if nothing is received in 1 min when was a sleepmode we ping
 	WaitForSkippedTimeout = 1000, // 1s wait for skipped seq or pts in updates
 	WaitForChannelGetDifference = 1000, // 1s wait after show channel history before sending getChannelDifference
 
-	MemoryForImageCache = 64 * 1024 * 1024, // after 64mb of unpacked images we try to clear some memory
+	MemoryForImageCache = 128 * 1024 * 1024, // after 128mb of unpacked images we forget the least recently painted ones
 	NotifySettingSaveTimeout = 1000, // wait 1 second before saving notify setting to server
 	UpdateChunk = 100 * 1024, // 100kb parts when downloading the update
 	IdleMsecs = 60 * 1000, // after 60secs without user input we think we are idle
@@ -0,0 +1,128 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop version of Telegram messaging app, see https://telegram.org
+
+Telegram Desktop is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+It is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+In addition, as a special exception, the copyright holders give permission
+to link the code of portions of this program with the OpenSSL library.
+
+Full license: https://github.com/telegramdesktop/tdesktop/blob/master/LICENSE
+Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
+*/
+#include "data/data_messages_index.h"
+
+#include "history/history_item.h"
+
+namespace Data {
+namespace {
+
+QStringList SplitWords(const QString &text) {
+	auto result = textSearchKey(text).split(cWordSplit(), QString::SkipEmptyParts);
+	result.removeDuplicates();
+	return result;
+}
+
+bool HasWordWithPrefix(const QStringList &words, const QString &prefix) {
+	for_const (auto &word, words) {
+		if (word.startsWith(prefix)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+} // namespace
+
+void MessagesIndex::add(gsl::not_null<HistoryItem*> item, const QString &text) {
+	remove(item);
+
+	auto words = SplitWords(text);
+	if (words.isEmpty()) {
+		return;
+	}
+	for_const (auto &word, words) {
+		_items[word].insert(item);
+	}
+	_words.emplace(item, std::move(words));
+}
+
+void MessagesIndex::remove(gsl::not_null<HistoryItem*> item) {
+	auto i = _words.find(item);
+	if (i == _words.cend()) {
+		return;
+	}
+	for_const (auto &word, i->second) {
+		auto j = _items.find(word);
+		if (j != _items.cend()) {
+			j->second.erase(item);
+			if (j->second.empty()) {
+				_items.erase(j);
+			}
+		}
+	}
+	_words.erase(i);
+}
+
+std::vector<HistoryItem*> MessagesIndex::search(const QString &query, PeerData *inPeer, int limit) const {
+	auto result = std::vector<HistoryItem*>();
+	auto words = SplitWords(query);
+	if (words.isEmpty() || limit <= 0) {
+		return result;
+	}
+
+	// The longest word has the fewest matching prefixes, collect the
+	// candidates with it and check the other words on each candidate.
+	auto longest = std::max_element(words.cbegin(), words.cend(), [](const QString &a, const QString &b) {
+		return a.size() < b.size();
+	});
+	auto first = *longest;
+	words.erase(longest);
+
+	auto migrated = inPeer ? inPeer->migrateFrom() : nullptr;
+	auto good = [inPeer, migrated](HistoryItem *item) {
+		if (!inPeer) {
+			return true;
+		}
+		auto peer = item->history()->peer;
+		return (peer == inPeer) || (migrated && peer == migrated);
+	};
+	for (auto i = _items.lower_bound(first), e = _items.cend(); i != e && i->first.startsWith(first); ++i) {
+		for (auto item : i->second) {
+			if (good(item)) {
+				result.push_back(item);
+			}
+		}
+	}
+	if (!words.isEmpty()) {
+		result.erase(std::remove_if(result.begin(), result.end(), [this, &words](HistoryItem *item) {
+			auto &itemWords = _words.find(item)->second;
+			for_const (auto &word, words) {
+				if (!HasWordWithPrefix(itemWords, word)) {
+					return true;
+				}
+			}
+			return false;
+		}), result.end());
+	}
+
+	// The same message could be found by several indexed words.
+	std::sort(result.begin(), result.end(), [](HistoryItem *a, HistoryItem *b) {
+		return (a->date > b->date) || (a->date == b->date && a < b);
+	});
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+	if (result.size() > size_t(limit)) {
+		result.erase(result.begin() + limit, result.end());
+	}
+	return result;
+}
+
+} // namespace Data
@@ -0,0 +1,47 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop version of Telegram messaging app, see https://telegram.org
+
+Telegram Desktop is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+It is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+In addition, as a special exception, the copyright holders give permission
+to link the code of portions of this program with the OpenSSL library.
+
+Full license: https://github.com/telegramdesktop/tdesktop/blob/master/LICENSE
+Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
+*/
+#pragma once
+
+#include <map>
+#include <set>
+
+namespace Data {
+
+// Inverted index over the texts of the messages that are currently loaded.
+// Words are stored by textSearchKey(), so a query word matches every
+// indexed word starting with it, ignoring case and accents.
+class MessagesIndex {
+public:
+	void add(gsl::not_null<HistoryItem*> item, const QString &text);
+	void remove(gsl::not_null<HistoryItem*> item);
+
+	// Returns the newest messages containing all words of the query,
+	// searching only in inPeer (and the group it migrated from) if it is set.
+	std::vector<HistoryItem*> search(const QString &query, PeerData *inPeer, int limit) const;
+
+private:
+	using Items = std::set<HistoryItem*>;
+	std::map<QString, Items> _items;
+	std::map<HistoryItem*, QStringList> _words;
+
+};
+
+} // namespace Data
@@ -38,6 +38,7 @@ RowsByLetter IndexedList::addToEnd(History *history) {
 			}
 			result.insert(ch, j.value()->addToEnd(history));
 		}
+		indexNames(history->peer->id, history->peer->names);
 	}
 	return result;
 }
@@ -55,6 +56,7 @@ Row *IndexedList::addByName(History *history) {
 		}
 		j.value()->addByName(history);
 	}
+	indexNames(history->peer->id, history->peer->names);
 	return result;
 }
 
@@ -117,6 +119,9 @@ void IndexedList::adjustByName(PeerData *peer, const PeerData::Names &oldNames,
 	Row *mainRow = _list.adjustByName(peer);
 	if (!mainRow) return;
 
+	unindexNames(peer->id, oldNames);
+	indexNames(peer->id, peer->names);
+
 	History *history = mainRow->history();
 
 	PeerData::NameFirstChars toRemove = oldChars, toAdd;
@@ -151,6 +156,9 @@ void IndexedList::adjustNames(Mode list, PeerData *peer, const PeerData::Names &
 	auto mainRow = _list.getRow(peer->id);
 	if (!mainRow) return;
 
+	unindexNames(peer->id, oldNames);
+	indexNames(peer->id, peer->names);
+
 	History *history = mainRow->history();
 
 	PeerData::NameFirstChars toRemove = oldChars, toAdd;
@@ -189,6 +197,7 @@ void IndexedList::del(const PeerData *peer, Row *replacedBy) {
 				list->del(peer->id, replacedBy);
 			}
 		}
+		unindexNames(peer->id, peer->names);
 	}
 }
 
@@ -196,6 +205,69 @@ void IndexedList::clear() {
 	for_const (auto &list, _index) {
 		delete list;
 	}
+	_names.clear();
+}
+
+std::vector<Row*> IndexedList::filtered(const QStringList &words) const {
+	auto result = std::vector<Row*>();
+	if (words.isEmpty()) {
+		return result;
+	}
+
+	// Longer words match fewer names, start from them to keep the sets small.
+	auto sorted = words;
+	std::sort(sorted.begin(), sorted.end(), [](const QString &a, const QString &b) {
+		return a.size() > b.size();
+	});
+	auto peers = std::set<PeerId>();
+	for (auto i = sorted.cbegin(), e = sorted.cend(); i != e; ++i) {
+		auto &word = *i;
+		auto found = std::set<PeerId>();
+		for (auto j = _names.lower_bound(word), end = _names.cend(); j != end && j->first.startsWith(word); ++j) {
+			if (i == sorted.cbegin()) {
+				found.insert(j->second.cbegin(), j->second.cend());
+			} else {
+				for (auto peerId : j->second) {
+					if (peers.find(peerId) != peers.cend()) {
+						found.insert(peerId);
+					}
+				}
+			}
+		}
+		peers = std::move(found);
+		if (peers.empty()) {
+			return result;
+		}
+	}
+
+	result.reserve(peers.size());
+	for (auto peerId : peers) {
+		if (auto row = _list.getRow(peerId)) {
+			result.push_back(row);
+		}
+	}
+	std::sort(result.begin(), result.end(), [](Row *a, Row *b) {
+		return a->pos() < b->pos();
+	});
+	return result;
+}
+
+void IndexedList::indexNames(PeerId peerId, const PeerData::Names &names) {
+	for_const (auto &name, names) {
+		_names[name].insert(peerId);
+	}
+}
+
+void IndexedList::unindexNames(PeerId peerId, const PeerData::Names &names) {
+	for_const (auto &name, names) {
+		auto i = _names.find(name);
+		if (i != _names.cend()) {
+			i->second.erase(peerId);
+			if (i->second.empty()) {
+				_names.erase(i);
+			}
+		}
+	}
 }
 
 IndexedList::~IndexedList() {
@@ -23,6 +23,9 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "dialogs/dialogs_common.h"
 #include "dialogs/dialogs_list.h"
 
+#include <map>
+#include <set>
+
 class History;
 
 namespace Dialogs {
@@ -56,6 +59,9 @@ public:
 		return _index.value(ch, empty.data());
 	}
 
+	// Rows of all() with a name starting with each of the words, in the all() order.
+	std::vector<Row*> filtered(const QStringList &words) const;
+
 	~IndexedList();
 
 	// Part of List interface is duplicated here for all() list.
@@ -83,12 +89,18 @@ public:
 private:
 	void adjustByName(PeerData *peer, const PeerData::Names &oldNames, const PeerData::NameFirstChars &oldChars);
 	void adjustNames(Mode list, PeerData *peer, const PeerData::Names &oldNames, const PeerData::NameFirstChars &oldChars);
+	void indexNames(PeerId peerId, const PeerData::Names &names);
+	void unindexNames(PeerId peerId, const PeerData::Names &names);
 
 	SortMode _sortMode;
 	List _list;
 	using Index = QMap<QChar, List*>;
 	Index _index;
 
+	// Sorted by the name words, so all words with some prefix are adjacent.
+	using NamesIndex = std::map<QString, std::set<PeerId>>;
+	NamesIndex _names;
+
 };
 
 } // namespace Dialogs
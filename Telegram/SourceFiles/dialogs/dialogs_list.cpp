@@ -27,92 +27,50 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 namespace Dialogs {
 
 List::List(SortMode sortMode)
-: _last(std::make_unique<Row>(nullptr, nullptr, nullptr, 0))
-, _begin(_last.get())
-, _end(_last.get())
-, _sortMode(sortMode)
-, _current(_last.get()) {
-}
-
-void List::adjustCurrent(int32 y, int32 h) const {
-	if (isEmpty()) return;
-
-	int32 pos = (y > 0) ? (y / h) : 0;
-	while (_current->_pos > pos && _current != _begin) {
-		_current = _current->_prev;
-	}
-	while (_current->_pos + 1 <= pos && _current->_next != _end) {
-		_current = _current->_next;
-	}
+: _sortMode(sortMode) {
 }
 
 Row *List::addToEnd(History *history) {
-	Row *result = new Row(history, _end->_prev, _end, _end->_pos);
-	_end->_pos++;
-	if (_begin == _end) {
-		_begin = _current = result;
-	} else {
-		_end->_prev->_next = result;
-	}
+	auto result = new Row(history, size());
+	_rows.push_back(result);
 	_rowByPeer.insert(history->peer->id, result);
-	++_count;
-	_end->_prev = result;
 	if (_sortMode == SortMode::Date) {
 		adjustByPos(result);
 	}
 	return result;
 }
 
-bool List::insertBefore(Row *row, Row *before) {
-	if (row == before) return false;
-
-	if (_current == row) {
-		_current = row->_prev;
-	}
-
-	Row *updateTill = row->_prev;
-	remove(row);
+bool List::moveRow(Row *row, int to) {
+	auto from = row->_pos;
+	if (from == to) return false;
 
-	// insert row
-	row->_next = before; // update row
-	row->_prev = before->_prev;
-	row->_next->_prev = row; // update row->next
-	if (row->_prev) { // update row->prev
-		row->_prev->_next = row;
+	auto b = _rows.begin();
+	if (from < to) {
+		std::rotate(b + from, b + from + 1, b + to + 1);
 	} else {
-		_begin = row;
+		std::rotate(b + to, b + from, b + from + 1);
 	}
-
-	// update y
-	for (Row *n = row; n != updateTill; n = n->_next) {
-		n->_next->_pos++;
-		row->_pos--;
+	for (auto i = qMin(from, to), till = qMax(from, to); i <= till; ++i) {
+		_rows[i]->_pos = i;
 	}
 	return true;
 }
 
-bool List::insertAfter(Row *row, Row *after) {
-	if (row == after) return false;
-
-	if (_current == row) {
-		_current = row->_next;
-	}
-
-	Row *updateFrom = row->_next;
-	remove(row);
-
-	// insert row
-	row->_prev = after; // update row
-	row->_next = after->_next;
-	row->_prev->_next = row; // update row->prev
-	row->_next->_prev = row; // update row->next
-
-	// update y
-	for (Row *n = updateFrom; n != row; n = n->_next) {
-		n->_pos--;
-		row->_pos++;
-	}
-	return true;
+template <typename Before>
+void List::reorder(Row *row, Before before) {
+	// The rows are kept sorted, so the new place is found by a binary search.
+	auto b = _rows.begin(), e = _rows.end();
+	auto from = row->_pos;
+	auto above = std::partition_point(b, b + from, [row, &before](Row *other) {
+		return !before(row, other);
+	});
+	if (moveRow(row, above - b)) {
+		return;
+	}
+	auto below = std::partition_point(b + from + 1, e, [row, &before](Row *other) {
+		return before(other, row);
+	});
+	moveRow(row, (below - b) - 1);
 }
 
 Row *List::adjustByName(const PeerData *peer) {
@@ -121,64 +79,36 @@ Row *List::adjustByName(const PeerData *peer) {
 	auto i = _rowByPeer.find(peer->id);
 	if (i == _rowByPeer.cend()) return nullptr;
 
-	Row *row = i.value(), *change = row;
-	while (change->_prev && change->_prev->history()->peer->name > peer->name) {
-		change = change->_prev;
-	}
-	if (!insertBefore(row, change)) {
-		while (change->_next != _end && change->_next->history()->peer->name < peer->name) {
-			change = change->_next;
-		}
-		insertAfter(row, change);
-	}
+	auto row = i.value();
+	reorder(row, [](Row *a, Row *b) {
+		return a->history()->peer->name < b->history()->peer->name;
+	});
 	return row;
 }
 
 Row *List::addByName(History *history) {
 	if (_sortMode != SortMode::Name) return nullptr;
 
-	Row *row = addToEnd(history), *change = row;
-	const QString &peerName(history->peer->name);
-	while (change->_prev && change->_prev->history()->peer->name.compare(peerName, Qt::CaseInsensitive) > 0) {
-		change = change->_prev;
-	}
-	if (!insertBefore(row, change)) {
-		while (change->_next != _end && change->_next->history()->peer->name.compare(peerName, Qt::CaseInsensitive) < 0) {
-			change = change->_next;
-		}
-		insertAfter(row, change);
-	}
+	auto row = addToEnd(history);
+	reorder(row, [](Row *a, Row *b) {
+		return a->history()->peer->name.compare(b->history()->peer->name, Qt::CaseInsensitive) < 0;
+	});
 	return row;
 }
 
 void List::adjustByPos(Row *row) {
-	if (_sortMode != SortMode::Date || !_begin) return;
+	if (_sortMode != SortMode::Date) return;
 
-	Row *change = row;
-	if (change != _begin && _begin->history()->sortKeyInChatList() < row->history()->sortKeyInChatList()) {
-		change = _begin;
-	} else {
-		while (change->_prev && change->_prev->history()->sortKeyInChatList() < row->history()->sortKeyInChatList()) {
-			change = change->_prev;
-		}
-	}
-	if (!insertBefore(row, change)) {
-		if (change->_next != _end && _end->_prev->history()->sortKeyInChatList() > row->history()->sortKeyInChatList()) {
-			change = _end->_prev;
-		} else {
-			while (change->_next != _end && change->_next->history()->sortKeyInChatList() > row->history()->sortKeyInChatList()) {
-				change = change->_next;
-			}
-		}
-		insertAfter(row, change);
-	}
+	reorder(row, [](Row *a, Row *b) {
+		return a->history()->sortKeyInChatList() > b->history()->sortKeyInChatList();
+	});
 }
 
 bool List::moveToTop(PeerId peerId) {
 	auto i = _rowByPeer.find(peerId);
 	if (i == _rowByPeer.cend()) return false;
 
-	insertBefore(i.value(), _begin);
+	moveRow(i.value(), 0);
 	return true;
 }
 
@@ -191,39 +121,22 @@ bool List::del(PeerId peerId, Row *replacedBy) {
 		emit App::main()->dialogRowReplaced(row, replacedBy);
 	}
 
-	if (row == _current) {
-		_current = row->_next;
+	auto pos = row->_pos;
+	_rows.erase(_rows.begin() + pos);
+	for (auto till = size(); pos != till; ++pos) {
+		_rows[pos]->_pos = pos;
 	}
-	for (auto change = row->_next; change != _end; change = change->_next) {
-		--change->_pos;
-	}
-	--_end->_pos;
-	remove(row);
 	delete row;
-	--_count;
 	_rowByPeer.erase(i);
 
 	return true;
 }
 
-void List::remove(Row *row) {
-	row->_next->_prev = row->_prev; // update row->next
-	if (row->_prev) { // update row->prev
-		row->_prev->_next = row->_next;
-	} else {
-		_begin = row->_next;
-	}
-}
-
 void List::clear() {
-	while (_begin != _end) {
-		_current = _begin;
-		_begin = _begin->_next;
-		delete _current;
+	for (auto row : base::take(_rows)) {
+		delete row;
 	}
-	_current = _begin;
 	_rowByPeer.clear();
-	_count = 0;
 }
 
 List::~List() {
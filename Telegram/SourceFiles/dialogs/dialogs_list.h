@@ -32,7 +32,7 @@ public:
 	List &operator=(const List &other) = delete;
 
 	int size() const {
-		return _count;
+		return int(_rows.size());
 	}
 	bool isEmpty() const {
 		return size() == 0;
@@ -44,11 +44,8 @@ public:
 		return _rowByPeer.value(peerId);
 	}
 	Row *rowAtY(int32 y, int32 h) const {
-		auto i = cfind(y, h);
-		if (i == cend() || (*i)->pos() != ((y > 0) ? (y / h) : 0)) {
-			return nullptr;
-		}
-		return *i;
+		auto pos = (y > 0) ? (y / h) : 0;
+		return (pos < size()) ? _rows[pos] : nullptr;
 	}
 
 	Row *addToEnd(History *history);
@@ -57,7 +54,6 @@ public:
 	bool moveToTop(PeerId peerId);
 	void adjustByPos(Row *row);
 	bool del(PeerId peerId, Row *replacedBy = nullptr);
-	void remove(Row *row);
 	void clear();
 
 	class const_iterator {
@@ -66,71 +62,62 @@ public:
 		using pointer = Row**;
 		using reference = Row*&;
 
-		explicit const_iterator(Row *p) : _p(p) {
+		const_iterator(const List *list, int index) : _list(list), _index(index) {
 		}
-		inline Row* operator*() const { return _p; }
-		inline Row* const* operator->() const { return &_p; }
-		inline bool operator==(const const_iterator &other) const { return _p == other._p; }
+		inline Row* operator*() const { return _list->_rows[_index]; }
+		inline Row* const* operator->() const { return &_list->_rows[_index]; }
+		inline bool operator==(const const_iterator &other) const { return _index == other._index; }
 		inline bool operator!=(const const_iterator &other) const { return !(*this == other); }
-		inline const_iterator &operator++() { _p = next(_p); return *this; }
+		inline const_iterator &operator++() { ++_index; return *this; }
 		inline const_iterator operator++(int) { const_iterator result(*this); ++(*this); return result; }
-		inline const_iterator &operator--() { _p = prev(_p); return *this; }
+		inline const_iterator &operator--() { --_index; return *this; }
 		inline const_iterator operator--(int) { const_iterator result(*this); --(*this); return result; }
 		inline const_iterator operator+(int j) const { const_iterator result = *this; return result += j; }
 		inline const_iterator operator-(int j) const { const_iterator result = *this; return result -= j; }
-		inline const_iterator &operator+=(int j) { if (j < 0) return (*this -= (-j)); while (j--) ++*this; return *this; }
-		inline const_iterator &operator-=(int j) { if (j < 0) return (*this += (-j)); while (j--) --*this; return *this; }
+		inline const_iterator &operator+=(int j) { _index += j; return *this; }
+		inline const_iterator &operator-=(int j) { _index -= j; return *this; }
 
 	private:
-		Row *_p;
+		const List *_list;
+		int _index;
 		friend class List;
 
 	};
 	friend class const_iterator;
 	using iterator = const_iterator;
 
-	const_iterator cbegin() const { return const_iterator(_begin); }
-	const_iterator cend() const { return const_iterator(_end); }
+	const_iterator cbegin() const { return const_iterator(this, 0); }
+	const_iterator cend() const { return const_iterator(this, size()); }
 	const_iterator begin() const { return cbegin(); }
 	const_iterator end() const { return cend(); }
-	iterator begin() { return iterator(_begin); }
-	iterator end() { return iterator(_end); }
-	const_iterator cfind(Row *value) const { return value ? const_iterator(value) : cend(); }
+	iterator begin() { return cbegin(); }
+	iterator end() { return cend(); }
+	const_iterator cfind(Row *value) const { return value ? const_iterator(this, value->_pos) : cend(); }
 	const_iterator find(Row *value) const { return cfind(value); }
-	iterator find(Row *value) { return value ? iterator(value) : end(); }
+	iterator find(Row *value) { return cfind(value); }
 	const_iterator cfind(int y, int h) const {
-		adjustCurrent(y, h);
-		return iterator(_current);
+		if (isEmpty()) return cend();
+		auto pos = (y > 0) ? (y / h) : 0;
+		return const_iterator(this, qMin(pos, size() - 1));
 	}
 	const_iterator find(int y, int h) const { return cfind(y, h); }
-	iterator find(int y, int h) {
-		adjustCurrent(y, h);
-		return iterator(_current);
-	}
+	iterator find(int y, int h) { return cfind(y, h); }
 
 	~List();
 
 private:
-	void adjustCurrent(int y, int h) const;
-	bool insertBefore(Row *row, Row *before);
-	bool insertAfter(Row *row, Row *after);
-	static Row *next(Row *row) {
-		return row->_next;
-	}
-	static Row *prev(Row *row) {
-		return row->_prev;
-	}
+	// Moves the row up or down to keep all rows ordered by before(a, b).
+	template <typename Before>
+	void reorder(Row *row, Before before);
+	bool moveRow(Row *row, int to);
 
-	std::unique_ptr<Row> _last;
-	Row *_begin;
-	Row *_end;
+	// Rows by their position, so Row::_pos always equals the index here.
+	std::vector<Row*> _rows;
 	SortMode _sortMode;
-	int _count = 0;
 
 	typedef QHash<PeerId, Row*> RowByPeer;
 	RowByPeer _rowByPeer;
 
-	mutable Row *_current; // cache
 };
 
 } // namespace Dialogs
@@ -52,10 +52,8 @@ private:
 class List;
 class Row : public RippleRow {
 public:
-	Row(History *history, Row *prev, Row *next, int pos)
+	Row(History *history, int pos)
 		: _history(history)
-		, _prev(prev)
-		, _next(next)
 		, _pos(pos) {
 	}
 	void *attached = nullptr; // for any attached data, for example View in contacts list
@@ -71,7 +69,6 @@ private:
 	friend class List;
 
 	History *_history;
-	Row *_prev, *_next;
 	int _pos;
 
 };
@@ -28,6 +28,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "ui/widgets/buttons.h"
 #include "ui/widgets/popup_menu.h"
 #include "data/data_drafts.h"
+#include "data/data_messages_index.h"
 #include "lang.h"
 #include "application.h"
 #include "mainwindow.h"
@@ -1262,77 +1263,19 @@ void DialogsInner::onFilterUpdate(QString newFilter, bool force) {
 				_lastSearchPeer = 0;
 				_lastSearchId = _lastSearchMigratedId = 0;
 			} else {
-				QStringList::const_iterator fb = f.cbegin(), fe = f.cend(), fi;
-
 				_state = FilteredState;
 				_filterResults.clear();
 				if (!_searchInPeer && !f.isEmpty()) {
-					const Dialogs::List *toFilter = nullptr;
-					if (!_dialogs->isEmpty()) {
-						for (fi = fb; fi != fe; ++fi) {
-							auto found = _dialogs->filtered(fi->at(0));
-							if (found->isEmpty()) {
-								toFilter = nullptr;
-								break;
-							}
-							if (!toFilter || toFilter->size() > found->size()) {
-								toFilter = found;
-							}
-						}
-					}
-					const Dialogs::List *toFilterContacts = nullptr;
-					if (!_contactsNoDialogs->isEmpty()) {
-						for (fi = fb; fi != fe; ++fi) {
-							auto found = _contactsNoDialogs->filtered(fi->at(0));
-							if (found->isEmpty()) {
-								toFilterContacts = nullptr;
-								break;
-							}
-							if (!toFilterContacts || toFilterContacts->size() > found->size()) {
-								toFilterContacts = found;
-							}
-						}
-					}
-					_filterResults.reserve((toFilter ? toFilter->size() : 0) + (toFilterContacts ? toFilterContacts->size() : 0));
-					if (toFilter) {
-						for_const (auto row, *toFilter) {
-							const PeerData::Names &names(row->history()->peer->names);
-							PeerData::Names::const_iterator nb = names.cbegin(), ne = names.cend(), ni;
-							for (fi = fb; fi != fe; ++fi) {
-								QString filterName(*fi);
-								for (ni = nb; ni != ne; ++ni) {
-									if (ni->startsWith(*fi)) {
-										break;
-									}
-								}
-								if (ni == ne) {
-									break;
-								}
-							}
-							if (fi == fe) {
-								_filterResults.push_back(row);
-							}
-						}
+					// The lists are queried each time, so that the rows added
+					// or renamed while typing and the current order are used.
+					auto dialogs = _dialogs->filtered(f);
+					auto contacts = _contactsNoDialogs->filtered(f);
+					_filterResults.reserve(int(dialogs.size() + contacts.size()));
+					for (auto row : dialogs) {
+						_filterResults.push_back(row);
 					}
-					if (toFilterContacts) {
-						for_const (auto row, *toFilterContacts) {
-							const PeerData::Names &names(row->history()->peer->names);
-							PeerData::Names::const_iterator nb = names.cbegin(), ne = names.cend(), ni;
-							for (fi = fb; fi != fe; ++fi) {
-								QString filterName(*fi);
-								for (ni = nb; ni != ne; ++ni) {
-									if (ni->startsWith(*fi)) {
-										break;
-									}
-								}
-								if (ni == ne) {
-									break;
-								}
-							}
-							if (fi == fe) {
-								_filterResults.push_back(row);
-							}
-						}
+					for (auto row : contacts) {
+						_filterResults.push_back(row);
 					}
 				}
 			}
@@ -1540,6 +1483,18 @@ bool DialogsInner::searchReceived(const QVector<MTPMessage> &messages, DialogsSe
 	return lastDateFound != 0;
 }
 
+void DialogsInner::localSearchReceived(const std::vector<HistoryItem*> &result) {
+	clearSearchResults(false);
+	for (auto item : result) {
+		_searchResults.push_back(std::make_unique<Dialogs::FakeRow>(item));
+	}
+	_searchedCount = int(_searchResults.size());
+	if (_state == FilteredState && !_searchResults.empty()) {
+		_state = SearchedState;
+	}
+	refresh();
+}
+
 void DialogsInner::peerSearchReceived(const QString &query, const QVector<MTPPeer> &result) {
 	_peerSearchQuery = query.toLower().trimmed();
 	_peerSearchResults.clear();
@@ -2672,6 +2627,11 @@ bool DialogsWidget::onSearchMessages(bool searchCache) {
 
 void DialogsWidget::onNeedSearchMessages() {
 	if (!onSearchMessages(true)) {
+		// Show the already loaded messages until the server answers.
+		auto query = _filter->getLastText().trimmed();
+		if (query != _searchQuery) {
+			_inner->localSearchReceived(AuthSession::Current().messagesIndex().search(query, _searchInPeer, SearchPerPage));
+		}
 		_searchTimer.start(AutoSearchTimeout);
 	}
 }
@@ -2721,6 +2681,10 @@ void DialogsWidget::onSearchMore() {
 	}
 }
 
+bool DialogsWidget::hasSearchResults() const {
+	return _inner->hasSearchResults();
+}
+
 void DialogsWidget::loadDialogs() {
 	if (_dialogsRequestId) return;
 	if (_dialogsFull) {
@@ -64,6 +64,7 @@ public:
 	void addSavedPeersAfter(const QDateTime &date);
 	void addAllSavedPeers();
 	bool searchReceived(const QVector<MTPMessage> &result, DialogsSearchRequestType type, int32 fullCount);
+	void localSearchReceived(const std::vector<HistoryItem*> &result);
 	void peerSearchReceived(const QString &query, const QVector<MTPPeer> &result);
 	void showMore(int32 pixels);
 
@@ -111,6 +112,9 @@ public:
 	void setState(State newState);
 	State state() const;
 	bool hasFilteredResults() const;
+	bool hasSearchResults() const {
+		return !_searchResults.empty();
+	}
 
 	void searchInPeer(PeerData *peer);
 
@@ -346,6 +350,7 @@ public:
 
 	void searchMessages(const QString &query, PeerData *inPeer = 0);
 	void onSearchMore();
+	bool hasSearchResults() const;
 
 	void notify_userIsContactChanged(UserData *user, bool fromThisApp);
 	void notify_historyMuteUpdated(History *history);
@@ -497,6 +497,8 @@ void WorkingDirReady() {
 	}
 }
 
+constexpr auto kMainThreadTasksTimeout = TimeMs(8);
+
 object_ptr<SingleQueuedInvokation> MainThreadTaskHandler = { nullptr };
 
 void MainThreadTaskAdded() {
@@ -509,7 +511,10 @@ void MainThreadTaskAdded() {
 
 void start() {
 	MainThreadTaskHandler.create([] {
-		base::TaskQueue::ProcessMainTasks();
+		// Long sequences of tasks are processed in slices, so that they don't block painting.
+		if (base::TaskQueue::ProcessMainTasks(kMainThreadTasksTimeout)) {
+			MainThreadTaskHandler->call();
+		}
 	});
 	SandboxData = std::make_unique<internal::Data>();
 
@@ -2007,6 +2007,7 @@ void History::clear(bool leaveItems) {
 	if (leaveItems) {
 		lastKeyboardInited = false;
 	} else {
+		Local::clearHistoryCache(peer->id);
 		setUnreadCount(0);
 		if (peer->isMegagroup()) {
 			peer->asChannel()->mgInfo->pinnedMsgId = 0;
@@ -2045,6 +2046,86 @@ void History::clearOnDestroy() {
 	clearBlocks(false);
 }
 
+bool History::canDestroyUnloadedItem(HistoryItem *item) const {
+	if (item->id <= 0 || item->id > ServerMaxMsgId) {
+		return false;
+	} else if (item == lastMsg || item->id == lastKeyboardId || item->unread()) {
+		return false;
+	} else if (notifies.contains(item) || App::historyHasDependent(item)) {
+		return false;
+	} else if (peer->isMegagroup() && peer->asChannel()->mgInfo->pinnedMsgId == item->id) {
+		return false;
+	}
+	if (auto media = item->getMedia()) {
+		if (media->type() == MediaTypeCall) {
+			return false;
+		}
+	}
+	for (auto i = 0; i != OverviewCount; ++i) {
+		if (overviewHasMsgId(i, item->id)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int History::unloadOldBlocks(int keepItemsCount) {
+	if (isBuildingFrontBlock()) {
+		return 0;
+	}
+
+	auto keepFrom = blocks.size();
+	for (auto kept = 0; keepFrom > 0 && kept < keepItemsCount;) {
+		kept += blocks[--keepFrom]->items.size();
+	}
+	for (auto item : { scrollTopItem, showFrom, unreadBar }) {
+		if (item && item->block()) {
+			accumulate_min(keepFrom, item->block()->indexInHistory());
+		}
+	}
+	if (keepFrom <= 0) {
+		return 0;
+	}
+	oldLoaded = false;
+
+	auto &pending = Global::RefPendingRepaintItems();
+	auto result = 0;
+	for (; keepFrom > 0; --keepFrom) {
+		auto block = blocks.front();
+		for (auto left = block->items.size(); left > 0; --left) {
+			auto item = block->items.front();
+			auto destroy = canDestroyUnloadedItem(item);
+			item->detach();
+			if (destroy) {
+				if (textCachedFor == item) {
+					textCachedFor = nullptr;
+				}
+				pending.remove(item);
+				delete item;
+				++result;
+			}
+		}
+	}
+	return result;
+}
+
+History::MemoryUsage History::memoryUsage() const {
+	auto result = MemoryUsage();
+	result.blocks = blocks.size();
+	result.bytes = sizeof(History) + lastItemTextCache.memoryUsage() + cloudDraftTextCache.memoryUsage();
+	for_const (auto block, blocks) {
+		result.items += block->items.size();
+		result.bytes += sizeof(HistoryBlock) + block->items.capacity() * sizeof(HistoryItem*);
+		for_const (auto item, block->items) {
+			if (item->getMedia()) {
+				++result.media;
+			}
+			result.bytes += item->memoryUsage();
+		}
+	}
+	return result;
+}
+
 History::PositionInChatListChange History::adjustByPosInChatList(Dialogs::Mode list, Dialogs::IndexedList *indexed) {
 	t_assert(indexed != nullptr);
 	Dialogs::Row *lnk = mainChatListLink(list);
@@ -220,6 +220,20 @@ public:
 
 	void clear(bool leaveItems = false);
 
+	// Removes the oldest blocks while more than keepItemsCount items stay loaded.
+	// Items nothing else refers to are destroyed, the rest are only detached.
+	// The removed part is requested from the server again when scrolled to.
+	// Returns the count of the destroyed items.
+	int unloadOldBlocks(int keepItemsCount);
+
+	struct MemoryUsage {
+		int blocks = 0;
+		int items = 0;
+		int media = 0;
+		int64 bytes = 0;
+	};
+	MemoryUsage memoryUsage() const;
+
 	virtual ~History();
 
 	HistoryItem *addNewService(MsgId msgId, QDateTime date, const QString &text, MTPDmessage::Flags flags = 0, bool newMsg = true);
@@ -486,6 +500,7 @@ protected:
 	void removeBlock(HistoryBlock *block);
 
 	void clearBlocks(bool leaveItems);
+	bool canDestroyUnloadedItem(HistoryItem *item) const;
 
 	HistoryItem *createItem(const MTPMessage &msg, bool applyServiceAction, bool detachExistingItem);
 	HistoryItem *createItemForwarded(MsgId id, MTPDmessage::Flags flags, QDateTime date, int32 from, HistoryMessage *msg);
@@ -850,6 +850,11 @@ public:
 		return _text.isEmpty() && !_media;
 	}
 
+	// Approximate heap usage of the item and its text layout, without media.
+	int memoryUsage() const {
+		return sizeof(HistoryItem) + _text.memoryUsage();
+	}
+
 	void clipCallback(Media::Clip::Notification notification);
 
 	~HistoryItem();
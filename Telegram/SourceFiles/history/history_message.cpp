@@ -32,6 +32,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "styles/style_widgets.h"
 #include "styles/style_history.h"
 #include "window/notifications_manager.h"
+#include "data/data_messages_index.h"
 
 namespace {
 
@@ -1104,10 +1105,12 @@ void HistoryMessage::setText(const TextWithEntities &textWithEntities) {
 		_textWidth = -1;
 		_textHeight = 0;
 	}
+	AuthSession::Current().messagesIndex().add(this, textWithEntities.text);
 }
 
 void HistoryMessage::setEmptyText() {
 	_text.setMarkedText(st::messageTextStyle, { QString(), EntitiesInText() }, itemTextOptions(this));
+	AuthSession::Current().messagesIndex().remove(this);
 
 	_textWidth = -1;
 	_textHeight = 0;
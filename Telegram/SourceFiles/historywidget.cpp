@@ -90,6 +90,29 @@ ApiWrap::RequestMessageDataCallback replyEditMessageDataCallback() {
 	};
 }
 
+// The cached users and chats could be outdated, so they only fill the unknown ones.
+void feedCachedPeers(const MTPDmessages_messages &data) {
+	for_const (auto &user, data.vusers.v) {
+		auto userId = (user.type() == mtpc_user) ? user.c_user().vid.v : user.c_userEmpty().vid.v;
+		if (!App::userLoaded(userId)) {
+			App::feedUser(user);
+		}
+	}
+	for_const (auto &chat, data.vchats.v) {
+		auto peerId = PeerId(0);
+		switch (chat.type()) {
+		case mtpc_chat: peerId = peerFromChat(chat.c_chat().vid); break;
+		case mtpc_chatEmpty: peerId = peerFromChat(chat.c_chatEmpty().vid); break;
+		case mtpc_chatForbidden: peerId = peerFromChat(chat.c_chatForbidden().vid); break;
+		case mtpc_channel: peerId = peerFromChannel(chat.c_channel().vid); break;
+		case mtpc_channelForbidden: peerId = peerFromChannel(chat.c_channelForbidden().vid); break;
+		}
+		if (peerId && !App::peerLoaded(peerId)) {
+			App::feedChat(chat);
+		}
+	}
+}
+
 MTPVector<MTPDocumentAttribute> composeDocumentAttributes(DocumentData *document) {
 	QVector<MTPDocumentAttribute> attributes(1, MTP_documentAttributeFilename(MTP_string(document->name)));
 	if (document->dimensions.width() > 0 && document->dimensions.height() > 0) {
@@ -1769,8 +1792,7 @@ void HistoryWidget::showHistory(const PeerId &peerId, MsgId showAtMsgId, bool re
 	App::mousedItem(nullptr);
 
 	if (_peer) {
-		App::forgetMedia();
-		_serviceImageCacheSize = imageCacheSize();
+		App::forgetDocumentsData();
 		AuthSession::Current().downloader().clearPriorities();
 
 		_history = App::history(_peer->id);
@@ -1803,6 +1825,8 @@ void HistoryWidget::showHistory(const PeerId &peerId, MsgId showAtMsgId, bool re
 		pinnedMsgVisibilityUpdated();
 		if (_history->scrollTopItem || (_migrated && _migrated->scrollTopItem) || _history->isReadyFor(_showAtMsgId)) {
 			historyLoaded();
+		} else if (showCachedMessages()) {
+			historyLoaded();
 		} else {
 			firstLoadMessages();
 			doneShow();
@@ -1858,9 +1882,10 @@ void HistoryWidget::clearDelayedShowAt() {
 void HistoryWidget::clearAllLoadRequests() {
 	clearDelayedShowAt();
 	if (_firstLoadRequest) MTP::cancel(_firstLoadRequest);
+	if (_cacheRefreshRequest) MTP::cancel(_cacheRefreshRequest);
 	if (_preloadRequest) MTP::cancel(_preloadRequest);
 	if (_preloadDownRequest) MTP::cancel(_preloadDownRequest);
-	_preloadRequest = _preloadDownRequest = _firstLoadRequest = 0;
+	_preloadRequest = _preloadDownRequest = _firstLoadRequest = _cacheRefreshRequest = 0;
 }
 
 void HistoryWidget::updateAfterDrag() {
@@ -2281,19 +2306,21 @@ bool HistoryWidget::messagesFailed(const RPCError &error, mtpRequestId requestId
 		App::main()->showBackFromStack();
 	} else if (_delayedShowAtRequest == requestId) {
 		_delayedShowAtRequest = 0;
+	} else if (_cacheRefreshRequest == requestId) {
+		_cacheRefreshRequest = 0;
 	}
 	return true;
 }
 
 void HistoryWidget::messagesReceived(PeerData *peer, const MTPmessages_Messages &messages, mtpRequestId requestId) {
 	if (!_history) {
-		_preloadRequest = _preloadDownRequest = _firstLoadRequest = _delayedShowAtRequest = 0;
+		_preloadRequest = _preloadDownRequest = _firstLoadRequest = _delayedShowAtRequest = _cacheRefreshRequest = 0;
 		return;
 	}
 
 	bool toMigrated = (peer == _peer->migrateFrom());
 	if (peer != _peer && !toMigrated) {
-		_preloadRequest = _preloadDownRequest = _firstLoadRequest = _delayedShowAtRequest = 0;
+		_preloadRequest = _preloadDownRequest = _firstLoadRequest = _delayedShowAtRequest = _cacheRefreshRequest = 0;
 		return;
 	}
 
@@ -2358,6 +2385,61 @@ void HistoryWidget::messagesReceived(PeerData *peer, const MTPmessages_Messages
 				return;
 			}
 		}
+		if (!toMigrated && _history->loadedAtBottom()) {
+			Local::writeHistoryCache(peer->id, messages);
+		}
+
+		historyLoaded();
+	} else if (_cacheRefreshRequest == requestId) {
+		_cacheRefreshRequest = 0;
+
+		// Replace the messages from the local cache with the server ones,
+		// the existing items are reused, only their edits are applied.
+		for_const (auto &message, *histList) {
+			App::updateEditedMessage(message);
+		}
+		if (_preloadRequest) MTP::cancel(_preloadRequest);
+		if (_preloadDownRequest) MTP::cancel(_preloadDownRequest);
+		_preloadRequest = _preloadDownRequest = 0;
+		auto cachedIds = std::vector<MsgId>();
+		for_const (auto block, _history->blocks) {
+			for_const (auto item, block->items) {
+				cachedIds.push_back(item->id);
+			}
+		}
+		_history->clear(true);
+		_history->getReadyFor(ShowAtTheEndMsgId);
+		_firstLoadRequest = -1; // hack - don't updateListSize yet
+		addMessagesToFront(peer, *histList);
+		_firstLoadRequest = 0;
+
+		// The cached messages from the refreshed range that the server did
+		// not return were deleted meanwhile, their detached items are dropped.
+		auto returnedIds = OrderedSet<MsgId>();
+		auto returnedFrom = MsgId(0);
+		for_const (auto &message, *histList) {
+			auto id = idFromMessage(message);
+			returnedIds.insert(id);
+			if (!returnedFrom || id < returnedFrom) {
+				returnedFrom = id;
+			}
+		}
+		auto refreshedAll = (histList->size() < kMessagesPerPageFirst);
+		for (auto id : cachedIds) {
+			if (id <= 0 || returnedIds.contains(id) || (!refreshedAll && id < returnedFrom)) {
+				continue;
+			}
+			if (auto item = App::histItemById(_history->channelId(), id)) {
+				if (item->detached()) {
+					item->destroy();
+				}
+			}
+		}
+		if (_history->loadedAtBottom()) {
+			Local::writeHistoryCache(peer->id, messages);
+		}
+
+		_histInited = false;
 
 		historyLoaded();
 	} else if (_delayedShowAtRequest == requestId) {
@@ -2415,7 +2497,7 @@ void HistoryWidget::windowShown() {
 
 bool HistoryWidget::doWeReadServerHistory() const {
 	if (!_history || !_list) return true;
-	if (_firstLoadRequest || _a_show.animating()) return false;
+	if (_firstLoadRequest || _cacheRefreshRequest || _a_show.animating()) return false;
 	if (_history->loadedAtBottom()) {
 		int scrollTop = _scroll->scrollTop();
 		if (scrollTop + 1 > _scroll->scrollTopMax()) return true;
@@ -2485,6 +2567,29 @@ void HistoryWidget::firstLoadMessages() {
 	_firstLoadRequest = MTP::send(MTPmessages_GetHistory(from->input, MTP_int(offset_id), MTP_int(0), MTP_int(offset), MTP_int(loadCount), MTP_int(0), MTP_int(0)), rpcDone(&HistoryWidget::messagesReceived, from), rpcFail(&HistoryWidget::messagesFailed));
 }
 
+bool HistoryWidget::showCachedMessages() {
+	if (_migrated || _history->unreadCount()) {
+		return false;
+	} else if (_showAtMsgId != ShowAtUnreadMsgId && _showAtMsgId != ShowAtTheEndMsgId) {
+		return false;
+	}
+
+	auto cached = MTPmessages_Messages();
+	if (!Local::readHistoryCache(_peer->id, cached) || cached.type() != mtpc_messages_messages) {
+		return false;
+	}
+	auto &d = cached.c_messages_messages();
+	feedCachedPeers(d);
+
+	_history->getReadyFor(ShowAtTheEndMsgId);
+	addMessagesToFront(_peer, d.vmessages.v);
+	if (_history->isEmpty()) {
+		return false;
+	}
+	_cacheRefreshRequest = MTP::send(MTPmessages_GetHistory(_peer->input, MTP_int(0), MTP_int(0), MTP_int(0), MTP_int(kMessagesPerPageFirst), MTP_int(0), MTP_int(0)), rpcDone(&HistoryWidget::messagesReceived, _peer), rpcFail(&HistoryWidget::messagesFailed));
+	return true;
+}
+
 void HistoryWidget::loadMessages() {
 	if (!_history || _preloadRequest) return;
 
@@ -2588,7 +2693,7 @@ void HistoryWidget::visibleAreaUpdated() {
 }
 
 void HistoryWidget::preloadHistoryIfNeeded() {
-	if (_firstLoadRequest || _scroll->isHidden() || !_peer) return;
+	if (_firstLoadRequest || _cacheRefreshRequest || _scroll->isHidden() || !_peer) return;
 
 	updateHistoryDownVisibility();
 
@@ -190,6 +190,9 @@ public:
 	void loadMessagesDown();
 	void firstLoadMessages();
 	void delayedShowAt(MsgId showAtMsgId);
+
+	// Paints the last messages from the local cache while they are requested.
+	bool showCachedMessages();
 	void peerMessagesUpdated(PeerId peer);
 	void peerMessagesUpdated();
 
@@ -709,6 +712,8 @@ private:
 	MsgId _delayedShowAtMsgId = -1; // wtf?
 	mtpRequestId _delayedShowAtRequest = 0;
 
+	mtpRequestId _cacheRefreshRequest = 0;
+
 	MsgId _activeAnimMsgId = 0;
 
 	object_ptr<Ui::AbstractButton> _backAnimationButton = { nullptr };
@@ -801,7 +806,6 @@ private:
 	TaskQueue _fileLoader;
 	TextUpdateEvents _textUpdateEvents = (TextUpdateEvent::SaveDraft | TextUpdateEvent::SendTyping);
 
-	int64 _serviceImageCacheSize = 0;
 	QString _confirmSource;
 
 	QString _titlePeerText;
@@ -58,6 +58,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "media/player/media_player_instance.h"
 #include "base/qthelp_regex.h"
 #include "base/qthelp_url.h"
+#include "base/task_queue.h"
 #include "window/themes/window_theme.h"
 #include "window/player_wrap_widget.h"
 #include "styles/style_boxes.h"
@@ -70,6 +71,53 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "calls/calls_instance.h"
 #include "calls/calls_top_bar.h"
 
+namespace {
+
+constexpr auto kDifferencePartSize = 20;
+constexpr auto kDifferenceProgressMinCount = 200;
+constexpr auto kUnloadHistoriesTimeout = TimeMs(5000);
+constexpr auto kKeptHiddenHistoryItemsCount = 200;
+
+// Differences after a long sleep can be huge, so they are deserialized
+// in the background and only the parsed result is applied in the main thread.
+template <typename TResponse, typename Done, typename Fail>
+void ParseInBackground(const mtpPrime *from, const mtpPrime *end, Done &&done, Fail &&fail) {
+	auto data = mtpBuffer(end - from);
+	memcpy(data.data(), from, (end - from) * sizeof(mtpPrime));
+	base::TaskQueue::Normal().Put([data = std::move(data), done = std::forward<Done>(done), fail = std::forward<Fail>(fail)]() mutable {
+		auto response = TResponse();
+		try {
+			auto from = data.constData();
+			response.read(from, from + data.size());
+		} catch (Exception &e) {
+			LOG(("API Error: could not parse a response in the background, %1").arg(e.what()));
+			base::TaskQueue::Main().Put(std::move(fail));
+			return;
+		}
+		base::TaskQueue::Main().Put([done = std::move(done), response = std::move(response)]() mutable {
+			done(response);
+		});
+	});
+}
+
+} // namespace
+
+struct MainWidget::DifferenceApplication {
+	QVector<MTPUser> users;
+	QVector<MTPChat> chats;
+	QVector<MTPMessage> messages; // sorted by id, the opened chat messages first
+	QVector<MTPUpdate> other;
+	int openedMessagesCount = 0;
+
+	int usersFed = 0;
+	int chatsFed = 0;
+	bool messageIdsFed = false;
+	int messagesFed = 0;
+	int otherFed = 0;
+
+	base::lambda_once<void()> done;
+};
+
 StackItemSection::StackItemSection(std::unique_ptr<Window::SectionMemento> &&memento) : StackItem(nullptr)
 , _memento(std::move(memento)) {
 }
@@ -143,6 +191,7 @@ MainWidget::MainWidget(QWidget *parent, gsl::not_null<Window::Controller*> contr
 		}
 	});
 	connect(&_cacheBackgroundTimer, SIGNAL(timeout()), this, SLOT(onCacheBackground()));
+	connect(&_unloadHistoriesTimer, SIGNAL(timeout()), this, SLOT(onUnloadHiddenHistories()));
 
 	_playerPanel->setPinCallback([this] { switchToFixedPlayer(); });
 	_playerPanel->setCloseCallback([this] { closeBothPlayers(); });
@@ -3241,6 +3290,42 @@ int MainWidget::backgroundFromY() const {
 void MainWidget::onHistoryShown(History *history, MsgId atMsgId) {
 	updateControlsGeometry();
 	dlgUpdated(history ? history->peer : nullptr, atMsgId);
+	_unloadHistoriesTimer.start(kUnloadHistoriesTimeout);
+}
+
+void MainWidget::onUnloadHiddenHistories() {
+	// Items of the forwarded messages and of the messages search
+	// results are held by pointers, so they can't be destroyed now.
+	if (!_toForward.isEmpty() || _dialogs->hasSearchResults()) {
+		return;
+	}
+
+	auto isShown = [this](PeerData *peer) {
+		for (auto shown : { historyPeer(), overviewPeer() }) {
+			if (shown && (shown == peer || shown->migrateFrom() == peer || shown->migrateTo() == peer)) {
+				return true;
+			}
+		}
+		return false;
+	};
+	auto destroyed = 0;
+	for_const (auto history, App::histories().map) {
+		if (!isShown(history->peer)) {
+			destroyed += history->unloadOldBlocks(kKeptHiddenHistoryItemsCount);
+		}
+	}
+	if (destroyed > 0 && cDebug()) {
+		// Walking all the items is needed only for the debug log.
+		auto left = History::MemoryUsage();
+		for_const (auto history, App::histories().map) {
+			auto usage = history->memoryUsage();
+			left.blocks += usage.blocks;
+			left.items += usage.items;
+			left.media += usage.media;
+			left.bytes += usage.bytes;
+		}
+		DEBUG_LOG(("History Info: unloaded %1 messages, %2 messages in %3 blocks (%4 with media, ~%5 KB) left.").arg(destroyed).arg(left.items).arg(left.blocks).arg(left.media).arg(left.bytes / 1024));
+	}
 }
 
 void MainWidget::searchInPeer(PeerData *peer) {
@@ -3315,6 +3400,14 @@ void MainWidget::updSetState(int32 pts, int32 date, int32 qts, int32 seq) {
 	}
 }
 
+void MainWidget::gotChannelDifferenceData(ChannelData *channel, const mtpPrime *from, const mtpPrime *end) {
+	ParseInBackground<MTPupdates_ChannelDifference>(from, end, base::lambda_guarded(this, [this, channel](const MTPupdates_ChannelDifference &diff) {
+		gotChannelDifference(channel, diff);
+	}), base::lambda_guarded(this, [this, channel] {
+		failDifferenceStartTimerFor(channel);
+	}));
+}
+
 void MainWidget::gotChannelDifference(ChannelData *channel, const MTPupdates_ChannelDifference &diff) {
 	_channelFailDifferenceTimeout.remove(channel);
 
@@ -3481,6 +3574,14 @@ void MainWidget::gotState(const MTPupdates_State &state) {
 	updateOnline();
 }
 
+void MainWidget::gotDifferenceData(const mtpPrime *from, const mtpPrime *end) {
+	ParseInBackground<MTPupdates_Difference>(from, end, base::lambda_guarded(this, [this](const MTPupdates_Difference &difference) {
+		gotDifference(difference);
+	}), base::lambda_guarded(this, [this] {
+		failDifferenceStartTimerFor(nullptr);
+	}));
+}
+
 void MainWidget::gotDifference(const MTPupdates_Difference &difference) {
 	_failDifferenceTimeout = 1;
 
@@ -3496,21 +3597,21 @@ void MainWidget::gotDifference(const MTPupdates_Difference &difference) {
 	} break;
 	case mtpc_updates_differenceSlice: {
 		auto &d = difference.c_updates_differenceSlice();
-		feedDifference(d.vusers, d.vchats, d.vnew_messages, d.vother_updates);
+		feedDifference(d.vusers, d.vchats, d.vnew_messages, d.vother_updates, [this, state = d.vintermediate_state] {
+			auto &s = state.c_updates_state();
+			updSetState(s.vpts.v, s.vdate.v, s.vqts.v, s.vseq.v);
 
-		auto &s = d.vintermediate_state.c_updates_state();
-		updSetState(s.vpts.v, s.vdate.v, s.vqts.v, s.vseq.v);
-
-		_ptsWaiter.setRequesting(false);
+			_ptsWaiter.setRequesting(false);
 
-		MTP_LOG(0, ("getDifference { good - after a slice of difference was received }%1").arg(cTestMode() ? " TESTMODE" : ""));
-		getDifference();
+			MTP_LOG(0, ("getDifference { good - after a slice of difference was received }%1").arg(cTestMode() ? " TESTMODE" : ""));
+			getDifference();
+		});
 	} break;
 	case mtpc_updates_difference: {
 		auto &d = difference.c_updates_difference();
-		feedDifference(d.vusers, d.vchats, d.vnew_messages, d.vother_updates);
-
-		gotState(d.vstate);
+		feedDifference(d.vusers, d.vchats, d.vnew_messages, d.vother_updates, [this, state = d.vstate] {
+			gotState(state);
+		});
 	} break;
 	case mtpc_updates_differenceTooLong: {
 		auto &d = difference.c_updates_differenceTooLong();
@@ -3604,14 +3705,114 @@ void MainWidget::ptsApplySkippedUpdates() {
 	return _ptsWaiter.applySkippedUpdates(0);
 }
 
-void MainWidget::feedDifference(const MTPVector<MTPUser> &users, const MTPVector<MTPChat> &chats, const MTPVector<MTPMessage> &msgs, const MTPVector<MTPUpdate> &other) {
+void MainWidget::feedDifference(const MTPVector<MTPUser> &users, const MTPVector<MTPChat> &chats, const MTPVector<MTPMessage> &msgs, const MTPVector<MTPUpdate> &other, base::lambda_once<void()> done) {
+	t_assert(_differenceApplication == nullptr);
+
 	AuthSession::Current().checkAutoLock();
-	App::feedUsers(users);
-	App::feedChats(chats);
-	feedMessageIds(other);
-	App::feedMsgs(msgs, NewMessageUnread);
-	feedUpdateVector(other, true);
-	_history->peerMessagesUpdated();
+
+	auto application = std::make_unique<DifferenceApplication>();
+	application->users = users.v;
+	application->chats = chats.v;
+	application->other = other.v;
+	application->done = std::move(done);
+
+	// Messages are fed in the same order as App::feedMsgs() does,
+	// except that the messages of the opened chat go first.
+	auto &messages = msgs.v;
+	auto order = std::vector<int>(messages.size());
+	for (auto i = 0, count = messages.size(); i != count; ++i) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&messages](int a, int b) {
+		return uint32(idFromMessage(messages[a])) < uint32(idFromMessage(messages[b]));
+	});
+	if (auto opened = _history->peer()) {
+		auto middle = std::stable_partition(order.begin(), order.end(), [&messages, opened](int index) {
+			return (peerFromMessage(messages[index]) == opened->id);
+		});
+		application->openedMessagesCount = int(middle - order.begin());
+	}
+	application->messages.reserve(messages.size());
+	for (auto index : order) {
+		application->messages.push_back(messages[index]);
+	}
+
+	_differenceApplication = std::move(application);
+	applyDifferencePart();
+}
+
+void MainWidget::applyDifferencePart() {
+	t_assert(_differenceApplication != nullptr);
+	auto &data = *_differenceApplication;
+
+	if (data.usersFed < data.users.size()) {
+		auto till = qMin(data.usersFed + kDifferencePartSize, data.users.size());
+		for (; data.usersFed != till; ++data.usersFed) {
+			App::feedUser(data.users[data.usersFed]);
+		}
+	} else if (data.chatsFed < data.chats.size()) {
+		auto till = qMin(data.chatsFed + kDifferencePartSize, data.chats.size());
+		for (; data.chatsFed != till; ++data.chatsFed) {
+			App::feedChat(data.chats[data.chatsFed]);
+		}
+	} else if (!data.messageIdsFed) {
+		for_const (auto &update, data.other) {
+			if (update.type() == mtpc_updateMessageID) {
+				feedUpdate(update);
+			}
+		}
+		data.messageIdsFed = true;
+	} else if (data.messagesFed < data.messages.size()) {
+		auto till = qMin(data.messagesFed + kDifferencePartSize, data.messages.size());
+		auto opened = (data.messagesFed < data.openedMessagesCount);
+		if (opened) {
+			accumulate_min(till, data.openedMessagesCount);
+		}
+		App::feedMsgs(data.messages.mid(data.messagesFed, till - data.messagesFed), NewMessageUnread);
+		data.messagesFed = till;
+		if (opened && data.messagesFed == data.openedMessagesCount) {
+			_history->peerMessagesUpdated();
+		}
+	} else if (data.otherFed < data.other.size()) {
+		auto till = qMin(data.otherFed + kDifferencePartSize, data.other.size());
+		for (; data.otherFed != till; ++data.otherFed) {
+			auto &update = data.other[data.otherFed];
+			if (update.type() != mtpc_updateMessageID) {
+				feedUpdate(update);
+			}
+		}
+	} else {
+		auto done = std::move(data.done);
+		_differenceApplication = nullptr;
+
+		_history->peerMessagesUpdated();
+		App::wnd()->updateConnectingStatus();
+		done();
+		return;
+	}
+
+	if (differenceProgress() >= 0) {
+		App::wnd()->updateConnectingStatus();
+	}
+
+	// The rest is applied in the next main thread tasks, they are processed
+	// with a time limit, so the window is repainted between the parts.
+	base::TaskQueue::Main().Put(base::lambda_guarded(this, [this] {
+		applyDifferencePart();
+	}));
+}
+
+int MainWidget::differenceProgress() const {
+	if (!_differenceApplication) {
+		return -1;
+	}
+	auto &data = *_differenceApplication;
+	auto total = data.users.size() + data.chats.size() + data.messages.size() + data.other.size();
+	if (total < kDifferenceProgressMinCount) {
+		return -1;
+	}
+	auto fed = data.usersFed + data.chatsFed + data.messagesFed + data.otherFed;
+	return (fed * 100) / total;
 }
 
 bool MainWidget::failDifference(const RPCError &error) {
@@ -3689,7 +3890,7 @@ void MainWidget::getDifference() {
 
 	_ptsWaiter.setRequesting(true);
 
-	MTP::send(MTPupdates_GetDifference(MTP_flags(0), MTP_int(_ptsWaiter.current()), MTPint(), MTP_int(updDate), MTP_int(updQts)), rpcDone(&MainWidget::gotDifference), rpcFail(&MainWidget::failDifference));
+	MTP::send(MTPupdates_GetDifference(MTP_flags(0), MTP_int(_ptsWaiter.current()), MTPint(), MTP_int(updDate), MTP_int(updQts)), rpcDone(&MainWidget::gotDifferenceData), rpcFail(&MainWidget::failDifference));
 }
 
 void MainWidget::getChannelDifference(ChannelData *channel, ChannelDifferenceRequest from) {
@@ -3714,7 +3915,7 @@ void MainWidget::getChannelDifference(ChannelData *channel, ChannelDifferenceReq
 			flags = 0; // No force flag when requesting for short poll.
 		}
 	}
-	MTP::send(MTPupdates_GetChannelDifference(MTP_flags(flags), channel->inputChannel, filter, MTP_int(channel->pts()), MTP_int(MTPChannelGetDifferenceLimit)), rpcDone(&MainWidget::gotChannelDifference, channel), rpcFail(&MainWidget::failChannelDifference, channel));
+	MTP::send(MTPupdates_GetChannelDifference(MTP_flags(flags), channel->inputChannel, filter, MTP_int(channel->pts()), MTP_int(MTPChannelGetDifferenceLimit)), rpcDone(&MainWidget::gotChannelDifferenceData, channel), rpcFail(&MainWidget::failChannelDifference, channel));
 }
 
 void MainWidget::mtpPing() {
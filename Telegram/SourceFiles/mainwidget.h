@@ -208,6 +208,10 @@ public:
 	PeerData *peer();
 
 	PeerData *activePeer();
+
+	// Percent of the getDifference result that is already applied,
+	// -1 if there is no large enough result being applied now.
+	int differenceProgress() const;
 	MsgId activeMsgId();
 
 	int backgroundFromY() const;
@@ -436,6 +440,7 @@ public slots:
 	void updateOnlineDisplay();
 
 	void onHistoryShown(History *history, MsgId atMsgId);
+	void onUnloadHiddenHistories();
 
 	void searchInPeer(PeerData *peer);
 
@@ -527,11 +532,14 @@ private:
 		AfterFail,
 	};
 	void getChannelDifference(ChannelData *channel, ChannelDifferenceRequest from = ChannelDifferenceRequest::Unknown);
+	void gotDifferenceData(const mtpPrime *from, const mtpPrime *end);
 	void gotDifference(const MTPupdates_Difference &diff);
 	bool failDifference(const RPCError &e);
-	void feedDifference(const MTPVector<MTPUser> &users, const MTPVector<MTPChat> &chats, const MTPVector<MTPMessage> &msgs, const MTPVector<MTPUpdate> &other);
+	void feedDifference(const MTPVector<MTPUser> &users, const MTPVector<MTPChat> &chats, const MTPVector<MTPMessage> &msgs, const MTPVector<MTPUpdate> &other, base::lambda_once<void()> done);
+	void applyDifferencePart();
 	void gotState(const MTPupdates_State &state);
 	void updSetState(int32 pts, int32 date, int32 qts, int32 seq);
+	void gotChannelDifferenceData(ChannelData *channel, const mtpPrime *from, const mtpPrime *end);
 	void gotChannelDifference(ChannelData *channel, const MTPupdates_ChannelDifference &diff);
 	bool failChannelDifference(ChannelData *channel, const RPCError &err);
 	void failDifferenceStartTimerFor(ChannelData *channel);
@@ -652,6 +660,8 @@ private:
 	OverviewsPreload _overviewPreload[OverviewCount], _overviewLoad[OverviewCount];
 
 	int32 _failDifferenceTimeout = 1; // growing timeout for getDifference calls, if it fails
+	struct DifferenceApplication;
+	std::unique_ptr<DifferenceApplication> _differenceApplication;
 	typedef QMap<ChannelData*, int32> ChannelFailDifferenceTimeout;
 	ChannelFailDifferenceTimeout _channelFailDifferenceTimeout; // growing timeout for getChannelDifference calls, if it fails
 	SingleTimer _failDifferenceTimer;
@@ -665,6 +675,8 @@ private:
 	int _cachedY = 0;
 	SingleTimer _cacheBackgroundTimer;
 
+	SingleTimer _unloadHistoriesTimer;
+
 	typedef QMap<ChannelData*, bool> UpdatedChannels;
 	UpdatedChannels _updatedChannels;
 
@@ -415,6 +415,8 @@ void MainWindow::updateConnectingStatus() {
 	} else if (state < 0) {
 		showConnecting(lng_reconnecting(lt_count, ((-state) / 1000) + 1), lang(lng_reconnecting_try_now));
 		QTimer::singleShot((-state) % 1000, this, SLOT(updateConnectingStatus()));
+	} else if (_main && _main->differenceProgress() >= 0) {
+		showConnecting(lng_updating_progress(lt_percent, QString::number(_main->differenceProgress()) + '%'));
 	} else {
 		hideConnecting();
 	}
@@ -2244,11 +2244,10 @@ void MediaView::preloadData(int32 delta) {
 			if (HistoryItem *item = App::histItemById(forgetHistory->channelId(), forgetHistory->overview[_overview][forgetIndex])) {
 				if (HistoryMedia *media = item->getMedia()) {
 					switch (media->type()) {
-					case MediaTypePhoto: static_cast<HistoryPhoto*>(media)->photo()->forget(); break;
 					case MediaTypeFile:
 					case MediaTypeVideo:
 					case MediaTypeGif:
-					case MediaTypeSticker: media->getDocument()->forget(); break;
+					case MediaTypeSticker: media->getDocument()->forgetData(); break;
 					}
 				}
 			}
@@ -2295,10 +2294,6 @@ void MediaView::preloadData(int32 delta) {
 				_user->photos[i]->download();
 			}
 		}
-		int32 forgetIndex = indexInOverview - delta * 2;
-		if (forgetIndex >= 0 && forgetIndex < _user->photos.size() && forgetIndex != indexInOverview) {
-			_user->photos[forgetIndex]->forget();
-		}
 	}
 }
 
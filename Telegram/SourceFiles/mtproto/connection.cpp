@@ -42,6 +42,11 @@ namespace {
 constexpr auto kRecreateKeyId = AuthKey::KeyId(0xFFFFFFFFFFFFFFFFULL);
 constexpr auto kIntSize = static_cast<int>(sizeof(mtpPrime));
 constexpr auto kMaxModExpSize = 256;
+constexpr auto kMaxKeptSendBufferSize = 256 * 1024; // in mtpPrime-s, one upload part with some room
+constexpr auto kKeptUngzipBuffersCount = 4;
+constexpr auto kMaxKeptUngzipBufferSize = 256 * 1024; // in mtpPrime-s
+constexpr auto kGzipMinSize = 18U; // 10 header bytes and 8 trailer bytes
+constexpr auto kReceiveStatsPeriod = TimeMs(60000);
 
 bool IsGoodModExpFirst(const openssl::BigNum &modexp, const openssl::BigNum &prime) {
 	auto diff = prime - modexp;
@@ -349,6 +354,36 @@ void ConnectionPrivate::destroyConn(AbstractConnection **conn) {
 	}
 }
 
+// Inflate state is kept between gzip_packed messages, inflateReset() is much
+// cheaper than allocating the window again in inflateInit2() for each of them.
+struct ConnectionPrivate::Inflater {
+	bool prepare() {
+		if (inited) {
+			return (inflateReset(&stream) == Z_OK);
+		}
+		stream.zalloc = 0;
+		stream.zfree = 0;
+		stream.opaque = 0;
+		stream.avail_in = 0;
+		stream.next_in = 0;
+		int res = inflateInit2(&stream, 16 + MAX_WBITS);
+		if (res != Z_OK) {
+			LOG(("RPC Error: could not init zlib stream, code: %1").arg(res));
+			return false;
+		}
+		inited = true;
+		return true;
+	}
+	~Inflater() {
+		if (inited) {
+			inflateEnd(&stream);
+		}
+	}
+
+	z_stream stream;
+	bool inited = false;
+};
+
 ConnectionPrivate::ConnectionPrivate(Instance *instance, QThread *thread, Connection *owner, SessionData *data, ShiftedDcId shiftedDcId) : QObject()
 , _instance(instance)
 , _state(DisconnectedState)
@@ -1256,9 +1291,19 @@ void ConnectionPrivate::handleReceived() {
 		return restartOnError();
 	}
 
+	auto measure = cDebug();
 	while (!_conn->received().empty()) {
 		auto intsBuffer = std::move(_conn->received().front());
 		_conn->received().pop_front();
+		if (measure) {
+			_receiveStats.packetReceivedAt = getms(true);
+			if (!_receiveStats.start) {
+				_receiveStats.start = _receiveStats.packetReceivedAt;
+			}
+			++_receiveStats.packets;
+			++_receiveStats.allocations; // the packet buffer
+			_receiveStats.bytes += intsBuffer.size() * kIntSize;
+		}
 
 		constexpr auto kExternalHeaderIntsCount = 6U; // 2 auth_key_id, 4 msg_key
 		constexpr auto kEncryptedHeaderIntsCount = 8U; // 2 salt, 2 session, 2 msg_id, 1 seq_no, 1 length
@@ -1279,15 +1324,15 @@ void ConnectionPrivate::handleReceived() {
 			return restartOnError();
 		}
 
-		auto encryptedInts = ints + kExternalHeaderIntsCount;
+		auto encryptedInts = intsBuffer.data() + kExternalHeaderIntsCount;
 		auto encryptedIntsCount = (intsCount - kExternalHeaderIntsCount);
 		auto encryptedBytesCount = encryptedIntsCount * kIntSize;
-		auto decryptedBuffer = QByteArray(encryptedBytesCount, Qt::Uninitialized);
 		auto msgKey = *(MTPint128*)(ints + 2);
 
-		aesIgeDecrypt(encryptedInts, decryptedBuffer.data(), encryptedBytesCount, key, msgKey);
+		// The received packet is owned here, so decrypt it in place.
+		aesIgeDecrypt(encryptedInts, encryptedInts, encryptedBytesCount, key, msgKey);
 
-		auto decryptedInts = reinterpret_cast<const mtpPrime*>(decryptedBuffer.constData());
+		auto decryptedInts = static_cast<const mtpPrime*>(encryptedInts);
 		auto serverSalt = *(uint64*)&decryptedInts[0];
 		auto session = *(uint64*)&decryptedInts[2];
 		auto msgId = *(uint64*)&decryptedInts[4];
@@ -1386,16 +1431,10 @@ void ConnectionPrivate::handleReceived() {
 			emit sendAnythingAsync(MTPAckSendWaiting);
 		}
 
-		bool emitSignal = false;
-		{
-			QReadLocker locker(sessionData->haveReceivedMutex());
-			emitSignal = !sessionData->haveReceivedResponses().isEmpty() || !sessionData->haveReceivedUpdates().isEmpty();
-			if (emitSignal) {
-				DEBUG_LOG(("MTP Info: emitting needToReceive() - need to parse in another thread, %1 responses, %2 updates.").arg(sessionData->haveReceivedResponses().size()).arg(sessionData->haveReceivedUpdates().size()));
-			}
-		}
-
-		if (emitSignal) {
+		auto responsesCount = sessionData->receivedResponsesCount();
+		auto updatesCount = sessionData->receivedUpdatesCount();
+		if (responsesCount > 0 || updatesCount > 0) {
+			DEBUG_LOG(("MTP Info: emitting needToReceive() - need to parse in another thread, %1 responses, %2 updates.").arg(responsesCount).arg(updatesCount));
 			emit needToReceive();
 		}
 
@@ -1417,6 +1456,9 @@ void ConnectionPrivate::handleReceived() {
 			}
 		}
 	}
+	if (measure) {
+		logReceiveStats();
+	}
 	if (_conn->needHttpWait()) {
 		emit sendHttpWaitAsync();
 	}
@@ -1430,11 +1472,14 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 
 	case mtpc_gzip_packed: {
 		DEBUG_LOG(("Message Info: gzip container"));
-		mtpBuffer response = ungzip(++from, end);
-		if (!response.size()) {
+		auto response = takeUngzipBuffer();
+		if (!ungzip(++from, end, response)) {
+			releaseUngzipBuffer(std::move(response));
 			return HandleResult::RestartConnection;
 		}
-		return handleOneReceived(response.data(), response.data() + response.size(), msgId, serverTime, serverSalt, badTime);
+		auto result = handleOneReceived(response.constData(), response.constData() + response.size(), msgId, serverTime, serverSalt, badTime);
+		releaseUngzipBuffer(std::move(response));
+		return result;
 	}
 
 	case mtpc_msg_container: {
@@ -1839,8 +1884,7 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 
 		if (typeId == mtpc_gzip_packed) {
 			DEBUG_LOG(("RPC Info: gzip container"));
-			response = ungzip(++from, end);
-			if (!response.size()) {
+			if (!ungzip(++from, end, response)) {
 				return HandleResult::RestartConnection;
 			}
 			typeId = response[0];
@@ -1856,8 +1900,8 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		auto requestId = wasSent(reqMsgId.v);
 		if (requestId && requestId != mtpRequestId(0xFFFFFFFF)) {
 			// Save rpc_result for processing in the main thread.
-			QWriteLocker locker(sessionData->haveReceivedMutex());
-			sessionData->haveReceivedResponses().insert(requestId, response);
+			countReceivedMessage();
+			sessionData->pushReceivedResponse(requestId, std::move(response), _receiveStats.packetReceivedAt);
 		} else {
 			DEBUG_LOG(("RPC Info: requestId not found for msgId %1").arg(reqMsgId.v));
 		}
@@ -1898,8 +1942,8 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		if (from > start) memcpy(update.data(), start, (from - start) * sizeof(mtpPrime));
 
 		// Notify main process about new session - need to get difference.
-		QWriteLocker locker(sessionData->haveReceivedMutex());
-		sessionData->haveReceivedUpdates().push_back(SerializedMessage(update));
+		countReceivedMessage();
+		sessionData->pushReceivedUpdate(std::move(update), _receiveStats.packetReceivedAt);
 	} return HandleResult::Success;
 
 	case mtpc_ping: {
@@ -1955,8 +1999,8 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		if (end > from) memcpy(update.data(), from, (end - from) * sizeof(mtpPrime));
 
 		// Notify main process about the new updates.
-		QWriteLocker locker(sessionData->haveReceivedMutex());
-		sessionData->haveReceivedUpdates().push_back(SerializedMessage(update));
+		countReceivedMessage();
+		sessionData->pushReceivedUpdate(std::move(update), _receiveStats.packetReceivedAt);
 
 		if (cons != mtpc_updatesTooLong && cons != mtpc_updateShortMessage && cons != mtpc_updateShortChatMessage && cons != mtpc_updateShortSentMessage && cons != mtpc_updateShort && cons != mtpc_updatesCombined && cons != mtpc_updates) {
 			LOG(("Message Error: unknown constructor %1").arg(cons)); // maybe new api?..
@@ -1968,54 +2012,120 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 	return HandleResult::Success;
 }
 
-mtpBuffer ConnectionPrivate::ungzip(const mtpPrime *from, const mtpPrime *end) const {
-	MTPstring packed;
-	packed.read(from, end); // read packed string as serialized mtp string type
-	uint32 packedLen = packed.v.size(), unpackedChunk = packedLen, unpackedLen = 0;
+bool ConnectionPrivate::ungzip(const mtpPrime *from, const mtpPrime *end, mtpBuffer &result) {
+	// Read the packed string header and inflate right from the received data.
+	if (from + 1 > end) throw mtpErrorInsufficient();
 
-	mtpBuffer result; // * 4 because of mtpPrime type
-	result.resize(0);
-	z_stream stream;
-	stream.zalloc = 0;
-	stream.zfree = 0;
-	stream.opaque = 0;
-	stream.avail_in = 0;
-	stream.next_in = 0;
-	int res = inflateInit2(&stream, 16 + MAX_WBITS);
-	if (res != Z_OK) {
-		LOG(("RPC Error: could not init zlib stream, code: %1").arg(res));
-		return result;
+	auto packed = reinterpret_cast<const uchar*>(from);
+	uint32 packedLen = 0;
+	if (packed[0] == 254) {
+		packedLen = (uint32)packed[1] + ((uint32)packed[2] << 8) + ((uint32)packed[3] << 16);
+		packed += 4;
+		from += ((packedLen + 4) >> 2) + (((packedLen + 4) & 0x03) ? 1 : 0);
+	} else {
+		packedLen = (uint32)packed[0];
+		++packed;
+		from += ((packedLen + 1) >> 2) + (((packedLen + 1) & 0x03) ? 1 : 0);
+	}
+	if (from > end) throw mtpErrorInsufficient();
+
+	// The gzip trailer has the unpacked size, so usually one allocation is enough.
+	// One more int is reserved so that a complete stream leaves some avail_out.
+	auto unpackedChunk = (packedLen + 3) / 4;
+	if (packedLen >= kGzipMinSize) {
+		auto trailer = packed + packedLen - 4;
+		auto unpackedLen = (uint32)trailer[0] + ((uint32)trailer[1] << 8) + ((uint32)trailer[2] << 16) + ((uint32)trailer[3] << 24);
+		if (unpackedLen > 0 && !(unpackedLen & 0x03) && unpackedLen <= uint32(MTPPacketSizeMax)) {
+			unpackedChunk = (unpackedLen >> 2) + 1;
+		}
 	}
+	if (!unpackedChunk) {
+		LOG(("RPC Error: bad length of packed data 0"));
+		return false;
+	}
+
+	if (!_inflater) {
+		_inflater = std::make_unique<Inflater>();
+	}
+	if (!_inflater->prepare()) {
+		return false;
+	}
+	auto &stream = _inflater->stream;
 	stream.avail_in = packedLen;
-	stream.next_in = reinterpret_cast<Bytef*>(packed.v.data());
+	stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(packed));
 
+	result.resize(0);
+	result.reserve(unpackedChunk);
 	stream.avail_out = 0;
 	while (!stream.avail_out) {
 		result.resize(result.size() + unpackedChunk);
 		stream.avail_out = unpackedChunk * sizeof(mtpPrime);
 		stream.next_out = (Bytef*)&result[result.size() - unpackedChunk];
+		unpackedChunk = (packedLen + 3) / 4;
 		int res = inflate(&stream, Z_NO_FLUSH);
 		if (res != Z_OK && res != Z_STREAM_END) {
-			inflateEnd(&stream);
 			LOG(("RPC Error: could not unpack gziped data, code: %1").arg(res));
-			DEBUG_LOG(("RPC Error: bad gzip: %1").arg(Logs::mb(packed.v.constData(), packedLen).str()));
-			return mtpBuffer();
+			DEBUG_LOG(("RPC Error: bad gzip: %1").arg(Logs::mb(packed, packedLen).str()));
+			return false;
 		}
 	}
 	if (stream.avail_out & 0x03) {
 		uint32 badSize = result.size() * sizeof(mtpPrime) - stream.avail_out;
 		LOG(("RPC Error: bad length of unpacked data %1").arg(badSize));
 		DEBUG_LOG(("RPC Error: bad unpacked data %1").arg(Logs::mb(result.data(), badSize).str()));
-		return mtpBuffer();
+		return false;
 	}
 	result.resize(result.size() - (stream.avail_out >> 2));
-	inflateEnd(&stream);
 	if (!result.size()) {
 		LOG(("RPC Error: bad length of unpacked data 0"));
+		return false;
 	}
+	return true;
+}
+
+void ConnectionPrivate::countReceivedMessage() {
+	if (_receiveStats.packetReceivedAt) {
+		++_receiveStats.messages;
+		++_receiveStats.allocations; // the message buffer
+	}
+}
+
+void ConnectionPrivate::logReceiveStats() {
+	auto now = getms(true);
+	auto elapsed = now - _receiveStats.start;
+	_receiveStats.packetReceivedAt = 0;
+	if (!_receiveStats.start || elapsed < kReceiveStatsPeriod) {
+		return;
+	}
+	auto perSecond = [elapsed](qint64 value) {
+		return value * 1000. / elapsed;
+	};
+	auto allocationsPerMessage = _receiveStats.messages ? (_receiveStats.allocations / double(_receiveStats.messages)) : 0.;
+	DEBUG_LOG(("MTP Info: received %1 packets (%2 KB) and %3 messages per second, %4 allocations per message, dc %5").arg(perSecond(_receiveStats.packets), 0, 'f', 1).arg(perSecond(_receiveStats.bytes) / 1024., 0, 'f', 1).arg(perSecond(_receiveStats.messages), 0, 'f', 1).arg(allocationsPerMessage, 0, 'f', 2).arg(_shiftedDcId));
+	_receiveStats = ReceiveStats();
+}
+
+mtpBuffer ConnectionPrivate::takeUngzipBuffer() {
+	if (_ungzipBuffers.empty()) {
+		if (_receiveStats.packetReceivedAt) {
+			++_receiveStats.allocations;
+		}
+		return mtpBuffer();
+	}
+	auto result = std::move(_ungzipBuffers.back());
+	_ungzipBuffers.pop_back();
 	return result;
 }
 
+void ConnectionPrivate::releaseUngzipBuffer(mtpBuffer &&buffer) {
+	if (int(_ungzipBuffers.size()) < kKeptUngzipBuffersCount
+		&& buffer.capacity() <= kMaxKeptUngzipBufferSize
+		&& buffer.isDetached()) {
+		buffer.resize(0); // the capacity was reserved in ungzip(), so it is kept
+		_ungzipBuffers.push_back(std::move(buffer));
+	}
+}
+
 bool ConnectionPrivate::requestsFixTimeSalt(const QVector<MTPlong> &ids, int32 serverTime, uint64 serverSalt) {
 	uint32 idsCount = ids.size();
 
@@ -2639,7 +2749,8 @@ void ConnectionPrivate::dhClientParamsAnswered() {
 		DEBUG_LOG(("AuthKey Info: auth key gen succeed, id: %1, server salt: %2").arg(authKey->keyId()).arg(serverSalt));
 
 		sessionData->owner()->notifyKeyCreated(std::move(authKey)); // slot will call authKeyCreated()
-		sessionData->clear(_instance);
+		sessionData->clear();
+		emit needToReceive();
 		unlockKey();
 	} return;
 
@@ -2910,7 +3021,8 @@ bool ConnectionPrivate::sendRequest(mtpRequest &request, bool needAnyResponse, Q
 	MTPint128 &msgKey(*(MTPint128*)(encryptedSHA + 4));
 	hashSha1(request->constData(), (fullSize - padding) * sizeof(mtpPrime), encryptedSHA);
 
-	mtpBuffer result;
+	// The packet buffer is reused, so sending doesn't allocate in the common case.
+	auto &result = _sendBuffer;
 	result.resize(9 + fullSize);
 	*((uint64*)&result[2]) = keyId;
 	*((MTPint128*)&result[4]) = msgKey;
@@ -2925,6 +3037,9 @@ bool ConnectionPrivate::sendRequest(mtpRequest &request, bool needAnyResponse, Q
 	if (needAnyResponse) {
 		onSentSome(result.size() * sizeof(mtpPrime));
 	}
+	if (result.capacity() > kMaxKeptSendBufferSize) {
+		mtpBuffer().swap(result);
+	}
 
 	return true;
 }
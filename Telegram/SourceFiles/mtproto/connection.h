@@ -186,7 +186,9 @@ private:
 		ResetSession,
 	};
 	HandleResult handleOneReceived(const mtpPrime *from, const mtpPrime *end, uint64 msgId, int32 serverTime, uint64 serverSalt, bool badTime);
-	mtpBuffer ungzip(const mtpPrime *from, const mtpPrime *end) const;
+	bool ungzip(const mtpPrime *from, const mtpPrime *end, mtpBuffer &result);
+	mtpBuffer takeUngzipBuffer();
+	void releaseUngzipBuffer(mtpBuffer &&buffer);
 	void handleMsgsStates(const QVector<MTPlong> &ids, const QByteArray &states, QVector<MTPlong> &acked);
 
 	void clearMessages();
@@ -223,6 +225,24 @@ private:
 	TimeMs firstSentAt = -1;
 
 	QVector<MTPlong> ackRequestData, resendRequestData;
+	mtpBuffer _sendBuffer;
+
+	struct Inflater;
+	std::unique_ptr<Inflater> _inflater;
+	std::vector<mtpBuffer> _ungzipBuffers;
+
+	// Receive stats, measured only when the debug logging is enabled.
+	struct ReceiveStats {
+		TimeMs start = 0;
+		TimeMs packetReceivedAt = 0; // zero if not measured
+		int packets = 0;
+		qint64 bytes = 0;
+		int messages = 0;
+		int allocations = 0;
+	};
+	ReceiveStats _receiveStats;
+	void countReceivedMessage();
+	void logReceiveStats();
 
 	// if badTime received - search for ids in sessionData->haveSent and sessionData->wereAcked and sync time/salt, return true if found
 	bool requestsFixTimeSalt(const QVector<MTPlong> &ids, int32 serverTime, uint64 serverSalt);
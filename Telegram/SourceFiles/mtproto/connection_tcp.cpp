@@ -27,6 +27,8 @@ namespace internal {
 
 namespace {
 
+constexpr auto kMinReadSpace = 16 * 1024; // in bytes, don't read the socket in tiny pieces
+
 uint32 tcpPacketSize(const char *packet) { // must have at least 4 bytes readable
 	uint32 result = (packet[0] > 0) ? packet[0] : 0;
 	if (result == 0x7f) {
@@ -41,15 +43,58 @@ uint32 tcpPacketSize(const char *packet) { // must have at least 4 bytes readabl
 
 AbstractTCPConnection::AbstractTCPConnection(QThread *thread) : AbstractConnection(thread)
 , packetNum(0)
-, packetRead(0)
-, packetLeft(0)
-, readingToShort(true)
-, currentPos((char*)shortBuffer) {
+, _readOffset(0)
+, _readEnd(0) {
 }
 
 AbstractTCPConnection::~AbstractTCPConnection() {
 }
 
+void AbstractTCPConnection::prepareReadSpace(uint32 required) {
+	auto capacity = uint32(_readBuffer.size() * sizeof(mtpPrime));
+	if (capacity >= _readEnd + required) {
+		return;
+	}
+	if (_readOffset > 0) {
+		auto data = reinterpret_cast<char*>(_readBuffer.data());
+		memmove(data, data + _readOffset, _readEnd - _readOffset);
+		_readEnd -= _readOffset;
+		_readOffset = 0;
+	}
+	if (capacity < _readEnd + required) {
+		auto size = qMax(_readEnd + required, uint32(MTPShortBufferSize * sizeof(mtpPrime)));
+		_readBuffer.resize((size + sizeof(mtpPrime) - 1) / sizeof(mtpPrime));
+	}
+}
+
+bool AbstractTCPConnection::handleReadPackets() {
+	while (_readEnd - _readOffset >= 4) {
+		auto packet = reinterpret_cast<const char*>(_readBuffer.constData()) + _readOffset;
+		auto packetSize = tcpPacketSize(packet);
+		if (packetSize < 5 || packetSize > MTPPacketSizeMax) {
+			LOG(("TCP Error: packet size = %1").arg(packetSize));
+			emit error(kErrorCodeOther);
+			return false;
+		}
+		auto packetRead = _readEnd - _readOffset;
+		if (packetRead < packetSize) {
+			TCP_LOG(("TCP Info: not enough %1 for packet! size %2 read %3").arg(packetSize - packetRead).arg(packetSize).arg(packetRead));
+			emit receivedSome();
+			break;
+		}
+		_readOffset += packetSize;
+		socketPacket(packet, packetSize);
+	}
+	if (_readOffset == _readEnd) {
+		_readOffset = _readEnd = 0;
+		if (_readBuffer.size() > MTPShortBufferSize) {
+			// Don't keep the memory of some huge packet.
+			_readBuffer = mtpBuffer(MTPShortBufferSize);
+		}
+	}
+	return true;
+}
+
 void AbstractTCPConnection::socketRead() {
 	if (sock.state() != QAbstractSocket::ConnectedState) {
 		LOG(("MTP error: socket not connected in socketRead(), state: %1").arg(sock.state()));
@@ -58,72 +103,27 @@ void AbstractTCPConnection::socketRead() {
 	}
 
 	do {
-		uint32 toRead = packetLeft ? packetLeft : (readingToShort ? (MTPShortBufferSize * sizeof(mtpPrime) - packetRead) : 4);
-		if (readingToShort) {
-			if (currentPos + toRead > ((char*)shortBuffer) + MTPShortBufferSize * sizeof(mtpPrime)) {
-				longBuffer.resize(((packetRead + toRead) >> 2) + 1);
-				memcpy(&longBuffer[0], shortBuffer, packetRead);
-				currentPos = ((char*)&longBuffer[0]) + packetRead;
-				readingToShort = false;
-			}
-		} else {
-			if (longBuffer.size() * sizeof(mtpPrime) < packetRead + toRead) {
-				longBuffer.resize(((packetRead + toRead) >> 2) + 1);
-				currentPos = ((char*)&longBuffer[0]) + packetRead;
+		// Make room at least for the rest of the current packet.
+		auto required = uint32(kMinReadSpace);
+		auto packetRead = _readEnd - _readOffset;
+		if (packetRead >= 4) {
+			auto packetSize = tcpPacketSize(reinterpret_cast<const char*>(_readBuffer.constData()) + _readOffset);
+			if (packetSize > packetRead && packetSize <= MTPPacketSizeMax) {
+				required = qMax(required, packetSize - packetRead);
 			}
 		}
+		prepareReadSpace(required);
+
+		auto currentPos = reinterpret_cast<char*>(_readBuffer.data()) + _readEnd;
+		auto toRead = uint32(_readBuffer.size() * sizeof(mtpPrime)) - _readEnd;
 		int32 bytes = (int32)sock.read(currentPos, toRead);
 		if (bytes > 0) {
 			aesCtrEncrypt(currentPos, bytes, _receiveKey, &_receiveState);
 			TCP_LOG(("TCP Info: read %1 bytes").arg(bytes));
 
-			packetRead += bytes;
-			currentPos += bytes;
-			if (packetLeft) {
-				packetLeft -= bytes;
-				if (!packetLeft) {
-					socketPacket(currentPos - packetRead, packetRead);
-					currentPos = (char*)shortBuffer;
-					packetRead = packetLeft = 0;
-					readingToShort = true;
-					longBuffer.clear();
-				} else {
-					TCP_LOG(("TCP Info: not enough %1 for packet! read %2").arg(packetLeft).arg(packetRead));
-					emit receivedSome();
-				}
-			} else {
-				bool move = false;
-				while (packetRead >= 4) {
-					uint32 packetSize = tcpPacketSize(currentPos - packetRead);
-					if (packetSize < 5 || packetSize > MTPPacketSizeMax) {
-						LOG(("TCP Error: packet size = %1").arg(packetSize));
-						emit error(kErrorCodeOther);
-						return;
-					}
-					if (packetRead >= packetSize) {
-						socketPacket(currentPos - packetRead, packetSize);
-						packetRead -= packetSize;
-						packetLeft = 0;
-						move = true;
-					} else {
-						packetLeft = packetSize - packetRead;
-						TCP_LOG(("TCP Info: not enough %1 for packet! size %2 read %3").arg(packetLeft).arg(packetSize).arg(packetRead));
-						emit receivedSome();
-						break;
-					}
-				}
-				if (move) {
-					if (!packetRead) {
-						currentPos = (char*)shortBuffer;
-						readingToShort = true;
-						longBuffer.clear();
-					} else if (!readingToShort && packetRead < MTPShortBufferSize * sizeof(mtpPrime)) {
-						memcpy(shortBuffer, currentPos - packetRead, packetRead);
-						currentPos = (char*)shortBuffer + packetRead;
-						readingToShort = true;
-						longBuffer.clear();
-					}
-				}
+			_readEnd += bytes;
+			if (!handleReadPackets()) {
+				return;
 			}
 		} else if (bytes < 0) {
 			LOG(("TCP Error: socket read return -1"));
@@ -349,7 +349,7 @@ void TCPConnection::socketPacket(const char *packet, uint32 length) {
 	if (data.size() == 1) {
 		emit error(data[0]);
 	} else if (status == UsingTcp) {
-		_receivedQueue.push_back(data);
+		_receivedQueue.push_back(std::move(data));
 		emit receivedData();
 	} else if (status == WaitingTcp) {
 		tcpTimeoutTimer.stop();
@@ -44,11 +44,13 @@ protected:
 	QTcpSocket sock;
 	uint32 packetNum; // sent packet number
 
-	uint32 packetRead, packetLeft; // reading from socket
-	bool readingToShort;
-	char *currentPos;
-	mtpBuffer longBuffer;
-	mtpPrime shortBuffer[MTPShortBufferSize];
+	// Received bytes are decrypted in place and complete packets are passed
+	// to socketPacket() right from this buffer. The unhandled tail is moved
+	// to the beginning only when there is not enough room left after it.
+	mtpBuffer _readBuffer;
+	uint32 _readOffset, _readEnd; // in bytes: not handled yet data start, received data end
+	void prepareReadSpace(uint32 required);
+	bool handleReadPackets();
 	virtual void socketPacket(const char *packet, uint32 length) = 0;
 
 	static mtpBuffer handleResponse(const char *packet, uint32 length);
@@ -24,6 +24,140 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 
 #include "lang.h"
 
+namespace {
+
+constexpr auto kRecycledRequestsCount = 16;
+constexpr auto kRecycledRequestMaxSize = 132 * 1024; // in mtpPrime-s, enough for a 512 KB upload part
+constexpr auto kRecycledRequestsMaxSize = 256 * 1024; // in mtpPrime-s, per thread
+
+} // namespace
+
+// Requests may be released on any thread, so the pool is guarded by a mutex
+// and is kept alive by the requests allocated from it.
+struct mtpRequestsPool {
+	QMutex mutex;
+	std::vector<mtpRequestData*> list;
+	int size = 0; // sum of capacities
+	bool alive = true; // the owning thread didn't finish yet
+
+	void clear() {
+		for (auto request : list) {
+			delete request;
+		}
+		list.clear();
+		size = 0;
+	}
+	~mtpRequestsPool() {
+		clear();
+	}
+};
+
+namespace {
+
+struct RequestsPoolHolder {
+	std::shared_ptr<mtpRequestsPool> pool = std::make_shared<mtpRequestsPool>();
+
+	~RequestsPoolHolder() {
+		QMutexLocker lock(&pool->mutex);
+		pool->alive = false;
+		pool->clear();
+	}
+};
+
+QThreadStorage<RequestsPoolHolder*> *RequestsPools() {
+	// Never destroyed, requests may be released during static destruction.
+	static auto result = new QThreadStorage<RequestsPoolHolder*>();
+	return result;
+}
+
+const std::shared_ptr<mtpRequestsPool> &CurrentRequestsPool() {
+	auto pools = RequestsPools();
+	if (!pools->hasLocalData()) {
+		pools->setLocalData(new RequestsPoolHolder());
+	}
+	return pools->localData()->pool;
+}
+
+} // namespace
+
+mtpRequestData *mtpRequestData::allocate(uint32 capacity) {
+	auto &pool = CurrentRequestsPool();
+	auto result = [&]() -> mtpRequestData* {
+		QMutexLocker lock(&pool->mutex);
+
+		// Best fit: the smallest recycled buffer that is large enough.
+		auto best = pool->list.end();
+		for (auto i = pool->list.begin(), e = pool->list.end(); i != e; ++i) {
+			auto has = uint32((*i)->capacity());
+			if (has >= capacity && (best == e || has < uint32((*best)->capacity()))) {
+				best = i;
+			}
+		}
+		if (best == pool->list.end()) {
+			return nullptr;
+		}
+		auto result = *best;
+		pool->size -= result->capacity();
+		pool->list.erase(best);
+		return result;
+	}();
+	if (!result) {
+		result = new mtpRequestData(true);
+		result->reserve(capacity);
+	}
+	result->_pool = pool;
+	return result;
+}
+
+void mtpRequestData::recycle(mtpRequestData *request) {
+	if (!request) return;
+
+	// Resolve the chain before touching the pool, releasing "after" may recycle as well.
+	request->after = mtpRequest();
+
+	// The pool is not referenced by the recycled requests, so that it is
+	// destroyed after its thread finished and the last request was released.
+	auto pool = std::move(request->_pool);
+	auto capacity = request->capacity();
+	if (!pool
+		|| capacity <= 0
+		|| capacity > kRecycledRequestMaxSize
+		|| !request->isDetached()) {
+		delete request;
+		return;
+	}
+
+	QMutexLocker lock(&pool->mutex);
+	if (!pool->alive || pool->list.size() >= kRecycledRequestsCount) {
+		delete request;
+		return;
+	}
+
+	// Make room for a buffer by dropping the smaller ones, large buffers are the expensive ones.
+	while (pool->size + capacity > kRecycledRequestsMaxSize && !pool->list.empty()) {
+		auto smallest = std::min_element(pool->list.begin(), pool->list.end(), [](mtpRequestData *a, mtpRequestData *b) {
+			return a->capacity() < b->capacity();
+		});
+		if ((*smallest)->capacity() > capacity) {
+			break;
+		}
+		pool->size -= (*smallest)->capacity();
+		delete *smallest;
+		pool->list.erase(smallest);
+	}
+	if (pool->size + capacity > kRecycledRequestsMaxSize) {
+		delete request;
+		return;
+	}
+
+	request->resize(0); // keeps the capacity for a detached vector
+	request->msDate = 0;
+	request->requestId = 0;
+	request->needsLayer = false;
+	pool->list.push_back(request);
+	pool->size += capacity;
+}
+
 QString mtpWrapNumber(float64 number) {
 	return QString::number(number);
 }
@@ -40,12 +40,12 @@ using mtpBuffer = QVector<mtpPrime>;
 using mtpTypeId = uint32;
 
 class mtpRequestData;
+struct mtpRequestsPool;
 class mtpRequest : public QSharedPointer<mtpRequestData> {
 public:
 	mtpRequest() {
 	}
-    explicit mtpRequest(mtpRequestData *ptr) : QSharedPointer<mtpRequestData>(ptr) {
-	}
+	explicit mtpRequest(mtpRequestData *ptr);
 
 	uint32 innerLength() const;
 	void write(mtpBuffer &to) const;
@@ -69,8 +69,7 @@ public:
 
 	static mtpRequest prepare(uint32 requestSize, uint32 maxSize = 0) {
 		if (!maxSize) maxSize = requestSize;
-		mtpRequest result(new mtpRequestData(true));
-		result->reserve(8 + maxSize + _padding(maxSize)); // 2: salt, 2: session_id, 2: msg_id, 1: seq_no, 1: message_length
+		mtpRequest result(allocate(8 + maxSize + _padding(maxSize))); // 2: salt, 2: session_id, 2: msg_id, 1: seq_no, 1: message_length
 		result->resize(7);
 		result->push_back(requestSize << 2);
 		return result;
@@ -98,13 +97,27 @@ public:
 	static bool needAck(const mtpRequest &request);
 	static bool needAckByType(mtpTypeId type);
 
+	// Request buffers are recycled through a small per-thread pool, so that
+	// serializing a request in the common case reuses the memory of some
+	// already destroyed request instead of allocating it again. A buffer
+	// returns to the pool of the thread that allocated it, even if the last
+	// reference is dropped by a connection thread.
+	static void recycle(mtpRequestData *request);
+
 private:
+	static mtpRequestData *allocate(uint32 capacity);
+
+	std::shared_ptr<mtpRequestsPool> _pool;
+
 	static uint32 _padding(uint32 requestSize) {
 		return ((8 + requestSize) & 0x03) ? (4 - ((8 + requestSize) & 0x03)) : 0;
 	}
 
 };
 
+inline mtpRequest::mtpRequest(mtpRequestData *ptr) : QSharedPointer<mtpRequestData>(ptr, &mtpRequestData::recycle) {
+}
+
 inline uint32 mtpRequest::innerLength() const { // for template MTP requests and MTPBoxed instanciation
     mtpRequestData *value = data();
 	if (!value || value->size() < 9) return 0;
@@ -24,30 +24,53 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 
 namespace MTP {
 namespace internal {
+namespace {
 
-void SessionData::clear(Instance *instance) {
-	RPCCallbackClears clearCallbacks;
+constexpr auto kReceiveStatsPeriod = TimeMs(60000);
+
+} // namespace
+
+void LatencyHistogram::add(TimeMs latency) {
+	auto bucket = 0;
+	while (bucket + 1 < kBucketsCount && (TimeMs(1) << bucket) <= latency) {
+		++bucket;
+	}
+	++_buckets[bucket];
+	++_count;
+}
+
+void LatencyHistogram::clear() {
+	_buckets.fill(0);
+	_count = 0;
+}
+
+TimeMs LatencyHistogram::percentile(int percent) const {
+	auto required = (int64(_count) * percent + 99) / 100;
+	auto counted = int64(0);
+	for (auto bucket = 0; bucket != kBucketsCount; ++bucket) {
+		counted += _buckets[bucket];
+		if (counted >= required) {
+			return (TimeMs(1) << bucket);
+		}
+	}
+	return (TimeMs(1) << (kBucketsCount - 1));
+}
+
+void SessionData::clear() {
+	// The callbacks are cleared through the received responses queue, so that
+	// the responses that were already received are processed before that.
 	{
-		QReadLocker locker1(haveSentMutex()), locker2(toResendMutex()), locker3(haveReceivedMutex()), locker4(wereAckedMutex());
-		auto receivedResponsesEnd = _receivedResponses.cend();
-		clearCallbacks.reserve(_haveSent.size() + _wereAcked.size());
+		QReadLocker locker1(haveSentMutex()), locker2(toResendMutex()), locker3(wereAckedMutex());
 		for (auto i = _haveSent.cbegin(), e = _haveSent.cend(); i != e; ++i) {
-			auto requestId = i.value()->requestId;
-			if (!_receivedResponses.contains(requestId)) {
-				clearCallbacks.push_back(requestId);
+			if (auto requestId = i.value()->requestId) {
+				pushReceivedResponse(requestId, SerializedMessage());
 			}
 		}
 		for (auto i = _toResend.cbegin(), e = _toResend.cend(); i != e; ++i) {
-			auto requestId = i.value();
-			if (!_receivedResponses.contains(requestId)) {
-				clearCallbacks.push_back(requestId);
-			}
+			pushReceivedResponse(i.value(), SerializedMessage());
 		}
 		for (auto i = _wereAcked.cbegin(), e = _wereAcked.cend(); i != e; ++i) {
-			auto requestId = i.value();
-			if (!_receivedResponses.contains(requestId)) {
-				clearCallbacks.push_back(requestId);
-			}
+			pushReceivedResponse(i.value(), SerializedMessage());
 		}
 	}
 	{
@@ -66,7 +89,6 @@ void SessionData::clear(Instance *instance) {
 		QWriteLocker locker(receivedIdsMutex());
 		_receivedIds.clear();
 	}
-	instance->clearCallbacksDelayed(clearCallbacks);
 }
 
 Session::Session(gsl::not_null<Instance*> instance, ShiftedDcId shiftedDcId) : QObject()
@@ -494,38 +516,54 @@ void Session::tryToReceive() {
 		_needToReceive = true;
 		return;
 	}
+	auto clearCallbacks = RPCCallbackClears();
 	while (true) {
 		auto requestId = mtpRequestId(0);
-		auto isUpdate = false;
 		auto message = SerializedMessage();
-		{
-			QWriteLocker locker(data.haveReceivedMutex());
-			auto &responses = data.haveReceivedResponses();
-			auto response = responses.begin();
-			if (response == responses.cend()) {
-				auto &updates = data.haveReceivedUpdates();
-				auto update = updates.begin();
-				if (update == updates.cend()) {
-					return;
-				} else {
-					message = std::move(*update);
-					isUpdate = true;
-					updates.pop_front();
-				}
+		auto receivedAt = TimeMs(0);
+		if (data.popReceivedResponse(requestId, message, receivedAt)) {
+			if (message.isEmpty()) {
+				clearCallbacks.push_back(RPCCallbackClear(requestId));
 			} else {
-				requestId = response.key();
-				message = std::move(response.value());
-				responses.erase(response);
+				countReceived(receivedAt);
+				_instance->execCallback(requestId, message.constData(), message.constData() + message.size());
 			}
-		}
-		if (isUpdate) {
+		} else if (data.popReceivedUpdate(message, receivedAt)) {
+			countReceived(receivedAt);
 			if (dcWithShift == bareDcId(dcWithShift)) { // call globalCallback only in main session
 				_instance->globalCallback(message.constData(), message.constData() + message.size());
 			}
 		} else {
-			_instance->execCallback(requestId, message.constData(), message.constData() + message.size());
+			break;
 		}
 	}
+	_instance->clearCallbacksDelayed(clearCallbacks);
+
+	if (_receiveStatsStart) {
+		logReceiveStats();
+	}
+}
+
+void Session::countReceived(TimeMs receivedAt) {
+	if (!receivedAt) {
+		return; // Not measured.
+	}
+	auto now = getms(true);
+	if (!_receiveStatsStart) {
+		_receiveStatsStart = now;
+	}
+	_receiveLatency.add(now - receivedAt);
+}
+
+void Session::logReceiveStats() {
+	auto elapsed = getms(true) - _receiveStatsStart;
+	if (elapsed < kReceiveStatsPeriod) {
+		return;
+	}
+	auto perSecond = _receiveLatency.count() * 1000. / elapsed;
+	DEBUG_LOG(("MTP Info: handled %1 messages per second, socket to handler latency p50 %2 ms, p99 %3 ms, dc %4").arg(perSecond, 0, 'f', 1).arg(_receiveLatency.percentile(50)).arg(_receiveLatency.percentile(99)).arg(dcWithShift));
+	_receiveLatency.clear();
+	_receiveStatsStart = 0;
 }
 
 Session::~Session() {
@@ -22,6 +22,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 
 #include "mtproto/dcenter.h"
 #include "core/single_timer.h"
+#include "base/spsc_queue.h"
 
 namespace MTP {
 
@@ -95,6 +96,26 @@ inline bool ResponseNeedsAck(const SerializedMessage &response) {
 	return (seqNo & 0x01) ? true : false;
 }
 
+// Counts the receive latencies in power of two milliseconds buckets.
+class LatencyHistogram {
+public:
+	void add(TimeMs latency);
+	void clear();
+
+	int count() const {
+		return _count;
+	}
+
+	// Returns the upper bound of the bucket holding the percentile.
+	TimeMs percentile(int percent) const;
+
+private:
+	static constexpr auto kBucketsCount = 16;
+	std::array<int, kBucketsCount> _buckets = { { 0 } };
+	int _count = 0;
+
+};
+
 class Session;
 class SessionData {
 public:
@@ -176,9 +197,6 @@ public:
 	QReadWriteLock *receivedIdsMutex() const {
 		return &_receivedIdsLock;
 	}
-	QReadWriteLock *haveReceivedMutex() const {
-		return &_haveReceivedLock;
-	}
 	QReadWriteLock *stateRequestMutex() const {
 		return &_stateRequestLock;
 	}
@@ -213,17 +231,41 @@ public:
 	const mtpRequestIdsMap &wereAckedMap() const {
 		return _wereAcked;
 	}
-	QMap<mtpRequestId, SerializedMessage> &haveReceivedResponses() {
-		return _receivedResponses;
-	}
-	const QMap<mtpRequestId, SerializedMessage> &haveReceivedResponses() const {
-		return _receivedResponses;
+	// Received messages are pushed by the connection thread and popped by
+	// the main thread, the connection thread is switched only after the old
+	// connection is stopped under its sessionDataMutex.
+	//
+	// The packet receive time is passed only when the receive stats are measured.
+	void pushReceivedResponse(mtpRequestId requestId, SerializedMessage &&response, TimeMs receivedAt = 0) {
+		_receivedResponses.push(ReceivedMessage(requestId, std::move(response), receivedAt));
+	}
+	void pushReceivedUpdate(SerializedMessage &&update, TimeMs receivedAt = 0) {
+		_receivedUpdates.push(ReceivedMessage(0, std::move(update), receivedAt));
+	}
+	bool popReceivedResponse(mtpRequestId &requestId, SerializedMessage &response, TimeMs &receivedAt) {
+		auto result = ReceivedMessage();
+		if (!_receivedResponses.pop(result)) {
+			return false;
+		}
+		requestId = result.requestId;
+		response = std::move(result.message);
+		receivedAt = result.receivedAt;
+		return true;
+	}
+	bool popReceivedUpdate(SerializedMessage &update, TimeMs &receivedAt) {
+		auto result = ReceivedMessage();
+		if (!_receivedUpdates.pop(result)) {
+			return false;
+		}
+		update = std::move(result.message);
+		receivedAt = result.receivedAt;
+		return true;
 	}
-	QList<SerializedMessage> &haveReceivedUpdates() {
-		return _receivedUpdates;
+	int receivedResponsesCount() const {
+		return _receivedResponses.size();
 	}
-	const QList<SerializedMessage> &haveReceivedUpdates() const {
-		return _receivedUpdates;
+	int receivedUpdatesCount() const {
+		return _receivedUpdates.size();
 	}
 	mtpMsgIdsSet &stateRequestMap() {
 		return _stateRequest;
@@ -246,7 +288,7 @@ public:
 		return result * 2 + (needAck ? 1 : 0);
 	}
 
-	void clear(Instance *instance);
+	void clear();
 
 private:
 	uint64 _session = 0;
@@ -267,8 +309,20 @@ private:
 	mtpRequestIdsMap _wereAcked; // map of msg_id -> request_id, this msg_ids already were acked or do not need ack
 	mtpMsgIdsSet _stateRequest; // set of msg_id's, whose state should be requested
 
-	QMap<mtpRequestId, SerializedMessage> _receivedResponses; // map of request_id -> response that should be processed in the main thread
-	QList<SerializedMessage> _receivedUpdates; // list of updates that should be processed in the main thread
+	struct ReceivedMessage {
+		ReceivedMessage() = default;
+		ReceivedMessage(mtpRequestId requestId, SerializedMessage &&message, TimeMs receivedAt)
+		: requestId(requestId)
+		, message(std::move(message))
+		, receivedAt(receivedAt) {
+		}
+
+		mtpRequestId requestId = 0;
+		SerializedMessage message;
+		TimeMs receivedAt = 0;
+	};
+	base::spsc_queue<ReceivedMessage> _receivedResponses; // responses with their request_id that should be processed in the main thread
+	base::spsc_queue<ReceivedMessage> _receivedUpdates; // updates that should be processed in the main thread
 
 	// mutexes
 	mutable QReadWriteLock _lock;
@@ -277,7 +331,6 @@ private:
 	mutable QReadWriteLock _toResendLock;
 	mutable QReadWriteLock _receivedIdsLock;
 	mutable QReadWriteLock _wereAckedLock;
-	mutable QReadWriteLock _haveReceivedLock;
 	mutable QReadWriteLock _stateRequestLock;
 
 };
@@ -348,6 +401,9 @@ private:
 	mtpRequest getRequest(mtpRequestId requestId);
 	bool rpcErrorOccured(mtpRequestId requestId, const RPCFailHandlerPtr &onFail, const RPCError &err);
 
+	void countReceived(TimeMs receivedAt);
+	void logReceiveStats();
+
 	gsl::not_null<Instance*> _instance;
 	std::unique_ptr<Connection> _connection;
 
@@ -364,6 +420,10 @@ private:
 
 	bool _ping = false;
 
+	// Receive stats, measured only when the debug logging is enabled.
+	LatencyHistogram _receiveLatency;
+	TimeMs _receiveStatsStart = 0;
+
 	QTimer timeouter;
 	SingleTimer sender;
 
@@ -0,0 +1,657 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop version of Telegram messaging app, see https://telegram.org
+
+Telegram Desktop is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+It is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+In addition, as a special exception, the copyright holders give permission
+to link the code of portions of this program with the OpenSSL library.
+
+Full license: https://github.com/telegramdesktop/tdesktop/blob/master/LICENSE
+Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
+*/
+#include "storage/cache_store.h"
+
+namespace Storage {
+namespace {
+
+constexpr auto kRecordMagic = quint32(0x43445424); // '$TDC'
+constexpr auto kRecordAlignment = 16;
+constexpr auto kSegmentSizeLimit = qint64(64 * 1024 * 1024);
+constexpr auto kSegmentFilePrefix = "segment_";
+constexpr auto kEvictSelectChunk = 64;
+constexpr auto kTouchedWriteCount = 64;
+
+enum RecordFlag : uchar {
+	RecordRemoved = 0x01,
+	RecordTouched = 0x02,
+};
+
+struct RecordHeader {
+	quint32 magic;
+	uchar category;
+	uchar flags;
+	uchar reserved[2];
+	quint64 first;
+	quint64 second;
+	qint32 size;
+	quint32 access; // last access tick
+};
+static_assert(sizeof(RecordHeader) == 32, "Bad RecordHeader size.");
+
+RecordHeader prepareHeader(uchar category, const StorageKey &key, uchar flags, quint64 access, qint32 size) {
+	RecordHeader result = { 0 };
+	result.magic = kRecordMagic;
+	result.category = category;
+	result.flags = flags;
+	result.first = key.first;
+	result.second = key.second;
+	result.size = size;
+	result.access = quint32(access);
+	return result;
+}
+
+qint64 lowWaterMark(qint64 limit) {
+	return (limit / 4) * 3;
+}
+
+qint64 recordLength(qint32 size) {
+	auto result = qint64(sizeof(RecordHeader)) + size;
+	if (result % kRecordAlignment) {
+		result += kRecordAlignment - (result % kRecordAlignment);
+	}
+	return result;
+}
+
+} // namespace
+
+CacheStore::CacheStore(const QString &path) : _path(path) {
+	if (!_path.endsWith('/')) {
+		_path += '/';
+	}
+}
+
+QString CacheStore::segmentPath(int index) const {
+	return _path + kSegmentFilePrefix + QString::number(index);
+}
+
+bool CacheStore::open() {
+	QMutexLocker lock(&_mutex);
+	closeAll();
+
+	if (!QDir().exists(_path) && !QDir().mkpath(_path)) {
+		LOG(("Cache Error: could not create cache folder '%1'").arg(_path));
+		return (_valid = false);
+	}
+
+	auto indices = std::vector<int>();
+	auto list = QDir(_path).entryList(QStringList(QString(kSegmentFilePrefix) + '*'), QDir::Files);
+	for_const (auto &name, list) {
+		auto ok = false;
+		auto index = name.mid(qstr(kSegmentFilePrefix).size()).toInt(&ok);
+		if (ok && index > 0) {
+			indices.push_back(index);
+		}
+	}
+	std::sort(indices.begin(), indices.end());
+
+	for (auto index : indices) {
+		auto segment = createSegment(index);
+		if (!segment || !scanSegment(*segment)) {
+			LOG(("Cache Error: could not read segment %1, dropping it").arg(index));
+			if (segment) {
+				segment->file->close();
+				_segments.erase(index);
+			}
+			QFile::remove(segmentPath(index));
+		}
+	}
+	for (auto i = _index.cbegin(), e = _index.cend(); i != e; ++i) {
+		auto segment = findSegment(i.value().segment);
+		t_assert(segment != nullptr);
+		segment->liveBytes += recordLength(i.value().size);
+		++_counts[i.key().first];
+		_sizes[i.key().first] += i.value().size;
+		_totalSize += i.value().size;
+	}
+	_activeSegment = _segments.empty() ? 1 : _segments.rbegin()->first;
+
+	LOG(("Cache Info: opened cache store with %1 records in %2 segments").arg(_index.size()).arg(_segments.size()));
+	return (_valid = true);
+}
+
+CacheStore::Segment *CacheStore::findSegment(int index) {
+	auto i = _segments.find(index);
+	return (i != _segments.end()) ? &i->second : nullptr;
+}
+
+CacheStore::Segment *CacheStore::createSegment(int index) {
+	if (!QDir().exists(_path)) {
+		QDir().mkpath(_path);
+	}
+	auto &segment = _segments[index];
+	segment.index = index;
+	segment.file = std::make_unique<QFile>(segmentPath(index));
+	if (!segment.file->open(QIODevice::ReadWrite)) {
+		LOG(("Cache Error: could not open segment '%1'").arg(segment.file->fileName()));
+		_segments.erase(index);
+		return nullptr;
+	}
+	segment.writeOffset = segment.file->size();
+	return &segment;
+}
+
+CacheStore::Segment *CacheStore::writableSegment(qint64 required) {
+	auto segment = findSegment(_activeSegment);
+	if (segment && segment->writeOffset > 0 && segment->writeOffset + required > kSegmentSizeLimit) {
+		segment = nullptr;
+		++_activeSegment;
+	}
+	return segment ? segment : createSegment(_activeSegment);
+}
+
+bool CacheStore::readAt(Segment &segment, qint64 offset, char *buffer, qint64 length) {
+	if (offset < 0 || length <= 0 || offset + length > segment.writeOffset) {
+		return false;
+	}
+	auto mapped = segment.file->map(offset, length);
+	if (!mapped) {
+		LOG(("Cache Error: could not map %1 bytes of segment '%2' at %3").arg(length).arg(segment.file->fileName()).arg(offset));
+		return false;
+	}
+	memcpy(buffer, mapped, length);
+	segment.file->unmap(mapped);
+	return true;
+}
+
+bool CacheStore::scanSegment(Segment &segment) {
+	if (!segment.writeOffset) {
+		return true;
+	}
+
+	// The segment is mapped only for the scan, the records are mapped one
+	// by one later when they are read.
+	auto mapped = segment.file->map(0, segment.writeOffset);
+	if (!mapped) {
+		LOG(("Cache Error: could not map segment '%1'").arg(segment.file->fileName()));
+		return false;
+	}
+	auto size = segment.writeOffset;
+	scanRecords(segment, mapped);
+	segment.file->unmap(mapped);
+	if (segment.writeOffset != size) {
+		segment.file->resize(segment.writeOffset);
+	}
+	return true;
+}
+
+void CacheStore::scanRecords(Segment &segment, const uchar *data) {
+	auto offset = qint64(0);
+	while (offset + qint64(sizeof(RecordHeader)) <= segment.writeOffset) {
+		RecordHeader header;
+		memcpy(&header, data + offset, sizeof(header));
+		if (header.magic != kRecordMagic || header.size < 0 || offset + recordLength(header.size) > segment.writeOffset) {
+			break;
+		}
+		auto key = Key(header.category, StorageKey(header.first, header.second));
+		_accessTick = qMax(_accessTick, quint64(header.access));
+		if (header.flags & RecordRemoved) {
+			_index.remove(key);
+		} else if (header.flags & RecordTouched) {
+			auto i = _index.find(key);
+			if (i != _index.end()) {
+				i.value().lastAccess = qMax(i.value().lastAccess, quint64(header.access));
+			}
+		} else {
+			auto &entry = _index[key];
+			entry.segment = segment.index;
+			entry.offset = offset;
+			entry.size = header.size;
+			entry.lastAccess = header.access;
+		}
+		offset += recordLength(header.size);
+	}
+	if (offset != segment.writeOffset) {
+		// Torn write at the end of the segment, drop the tail.
+		LOG(("Cache Info: truncating segment %1 from %2 to %3").arg(segment.index).arg(segment.writeOffset).arg(offset));
+		segment.writeOffset = offset;
+	}
+}
+
+bool CacheStore::appendRecord(uchar category, const StorageKey &key, uchar flags, quint64 access, const char *data, qint32 size, Entry *written) {
+	auto length = recordLength(size);
+	auto segment = writableSegment(length);
+	if (!segment) {
+		return false;
+	}
+
+	auto header = prepareHeader(category, key, flags, access, size);
+
+	char padding[kRecordAlignment] = { 0 };
+	auto paddingSize = length - qint64(sizeof(header)) - size;
+	auto &file = *segment->file;
+	if (!file.seek(segment->writeOffset)
+		|| file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)
+		|| (size > 0 && file.write(data, size) != size)
+		|| (paddingSize > 0 && file.write(padding, paddingSize) != paddingSize)
+		|| !file.flush()) {
+		LOG(("Cache Error: could not write to segment '%1'").arg(file.fileName()));
+		file.resize(segment->writeOffset);
+		return false;
+	}
+	if (written) {
+		written->segment = segment->index;
+		written->offset = segment->writeOffset;
+		written->size = size;
+		written->lastAccess = access;
+	}
+	segment->writeOffset += length;
+	return true;
+}
+
+bool CacheStore::appendMarkers(const std::vector<Key> &keys, uchar flags) {
+	if (keys.empty()) {
+		return true;
+	}
+	auto length = recordLength(0);
+	auto segment = writableSegment(length * keys.size());
+	if (!segment) {
+		return false;
+	}
+
+	auto buffer = QByteArray(length * keys.size(), 0);
+	auto data = buffer.data();
+	for (auto &key : keys) {
+		auto access = (flags & RecordTouched) ? _index.value(key).lastAccess : 0;
+		auto header = prepareHeader(key.first, key.second, flags, access, 0);
+		memcpy(data, &header, sizeof(header));
+		data += length;
+	}
+
+	auto &file = *segment->file;
+	if (!file.seek(segment->writeOffset)
+		|| file.write(buffer) != buffer.size()
+		|| !file.flush()) {
+		LOG(("Cache Error: could not write to segment '%1'").arg(file.fileName()));
+		file.resize(segment->writeOffset);
+		return false;
+	}
+	segment->writeOffset += buffer.size();
+	return true;
+}
+
+void CacheStore::writeTouched() {
+	auto keys = std::vector<Key>();
+	keys.reserve(_touched.size());
+	for (auto &key : _touched) {
+		if (_index.contains(key)) {
+			keys.push_back(key);
+		}
+	}
+	if (appendMarkers(keys, RecordTouched)) {
+		_touched.clear();
+	}
+}
+
+void CacheStore::forgetEntry(const Key &key) {
+	auto i = _index.find(key);
+	if (i == _index.end()) {
+		return;
+	}
+	if (auto segment = findSegment(i.value().segment)) {
+		segment->liveBytes -= recordLength(i.value().size);
+	}
+	--_counts[key.first];
+	_sizes[key.first] -= i.value().size;
+	_totalSize -= i.value().size;
+	_index.erase(i);
+}
+
+bool CacheStore::put(CacheCategory category, const StorageKey &key, const QByteArray &data) {
+	return put(category, key, data, generation());
+}
+
+int CacheStore::generation() const {
+	QMutexLocker lock(&_mutex);
+	return _generation;
+}
+
+bool CacheStore::put(CacheCategory category, const StorageKey &key, const QByteArray &data, int generation) {
+	QMutexLocker lock(&_mutex);
+	if (!_valid || generation != _generation) {
+		return false;
+	}
+	auto entry = Entry();
+	auto indexKey = makeKey(category, key);
+	if (!appendRecord(indexKey.first, key, 0, _accessTick + 1, data.constData(), data.size(), &entry)) {
+		return false;
+	}
+	forgetEntry(indexKey);
+	++_accessTick;
+	_index.insert(indexKey, entry);
+	findSegment(entry.segment)->liveBytes += recordLength(entry.size);
+	++_counts[indexKey.first];
+	_sizes[indexKey.first] += entry.size;
+	_totalSize += entry.size;
+	return true;
+}
+
+bool CacheStore::contains(CacheCategory category, const StorageKey &key) const {
+	QMutexLocker lock(&_mutex);
+	return _index.contains(makeKey(category, key));
+}
+
+bool CacheStore::readRecord(const Entry &entry, QByteArray &result) {
+	auto segment = findSegment(entry.segment);
+	if (!segment) {
+		return false;
+	}
+	auto length = qint64(sizeof(RecordHeader)) + entry.size;
+	if (entry.offset + length > segment->writeOffset) {
+		return false;
+	}
+	auto mapped = segment->file->map(entry.offset, length);
+	if (!mapped) {
+		LOG(("Cache Error: could not map record in segment %1 at %2").arg(entry.segment).arg(entry.offset));
+		return false;
+	}
+	RecordHeader header;
+	memcpy(&header, mapped, sizeof(header));
+	auto valid = (header.magic == kRecordMagic && header.size == entry.size);
+	if (valid) {
+		result = QByteArray(reinterpret_cast<const char*>(mapped + sizeof(header)), entry.size);
+	} else {
+		LOG(("Cache Error: bad record header in segment %1 at %2").arg(entry.segment).arg(entry.offset));
+	}
+	segment->file->unmap(mapped);
+	return valid;
+}
+
+QByteArray CacheStore::get(CacheCategory category, const StorageKey &key) {
+	QMutexLocker lock(&_mutex);
+	auto i = _index.find(makeKey(category, key));
+	if (i == _index.end()) {
+		++_stats.misses;
+		return QByteArray();
+	}
+	auto result = QByteArray();
+	if (!readRecord(i.value(), result)) {
+		++_stats.misses;
+		return QByteArray();
+	}
+	i.value().lastAccess = ++_accessTick;
+	++_stats.hits;
+
+	_touched.insert(i.key());
+	if (_touched.size() >= kTouchedWriteCount) {
+		writeTouched();
+	}
+	return result;
+}
+
+bool CacheStore::copy(CacheCategory category, const StorageKey &from, const StorageKey &to) {
+	auto data = get(category, from);
+	if (data.isEmpty()) {
+		return false;
+	}
+	return put(category, to, data);
+}
+
+void CacheStore::remove(CacheCategory category, const StorageKey &key) {
+	QMutexLocker lock(&_mutex);
+	auto indexKey = makeKey(category, key);
+	if (!_valid || !_index.contains(indexKey)) {
+		return;
+	}
+	if (appendRecord(indexKey.first, key, RecordRemoved, 0, nullptr, 0, nullptr)) {
+		forgetEntry(indexKey);
+	}
+}
+
+void CacheStore::clear() {
+	QMutexLocker lock(&_mutex);
+	auto indices = std::vector<int>();
+	for (auto &segment : _segments) {
+		indices.push_back(segment.first);
+	}
+	closeAll();
+	for (auto index : indices) {
+		QFile::remove(segmentPath(index));
+	}
+	_activeSegment = 1;
+	++_generation;
+}
+
+int CacheStore::count(CacheCategory category) const {
+	QMutexLocker lock(&_mutex);
+	auto i = _counts.find(static_cast<uchar>(category));
+	return (i != _counts.cend()) ? i->second : 0;
+}
+
+qint64 CacheStore::size(CacheCategory category) const {
+	QMutexLocker lock(&_mutex);
+	auto i = _sizes.find(static_cast<uchar>(category));
+	return (i != _sizes.cend()) ? i->second : 0;
+}
+
+qint64 CacheStore::totalSize() const {
+	QMutexLocker lock(&_mutex);
+	return _totalSize;
+}
+
+void CacheStore::setLimits(const CacheLimits &limits) {
+	QMutexLocker lock(&_mutex);
+	_limits = limits;
+}
+
+CacheStats CacheStore::stats() const {
+	QMutexLocker lock(&_mutex);
+	return _stats;
+}
+
+bool CacheStore::overLimit(uchar category) const {
+	auto limit = _limits.categories[CacheCategoryIndex(static_cast<CacheCategory>(category))];
+	if (!limit) {
+		return false;
+	}
+	auto i = _sizes.find(category);
+	return (i != _sizes.cend()) && (i->second > limit);
+}
+
+bool CacheStore::overTotalLimit() const {
+	return _limits.total && (_totalSize > _limits.total);
+}
+
+bool CacheStore::evictionNeeded() const {
+	QMutexLocker lock(&_mutex);
+	if (overTotalLimit()) {
+		return true;
+	}
+	for (auto &size : _sizes) {
+		if (overLimit(size.first)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void CacheStore::evict() {
+	QMutexLocker lock(&_mutex);
+	if (!_valid) {
+		return;
+	}
+
+	// Evict a bit more than required, so that the next puts do not start
+	// another eviction pass right away.
+	auto totalExcess = overTotalLimit() ? (_totalSize - lowWaterMark(_limits.total)) : qint64(0);
+	auto categoriesExcess = std::map<uchar, qint64>();
+	for (auto &size : _sizes) {
+		if (overLimit(size.first)) {
+			auto limit = _limits.categories[CacheCategoryIndex(static_cast<CacheCategory>(size.first))];
+			categoriesExcess.emplace(size.first, size.second - lowWaterMark(limit));
+		}
+	}
+	if (totalExcess <= 0 && categoriesExcess.empty()) {
+		return;
+	}
+	writeTouched();
+
+	auto candidates = std::vector<QPair<quint64, Key>>();
+	candidates.reserve(_index.size());
+	for (auto i = _index.cbegin(), e = _index.cend(); i != e; ++i) {
+		candidates.push_back(qMakePair(i.value().lastAccess, i.key()));
+	}
+
+	// Usually only a small part of the entries is evicted, so only the
+	// oldest entries are ordered, in chunks growing twice each time.
+	auto victims = std::vector<Key>();
+	auto victimsSize = qint64(0);
+	auto ordered = candidates.begin();
+	for (auto i = candidates.begin(), e = candidates.end(); i != e; ++i) {
+		if (totalExcess <= 0 && categoriesExcess.empty()) {
+			break;
+		}
+		if (i == ordered) {
+			auto chunk = qMax(int(ordered - candidates.begin()), kEvictSelectChunk);
+			ordered += qMin(chunk, int(e - ordered));
+			std::partial_sort(i, ordered, e);
+		}
+		auto &key = i->second;
+		auto category = categoriesExcess.find(key.first);
+		if (totalExcess <= 0 && category == categoriesExcess.end()) {
+			continue;
+		}
+		auto size = _index.value(key).size;
+		victims.push_back(key);
+		victimsSize += size;
+		totalExcess -= size;
+		if (category != categoriesExcess.end()) {
+			category->second -= size;
+			if (category->second <= 0) {
+				categoriesExcess.erase(category);
+			}
+		}
+	}
+
+	if (!appendMarkers(victims, RecordRemoved)) {
+		return;
+	}
+	for (auto &key : victims) {
+		forgetEntry(key);
+	}
+	_stats.evicted += victims.size();
+	_stats.evictedBytes += victimsSize;
+	DEBUG_LOG(("Cache Info: evicted %1 entries (%2 bytes), %3 entries (%4 bytes) in total").arg(victims.size()).arg(victimsSize).arg(_stats.evicted).arg(_stats.evictedBytes));
+}
+
+bool CacheStore::sparse(const Segment &segment) const {
+	return (segment.index != _activeSegment)
+		&& (segment.writeOffset > 0)
+		&& (segment.liveBytes * 2 < segment.writeOffset);
+}
+
+bool CacheStore::compactionNeeded() const {
+	QMutexLocker lock(&_mutex);
+	for (auto &segment : _segments) {
+		if (sparse(segment.second)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void CacheStore::compact() {
+	while (true) {
+		auto index = 0;
+		auto hasOlder = false;
+		{
+			QMutexLocker lock(&_mutex);
+			for (auto &segment : _segments) {
+				if (sparse(segment.second)) {
+					index = segment.first;
+					break;
+				}
+				hasOlder = true;
+			}
+		}
+		if (!index) {
+			return;
+		}
+
+		// Move record by record, so that readers are not blocked for long.
+		auto offset = qint64(0);
+		while (true) {
+			if (QThread::currentThread()->isInterruptionRequested()) {
+				return;
+			}
+			QMutexLocker lock(&_mutex);
+			auto segment = findSegment(index);
+			if (!segment) {
+				break; // Cleared while compacting.
+			}
+			if (offset + qint64(sizeof(RecordHeader)) > segment->writeOffset) {
+				// All the live records were moved, the segment is done.
+				segment->file->remove();
+				_segments.erase(index);
+				break;
+			}
+			RecordHeader header;
+			if (!readAt(*segment, offset, reinterpret_cast<char*>(&header), sizeof(header))) {
+				return; // Try again next time.
+			}
+			auto key = StorageKey(header.first, header.second);
+			auto indexKey = Key(header.category, key);
+			auto i = _index.find(indexKey);
+			if (header.flags & RecordRemoved) {
+				// Older segments may still hold the removed record.
+				if (hasOlder && i == _index.end()) {
+					appendRecord(header.category, key, RecordRemoved, 0, nullptr, 0, nullptr);
+				}
+			} else if (header.flags & RecordTouched) {
+				// The moved records keep the last access tick in the header.
+			} else if (i != _index.end() && i.value().segment == index && i.value().offset == offset) {
+				auto data = QByteArray();
+				auto moved = Entry();
+				if (readRecord(i.value(), data)
+					&& appendRecord(header.category, key, 0, i.value().lastAccess, data.constData(), data.size(), &moved)) {
+					segment->liveBytes -= recordLength(i.value().size);
+					findSegment(moved.segment)->liveBytes += recordLength(moved.size);
+					i.value() = moved;
+				} else {
+					return; // Try again next time.
+				}
+			}
+			offset += recordLength(header.size);
+		}
+	}
+}
+
+void CacheStore::closeAll() {
+	for (auto &segment : _segments) {
+		segment.second.file->close();
+	}
+	_segments.clear();
+	_index.clear();
+	_touched.clear();
+	_counts.clear();
+	_sizes.clear();
+	_totalSize = 0;
+}
+
+CacheStore::~CacheStore() {
+	QMutexLocker lock(&_mutex);
+	if (_valid) {
+		writeTouched();
+	}
+	closeAll();
+}
+
+} // namespace Storage
@@ -0,0 +1,163 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop version of Telegram messaging app, see https://telegram.org
+
+Telegram Desktop is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+It is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+In addition, as a special exception, the copyright holders give permission
+to link the code of portions of this program with the OpenSSL library.
+
+Full license: https://github.com/telegramdesktop/tdesktop/blob/master/LICENSE
+Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
+*/
+#pragma once
+
+namespace Storage {
+
+enum class CacheCategory : uchar {
+	Image = 0x01,
+	StickerImage = 0x02,
+	Audio = 0x03,
+	WebFile = 0x04,
+};
+constexpr auto kCacheCategoriesCount = 4;
+
+inline int CacheCategoryIndex(CacheCategory category) {
+	return static_cast<int>(category) - 1;
+}
+
+struct CacheLimits {
+	qint64 total = 0; // 0 - unlimited
+	std::array<qint64, kCacheCategoriesCount> categories = { { 0 } };
+};
+
+struct CacheStats {
+	quint64 hits = 0;
+	quint64 misses = 0;
+	quint64 evicted = 0;
+	qint64 evictedBytes = 0;
+};
+
+// Append-only storage for the local media cache.
+//
+// All records live in a few large segment files inside one folder, each
+// record is a fixed header followed by an opaque (already encrypted) blob.
+// Removals append a tombstone, so the in-memory index can be rebuilt by
+// a single pass over the segment headers on start. Only the record being
+// read is mapped through QFile::map() and only while it is read, so the
+// address space use does not grow with the cache size. Segments are
+// compacted when most of their bytes are dead.
+//
+// Each entry remembers its last access tick, when the size limits are
+// exceeded the least recently used entries are removed by evict(). The
+// tick is written to the record header and the accesses are appended in
+// batches as small touch records, so the order survives restarts.
+//
+// The store is used from the main thread (writes) and from the local
+// loader thread (reads, eviction, compaction), all the state is guarded
+// by a mutex.
+class CacheStore final {
+public:
+	explicit CacheStore(const QString &path);
+
+	bool open();
+	bool valid() const {
+		return _valid;
+	}
+
+	bool put(CacheCategory category, const StorageKey &key, const QByteArray &data);
+
+	// Each clear() starts a new generation, so that a background writer
+	// started before it does not put the cleared data back.
+	int generation() const;
+	bool put(CacheCategory category, const StorageKey &key, const QByteArray &data, int generation);
+	bool contains(CacheCategory category, const StorageKey &key) const;
+	QByteArray get(CacheCategory category, const StorageKey &key);
+	bool copy(CacheCategory category, const StorageKey &from, const StorageKey &to);
+	void remove(CacheCategory category, const StorageKey &key);
+	void clear();
+
+	int count(CacheCategory category) const;
+	qint64 size(CacheCategory category) const;
+	qint64 totalSize() const;
+
+	void setLimits(const CacheLimits &limits);
+	CacheStats stats() const;
+
+	// Returns true if some size limit is exceeded.
+	bool evictionNeeded() const;
+
+	// Removes least recently used entries until the exceeded limits are
+	// satisfied with a margin, down to 3/4 of each of them.
+	void evict();
+
+	// Returns true if some segment should be compacted.
+	bool compactionNeeded() const;
+
+	// Moves live records out of sparse segments, may be called from any thread.
+	void compact();
+
+	~CacheStore();
+
+private:
+	struct Entry {
+		int segment = 0;
+		qint64 offset = 0;
+		qint32 size = 0;
+		quint64 lastAccess = 0;
+	};
+	struct Segment {
+		int index = 0;
+		std::unique_ptr<QFile> file;
+		qint64 writeOffset = 0;
+		qint64 liveBytes = 0;
+	};
+	using Key = QPair<uchar, StorageKey>;
+	static Key makeKey(CacheCategory category, const StorageKey &key) {
+		return Key(static_cast<uchar>(category), key);
+	}
+
+	QString segmentPath(int index) const;
+	Segment *findSegment(int index);
+	Segment *createSegment(int index);
+	Segment *writableSegment(qint64 required);
+	bool readAt(Segment &segment, qint64 offset, char *buffer, qint64 length);
+	bool scanSegment(Segment &segment);
+	void scanRecords(Segment &segment, const uchar *data);
+	bool appendRecord(uchar category, const StorageKey &key, uchar flags, quint64 access, const char *data, qint32 size, Entry *written);
+	bool appendMarkers(const std::vector<Key> &keys, uchar flags);
+	void writeTouched();
+	void forgetEntry(const Key &key);
+	bool readRecord(const Entry &entry, QByteArray &result);
+	void closeAll();
+	bool sparse(const Segment &segment) const;
+	bool overLimit(uchar category) const;
+	bool overTotalLimit() const;
+
+	QString _path;
+	bool _valid = false;
+
+	mutable QMutex _mutex;
+	std::map<int, Segment> _segments;
+	int _activeSegment = 0;
+	QMap<Key, Entry> _index;
+	std::map<uchar, int> _counts;
+	std::map<uchar, qint64> _sizes;
+	qint64 _totalSize = 0;
+	quint64 _accessTick = 0;
+	std::set<Key> _touched;
+	int _generation = 0;
+	CacheLimits _limits;
+	CacheStats _stats;
+
+};
+
+} // namespace Storage
@@ -26,6 +26,22 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "storage/localstorage.h"
 #include "platform/platform_file_utilities.h"
 #include "auth_session.h"
+#include "base/task_queue.h"
+
+namespace {
+
+constexpr auto kDownloadPhotoPartSize = 64 * 1024; // 64kb for photo
+constexpr auto kDownloadDocumentPartSize = 128 * 1024; // 128kb for document
+constexpr auto kDownloadMaxPartSize = 512 * 1024; // 512kb is the protocol maximum
+constexpr auto kResumeStateSaveBytes = 1024 * 1024; // save the resume state each 1mb received
+constexpr auto kDefaultFileQueries = 16; // 16 file parts downloaded at the same time, until the link is measured
+constexpr auto kMinFileQueries = 8;
+constexpr auto kMaxFileQueries = 32;
+constexpr auto kMaxWebFileQueries = 8; // max 8 http[s] files downloaded at the same time
+constexpr auto kThroughputWindow = TimeMs(500);
+constexpr auto kMinRoundTripWindow = TimeMs(10000);
+
+} // namespace
 
 namespace Storage {
 
@@ -48,8 +64,15 @@ void Downloader::requestedAmountIncrement(MTP::DcId dcId, int index, int amount)
 	if (it == _requestedBytesAmount.cend()) {
 		it = _requestedBytesAmount.emplace(dcId, RequestedInDc { { 0 } }).first;
 	}
+	auto wasIdle = (it->second[index] == 0);
 	it->second[index] += amount;
 	if (it->second[index]) {
+		if (wasIdle) {
+			// Don't count the idle time in the throughput window.
+			auto &estimate = _estimates[dcId][index];
+			estimate.windowBytes = 0;
+			estimate.windowStart = getms(true);
+		}
 		Messenger::Instance().killDownloadSessionsStop(dcId);
 	} else {
 		Messenger::Instance().killDownloadSessionsStart(dcId);
@@ -69,6 +92,65 @@ int Downloader::chooseDcIndexForRequest(MTP::DcId dcId) const {
 	return result;
 }
 
+void Downloader::requestFinished(MTP::DcId dcId, int index, int bytes, TimeMs duration) {
+	Expects(index >= 0 && index < MTP::kDownloadSessionsCount);
+	auto now = getms(true);
+	auto &estimate = _estimates[dcId][index];
+
+	// The minimal round trip time is the latency without the queueing,
+	// it is measured again from time to time to follow route changes.
+	duration = qMax(duration, TimeMs(1));
+	if (!estimate.minRoundTrip
+		|| duration < estimate.minRoundTrip
+		|| now - estimate.minRoundTripUpdated > kMinRoundTripWindow) {
+		estimate.minRoundTrip = duration;
+		estimate.minRoundTripUpdated = now;
+	}
+
+	estimate.windowBytes += bytes;
+	auto elapsed = now - estimate.windowStart;
+	if (estimate.windowStart && elapsed >= kThroughputWindow) {
+		auto rate = (estimate.windowBytes * 1000) / elapsed;
+		estimate.bytesPerSecond = estimate.bytesPerSecond
+			? (estimate.bytesPerSecond * 3 + rate) / 4
+			: rate;
+		estimate.windowBytes = 0;
+		estimate.windowStart = now;
+	}
+}
+
+int64 Downloader::bandwidthDelayProduct(MTP::DcId dcId) const {
+	auto result = int64(0);
+	auto it = _estimates.find(dcId);
+	if (it != _estimates.cend()) {
+		for (auto &estimate : it->second) {
+			result += (estimate.bytesPerSecond * estimate.minRoundTrip) / 1000;
+		}
+	}
+	return result;
+}
+
+int Downloader::partSizeForRequest(MTP::DcId dcId, int minimalPartSize) const {
+	// Keep twice the bandwidth-delay product in flight with the default
+	// queries count, growing the part size by powers of two.
+	auto wanted = (2 * bandwidthDelayProduct(dcId)) / kDefaultFileQueries;
+	auto result = minimalPartSize;
+	while (result < kDownloadMaxPartSize && result < wanted) {
+		result *= 2;
+	}
+	return result;
+}
+
+int Downloader::queriesLimit(MTP::DcId dcId) const {
+	auto inFlight = 2 * bandwidthDelayProduct(dcId);
+	if (!inFlight) {
+		return kDefaultFileQueries;
+	}
+	auto partSize = partSizeForRequest(dcId, kDownloadDocumentPartSize);
+	auto result = int((inFlight + partSize - 1) / partSize) + MTP::kDownloadSessionsCount;
+	return snap(result, kMinFileQueries, kMaxFileQueries);
+}
+
 Downloader::~Downloader() {
 	// The file loaders have pointer to downloader and they cancel
 	// requests in destructor where they use that pointer, so all
@@ -78,15 +160,6 @@ Downloader::~Downloader() {
 
 } // namespace Storage
 
-namespace {
-
-constexpr auto kDownloadPhotoPartSize = 64 * 1024; // 64kb for photo
-constexpr auto kDownloadDocumentPartSize = 128 * 1024; // 128kb for document
-constexpr auto kMaxFileQueries = 16; // max 16 file parts downloaded at the same time
-constexpr auto kMaxWebFileQueries = 8; // max 8 http[s] files downloaded at the same time
-
-} // namespace
-
 struct FileLoaderQueue {
 	FileLoaderQueue(int queriesLimit) : queriesLimit(queriesLimit) {
 	}
@@ -123,29 +196,67 @@ FileLoader::FileLoader(const QString &toFile, int32 size, LocationType locationT
 , _locationType(locationType) {
 }
 
+namespace {
+
+QImage DecodeImage(const QByteArray &data, const QSize &shrinkBox, QByteArray *format) {
+	auto image = App::readImage(data, format, false);
+	if (!image.isNull() && !shrinkBox.isEmpty() && (image.width() > shrinkBox.width() || image.height() > shrinkBox.height())) {
+		return image.scaled(shrinkBox, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+	}
+	return image;
+}
+
+} // namespace
+
 QByteArray FileLoader::imageFormat(const QSize &shrinkBox) const {
-	if (_imageFormat.isEmpty() && _locationType == UnknownFileLocation) {
+	if (_imageFormat.isEmpty() && _locationType == UnknownFileLocation && !_imageDecoded) {
 		readImage(shrinkBox);
 	}
 	return _imageFormat;
 }
 
 QPixmap FileLoader::imagePixmap(const QSize &shrinkBox) const {
-	if (_imagePixmap.isNull() && _locationType == UnknownFileLocation) {
+	if (_imagePixmap.isNull() && _locationType == UnknownFileLocation && !_imageDecoded) {
 		readImage(shrinkBox);
 	}
 	return _imagePixmap;
 }
 
+bool FileLoader::imageReady(const QSize &shrinkBox) const {
+	if (_cancelled || !_imagePixmap.isNull() || _imageDecoded || _locationType != UnknownFileLocation) {
+		return true;
+	} else if (!_finished) {
+		return false;
+	} else if (!_imageDecoding) {
+		_imageDecoding = std::make_shared<bool>(true);
+		auto guard = std::weak_ptr<bool>(_imageDecoding);
+		base::TaskQueue::Normal().Put([this, guard, data = _data, shrinkBox] {
+			if (guard.expired()) {
+				return;
+			}
+			auto format = QByteArray();
+			auto image = DecodeImage(data, shrinkBox, &format);
+			base::TaskQueue::Main().Put([this, guard, image = std::move(image), format]() mutable {
+				if (!guard.expired()) {
+					imageDecoded(std::move(image), format);
+					_downloader->taskFinished().notify();
+				}
+			});
+		});
+	}
+	return false;
+}
+
 void FileLoader::readImage(const QSize &shrinkBox) const {
 	auto format = QByteArray();
-	auto image = App::readImage(_data, &format, false);
+	imageDecoded(DecodeImage(_data, shrinkBox, &format), format);
+}
+
+void FileLoader::imageDecoded(QImage &&image, const QByteArray &format) const {
+	_imageDecoding = nullptr;
+	_imageDecoded = true;
 	if (!image.isNull()) {
-		if (!shrinkBox.isEmpty() && (image.width() > shrinkBox.width() || image.height() > shrinkBox.height())) {
-			_imagePixmap = App::pixmapFromImageInPlace(image.scaled(shrinkBox, Qt::KeepAspectRatio, Qt::SmoothTransformation));
-		} else {
-			_imagePixmap = App::pixmapFromImageInPlace(std::move(image));
-		}
+		_imagePixmap = App::pixmapFromImageInPlace(std::move(image));
 		_imageFormat = format;
 	}
 }
@@ -260,7 +371,16 @@ void FileLoader::start(bool loadFirst, bool prior) {
 	if (_paused) {
 		_paused = false;
 	}
-	if (_finished || tryLoadLocal()) return;
+	if (_finished) return;
+
+	// The cache read task is queued with our priority, so it must be the
+	// current one already. A loader in the queue has tried the cache before
+	// and keeps its priority to be found at its place in the queue below.
+	auto currentPriority = _downloader->currentPriority();
+	if (!_inQueue) {
+		_priority = currentPriority;
+	}
+	if (tryLoadLocal()) return;
 
 	if (_fromCloud == LoadFromLocalOnly) {
 		cancel();
@@ -268,13 +388,12 @@ void FileLoader::start(bool loadFirst, bool prior) {
 	}
 
 	if (!_fname.isEmpty() && _toCache == LoadToFileOnly && !_fileIsOpen) {
-		_fileIsOpen = _file.open(QIODevice::WriteOnly);
+		_fileIsOpen = openFile();
 		if (!_fileIsOpen) {
 			return cancel(true);
 		}
 	}
 
-	auto currentPriority = _downloader->currentPriority();
 	FileLoader *before = 0, *after = 0;
 	if (prior) {
 		if (_inQueue && _priority == currentPriority) {
@@ -367,15 +486,22 @@ void FileLoader::cancel() {
 	cancel(false);
 }
 
+bool FileLoader::openFile() {
+	return _file.open(QIODevice::WriteOnly);
+}
+
 void FileLoader::cancel(bool fail) {
 	bool started = currentOffset(true) > 0;
 	cancelRequests();
 	_cancelled = true;
 	_finished = true;
+	_imageDecoding = nullptr;
 	if (_fileIsOpen) {
 		_file.close();
 		_fileIsOpen = false;
-		_file.remove();
+		if (!keepPartialFile(fail)) {
+			_file.remove();
+		}
 	}
 	_data = QByteArray();
 	_fname = QString();
@@ -404,7 +530,7 @@ mtpFileLoader::mtpFileLoader(const StorageImageLocation *location, int32 size, L
 	auto shiftedDcId = MTP::downloadDcId(_dcId, 0);
 	auto i = queues.find(shiftedDcId);
 	if (i == queues.cend()) {
-		i = queues.insert(shiftedDcId, FileLoaderQueue(kMaxFileQueries));
+		i = queues.insert(shiftedDcId, FileLoaderQueue(kDefaultFileQueries));
 	}
 	_queue = &i.value();
 }
@@ -418,7 +544,7 @@ mtpFileLoader::mtpFileLoader(int32 dc, uint64 id, uint64 accessHash, int32 versi
 	auto shiftedDcId = MTP::downloadDcId(_dcId, 0);
 	auto i = queues.find(shiftedDcId);
 	if (i == queues.cend()) {
-		i = queues.insert(shiftedDcId, FileLoaderQueue(kMaxFileQueries));
+		i = queues.insert(shiftedDcId, FileLoaderQueue(kDefaultFileQueries));
 	}
 	_queue = &i.value();
 }
@@ -430,24 +556,153 @@ mtpFileLoader::mtpFileLoader(const WebFileImageLocation *location, int32 size, L
 	auto shiftedDcId = MTP::downloadDcId(_dcId, 0);
 	auto i = queues.find(shiftedDcId);
 	if (i == queues.cend()) {
-		i = queues.insert(shiftedDcId, FileLoaderQueue(kMaxFileQueries));
+		i = queues.insert(shiftedDcId, FileLoaderQueue(kDefaultFileQueries));
 	}
 	_queue = &i.value();
 }
 
 int32 mtpFileLoader::currentOffset(bool includeSkipped) const {
+	if (_resumable) {
+		auto result = 0;
+		for (auto &range : _completeRanges) {
+			result = includeSkipped ? range.second : (result + range.second - range.first);
+		}
+		return result;
+	}
 	return (_fileIsOpen ? _file.size() : _data.size()) - (includeSkipped ? 0 : _skippedBytes);
 }
 
+bool mtpFileLoader::openFile() {
+	_resumable = (_locationType != UnknownFileLocation) && (_size > 0) && !_location && !_urlLocation;
+	if (!_resumable) {
+		return FileLoader::openFile();
+	}
+
+	auto state = Local::readDownloadState(resumeKey());
+	if (!state.path.isEmpty() && state.size == _size && QFileInfo(state.path).isFile()) {
+		_file.setFileName(state.path);
+		if (_file.open(QIODevice::ReadWrite)) {
+			_completeRanges = state.ranges;
+			if (state.cdnDcId
+				&& state.cdnEncryptionKey.size() == MTP::CTRState::KeySize
+				&& state.cdnEncryptionIV.size() == MTP::CTRState::IvecSize) {
+				_cdnDcId = state.cdnDcId;
+				_cdnToken = state.cdnToken;
+				_cdnEncryptionKey = state.cdnEncryptionKey;
+				_cdnEncryptionIV = state.cdnEncryptionIV;
+			}
+
+			// Load the last part anyway, so that the download is finished by the part answer.
+			auto lastPartOffset = ((_size - 1) / kDownloadDocumentPartSize) * kDownloadDocumentPartSize;
+			removeCompleteRange(lastPartOffset, _size);
+			return true;
+		}
+	}
+
+	// The parts are written at their offsets, the skipped ranges are holes in the file.
+	_completeRanges.clear();
+	_file.setFileName(_fname + qsl(".part"));
+	return _file.open(QIODevice::WriteOnly);
+}
+
+bool mtpFileLoader::keepPartialFile(bool failed) {
+	if (!_resumable) {
+		return false;
+	} else if (failed) {
+		Local::removeDownloadState(resumeKey());
+		return false;
+	}
+	saveResumeState();
+	return true;
+}
+
+MediaKey mtpFileLoader::resumeKey() const {
+	return mediaKey(_locationType, _dcId, _id, _version);
+}
+
+void mtpFileLoader::saveResumeState() {
+	auto state = Local::DownloadState();
+	state.path = _file.fileName();
+	state.size = _size;
+	state.ranges = _completeRanges;
+	state.cdnDcId = _cdnDcId;
+	state.cdnToken = _cdnToken;
+	state.cdnEncryptionKey = _cdnEncryptionKey;
+	state.cdnEncryptionIV = _cdnEncryptionIV;
+	Local::writeDownloadState(resumeKey(), state);
+	_unsavedBytes = 0;
+}
+
+bool mtpFileLoader::finishPartialFile() {
+	if (QFileInfo(_fname).exists() && !QFile::remove(_fname)) {
+		return false;
+	} else if (!_file.rename(_fname)) {
+		return false;
+	}
+	Local::removeDownloadState(resumeKey());
+	return true;
+}
+
+void mtpFileLoader::addCompleteRange(int32 from, int32 till) {
+	if (from >= till) return;
+
+	auto i = std::lower_bound(_completeRanges.begin(), _completeRanges.end(), qMakePair(from, from));
+	if (i != _completeRanges.begin() && (i - 1)->second >= from) {
+		--i;
+	}
+	auto j = i;
+	while (j != _completeRanges.end() && j->first <= till) {
+		from = qMin(from, j->first);
+		till = qMax(till, j->second);
+		++j;
+	}
+	i = _completeRanges.erase(i, j);
+	_completeRanges.insert(i, qMakePair(from, till));
+}
+
+void mtpFileLoader::removeCompleteRange(int32 from, int32 till) {
+	auto result = QVector<QPair<int32, int32>>();
+	result.reserve(_completeRanges.size() + 1);
+	for (auto &range : _completeRanges) {
+		if (range.second <= from || range.first >= till) {
+			result.push_back(range);
+			continue;
+		}
+		if (range.first < from) {
+			result.push_back(qMakePair(range.first, from));
+		}
+		if (range.second > till) {
+			result.push_back(qMakePair(till, range.second));
+		}
+	}
+	_completeRanges = result;
+}
+
+int32 mtpFileLoader::nextCompleteFrom(int32 offset) const {
+	for (auto &range : _completeRanges) {
+		if (range.first > offset) {
+			return range.first;
+		}
+	}
+	return _size;
+}
+
 bool mtpFileLoader::loadPart() {
 	if (_finished || _lastComplete || (!_sentRequests.empty() && !_size)) {
 		return false;
-	} else if (_size && _nextRequestOffset >= _size) {
+	}
+	for (auto &range : _completeRanges) {
+		if (range.first <= _nextRequestOffset && _nextRequestOffset < range.second) {
+			_nextRequestOffset = range.second;
+		}
+	}
+	if (_size && _nextRequestOffset >= _size) {
 		return false;
 	}
 
-	makeRequest(_nextRequestOffset);
-	_nextRequestOffset += partSize();
+	auto limit = partSize();
+	makeRequest(_nextRequestOffset, limit);
+	_nextRequestOffset += limit;
 	return true;
 }
 
@@ -455,22 +710,34 @@ int mtpFileLoader::partSize() const {
 	if (_locationType == UnknownFileLocation) {
 		return kDownloadPhotoPartSize;
 	}
-	return kDownloadDocumentPartSize;
+	auto result = _downloader->partSizeForRequest(_cdnDcId ? _cdnDcId : _dcId, kDownloadDocumentPartSize);
+
+	// The offset must be divisible by the limit, so that a part
+	// never crosses a 1mb boundary, the part size grows gradually.
+	// When resuming the part should not overlap the next complete range.
+	auto till = _resumable ? nextCompleteFrom(_nextRequestOffset) : _size;
+	while (result > kDownloadDocumentPartSize
+		&& ((_nextRequestOffset % result) != 0
+			|| (_resumable && _nextRequestOffset + result > till))) {
+		result /= 2;
+	}
+	return result;
 }
 
-mtpFileLoader::RequestData mtpFileLoader::prepareRequest(int offset) const {
+mtpFileLoader::RequestData mtpFileLoader::prepareRequest(int offset, int limit) const {
 	auto result = RequestData();
 	result.dcId = _cdnDcId ? _cdnDcId : _dcId;
 	result.dcIndex = _size ? _downloader->chooseDcIndexForRequest(result.dcId) : 0;
 	result.offset = offset;
+	result.limit = limit;
 	return result;
 }
 
-void mtpFileLoader::makeRequest(int offset) {
-	auto requestData = prepareRequest(offset);
+void mtpFileLoader::makeRequest(int offset, int limit) {
+	auto requestData = prepareRequest(offset, limit);
 	auto send = [this, &requestData] {
 		auto offset = requestData.offset;
-		auto limit = partSize();
+		auto limit = requestData.limit;
 		auto shiftedDcId = MTP::downloadDcId(requestData.dcId, requestData.dcIndex);
 		if (_cdnDcId) {
 			t_assert(requestData.dcId == _cdnDcId);
@@ -495,19 +762,20 @@ void mtpFileLoader::makeRequest(int offset) {
 void mtpFileLoader::normalPartLoaded(const MTPupload_File &result, mtpRequestId requestId) {
 	Expects(result.type() == mtpc_upload_fileCdnRedirect || result.type() == mtpc_upload_file);
 
-	auto offset = finishSentRequestGetOffset(requestId);
 	if (result.type() == mtpc_upload_fileCdnRedirect) {
-		return switchToCDN(offset, result.c_upload_fileCdnRedirect());
+		auto requestData = finishSentRequest(requestId);
+		return switchToCDN(requestData, result.c_upload_fileCdnRedirect());
 	}
 	auto bytes = gsl::as_bytes(gsl::make_span(result.c_upload_file().vbytes.v));
+	auto offset = finishSentRequest(requestId, bytes.size()).offset;
 	return partLoaded(offset, bytes);
 }
 
 void mtpFileLoader::webPartLoaded(const MTPupload_WebFile &result, mtpRequestId requestId) {
 	Expects(result.type() == mtpc_upload_webFile);
 
-	auto offset = finishSentRequestGetOffset(requestId);
 	auto &webFile = result.c_upload_webFile();
+	auto offset = finishSentRequest(requestId, webFile.vbytes.v.size()).offset;
 	if (!_size) {
 		_size = webFile.vsize.v;
 	} else if (webFile.vsize.v != _size) {
@@ -519,12 +787,10 @@ void mtpFileLoader::webPartLoaded(const MTPupload_WebFile &result, mtpRequestId
 }
 
 void mtpFileLoader::cdnPartLoaded(const MTPupload_CdnFile &result, mtpRequestId requestId) {
-	auto offset = finishSentRequestGetOffset(requestId);
 	if (result.type() == mtpc_upload_cdnFileReuploadNeeded) {
-		auto requestData = RequestData();
+		auto requestData = finishSentRequest(requestId);
 		requestData.dcId = _dcId;
 		requestData.dcIndex = 0;
-		requestData.offset = offset;
 		auto shiftedDcId = MTP::downloadDcId(requestData.dcId, requestData.dcIndex);
 		auto requestId = MTP::send(MTPupload_ReuploadCdnFile(MTP_bytes(_cdnToken), result.c_upload_cdnFileReuploadNeeded().vrequest_token), rpcDone(&mtpFileLoader::reuploadDone), rpcFail(&mtpFileLoader::cdnPartFailed), shiftedDcId);
 		placeSentRequest(requestId, requestData);
@@ -532,6 +798,7 @@ void mtpFileLoader::cdnPartLoaded(const MTPupload_CdnFile &result, mtpRequestId
 	}
 	Expects(result.type() == mtpc_upload_cdnFile);
 
+	auto offset = finishSentRequest(requestId, result.c_upload_cdnFile().vbytes.v.size()).offset;
 	auto key = gsl::as_bytes(gsl::make_span(_cdnEncryptionKey));
 	auto iv = gsl::as_bytes(gsl::make_span(_cdnEncryptionIV));
 	Expects(key.size() == MTP::CTRState::KeySize);
@@ -554,27 +821,36 @@ void mtpFileLoader::cdnPartLoaded(const MTPupload_CdnFile &result, mtpRequestId
 }
 
 void mtpFileLoader::reuploadDone(const MTPBool &result, mtpRequestId requestId) {
-	auto offset = finishSentRequestGetOffset(requestId);
-	makeRequest(offset);
+	auto requestData = finishSentRequest(requestId);
+	makeRequest(requestData.offset, requestData.limit);
 }
 
 void mtpFileLoader::placeSentRequest(mtpRequestId requestId, const RequestData &requestData) {
-	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, partSize());
+	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, requestData.limit);
 	++_queue->queriesCount;
-	_sentRequests.emplace(requestId, requestData);
+	auto sent = requestData;
+	sent.sent = getms(true);
+	_sentRequests.emplace(requestId, sent);
 }
 
-int mtpFileLoader::finishSentRequestGetOffset(mtpRequestId requestId) {
+mtpFileLoader::RequestData mtpFileLoader::finishSentRequest(mtpRequestId requestId, int receivedBytes) {
 	auto it = _sentRequests.find(requestId);
 	Expects(it != _sentRequests.cend());
 
 	auto requestData = it->second;
-	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, -partSize());
+	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, -requestData.limit);
+	if (receivedBytes >= 0) {
+		_downloader->requestFinished(requestData.dcId, requestData.dcIndex, receivedBytes, getms(true) - requestData.sent);
+
+		// The queue is shared by all the loaders from the main dc, so its limit
+		// follows the main dc estimate even if this part came from a CDN dc.
+		_queue->queriesLimit = _downloader->queriesLimit(_dcId);
+	}
 
 	--_queue->queriesCount;
 	_sentRequests.erase(it);
 
-	return requestData.offset;
+	return requestData;
 }
 
 void mtpFileLoader::partLoaded(int offset, base::const_byte_span bytes) {
@@ -590,6 +866,17 @@ void mtpFileLoader::partLoaded(int offset, base::const_byte_span bytes) {
 			if (_file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size()) != qint64(bytes.size())) {
 				return cancel(true);
 			}
+			if (_resumable) {
+				addCompleteRange(offset, offset + bytes.size());
+				_unsavedBytes += bytes.size();
+				if (_unsavedBytes >= kResumeStateSaveBytes) {
+					// The saved ranges must be written to the file already.
+					if (!_file.flush()) {
+						return cancel(true);
+					}
+					saveResumeState();
+				}
+			}
 		} else {
 			_data.reserve(offset + bytes.size());
 			if (offset > _data.size()) {
@@ -626,6 +913,9 @@ void mtpFileLoader::partLoaded(int offset, base::const_byte_span bytes) {
 		if (_fileIsOpen) {
 			_file.close();
 			_fileIsOpen = false;
+			if (_resumable && !finishPartialFile()) {
+				return cancel(true);
+			}
 			Platform::File::PostprocessDownloaded(QFileInfo(_file).absoluteFilePath());
 		}
 		removeFromQueue();
@@ -670,8 +960,8 @@ bool mtpFileLoader::cdnPartFailed(const RPCError &error, mtpRequestId requestId)
 	if (MTP::isDefaultHandledError(error)) return false;
 
 	if (error.type() == qstr("FILE_TOKEN_INVALID") || error.type() == qstr("REQUEST_TOKEN_INVALID")) {
-		auto offset = finishSentRequestGetOffset(requestId);
-		changeCDNParams(offset, 0, QByteArray(), QByteArray(), QByteArray());
+		auto requestData = finishSentRequest(requestId);
+		changeCDNParams(requestData, 0, QByteArray(), QByteArray(), QByteArray());
 		return true;
 	}
 	return partFailed(error);
@@ -681,15 +971,15 @@ void mtpFileLoader::cancelRequests() {
 	while (!_sentRequests.empty()) {
 		auto requestId = _sentRequests.begin()->first;
 		MTP::cancel(requestId);
-		finishSentRequestGetOffset(requestId);
+		finishSentRequest(requestId);
 	}
 }
 
-void mtpFileLoader::switchToCDN(int offset, const MTPDupload_fileCdnRedirect &redirect) {
-	changeCDNParams(offset, redirect.vdc_id.v, redirect.vfile_token.v, redirect.vencryption_key.v, redirect.vencryption_iv.v);
+void mtpFileLoader::switchToCDN(const RequestData &requestData, const MTPDupload_fileCdnRedirect &redirect) {
+	changeCDNParams(requestData, redirect.vdc_id.v, redirect.vfile_token.v, redirect.vencryption_key.v, redirect.vencryption_iv.v);
 }
 
-void mtpFileLoader::changeCDNParams(int offset, MTP::DcId dcId, const QByteArray &token, const QByteArray &encryptionKey, const QByteArray &encryptionIV) {
+void mtpFileLoader::changeCDNParams(const RequestData &requestData, MTP::DcId dcId, const QByteArray &token, const QByteArray &encryptionKey, const QByteArray &encryptionIV) {
 	if (dcId != 0 && (encryptionKey.size() != MTP::CTRState::KeySize || encryptionIV.size() != MTP::CTRState::IvecSize)) {
 		LOG(("Message Error: Wrong key (%1) / iv (%2) size in CDN params").arg(encryptionKey.size()).arg(encryptionIV.size()));
 		cancel(true);
@@ -706,19 +996,18 @@ void mtpFileLoader::changeCDNParams(int offset, MTP::DcId dcId, const QByteArray
 	_cdnEncryptionIV = encryptionIV;
 
 	if (resendAllRequests && !_sentRequests.empty()) {
-		auto resendOffsets = std::vector<int>();
-		resendOffsets.reserve(_sentRequests.size());
+		auto resendRequests = std::vector<RequestData>();
+		resendRequests.reserve(_sentRequests.size());
 		while (!_sentRequests.empty()) {
 			auto requestId = _sentRequests.begin()->first;
 			MTP::cancel(requestId);
-			auto resendOffset = finishSentRequestGetOffset(requestId);
-			resendOffsets.push_back(resendOffset);
+			resendRequests.push_back(finishSentRequest(requestId));
 		}
-		for (auto resendOffset : resendOffsets) {
-			makeRequest(offset);
+		for (auto &resendRequest : resendRequests) {
+			makeRequest(resendRequest.offset, resendRequest.limit);
 		}
 	}
-	makeRequest(offset);
+	makeRequest(requestData.offset, requestData.limit);
 }
 
 bool mtpFileLoader::tryLoadLocal() {
@@ -758,6 +1047,9 @@ bool mtpFileLoader::tryLoadLocal() {
 
 mtpFileLoader::~mtpFileLoader() {
 	cancelRequests();
+	if (_resumable && _fileIsOpen && _unsavedBytes > 0 && _file.flush()) {
+		saveResumeState();
+	}
 }
 
 webFileLoader::webFileLoader(const QString &url, const QString &to, LoadFromCloudSetting fromCloud, bool autoLoading)
@@ -43,9 +43,23 @@ public:
 	void requestedAmountIncrement(MTP::DcId dcId, int index, int amount);
 	int chooseDcIndexForRequest(MTP::DcId dcId) const;
 
+	// Bandwidth-delay product estimation for each download session.
+	void requestFinished(MTP::DcId dcId, int index, int bytes, TimeMs duration);
+	int partSizeForRequest(MTP::DcId dcId, int minimalPartSize) const;
+	int queriesLimit(MTP::DcId dcId) const;
+
 	~Downloader();
 
 private:
+	struct SessionEstimate {
+		TimeMs minRoundTrip = 0;
+		TimeMs minRoundTripUpdated = 0;
+		int64 bytesPerSecond = 0;
+		int64 windowBytes = 0;
+		TimeMs windowStart = 0;
+	};
+	int64 bandwidthDelayProduct(MTP::DcId dcId) const;
+
 	base::Observable<void> _taskFinishedObservable;
 	int _priority = 1;
 
@@ -55,6 +69,9 @@ private:
 	using RequestedInDc = std::array<int64, MTP::kDownloadSessionsCount>;
 	std::map<MTP::DcId, RequestedInDc> _requestedBytesAmount;
 
+	using EstimatesInDc = std::array<SessionEstimate, MTP::kDownloadSessionsCount>;
+	std::map<MTP::DcId, EstimatesInDc> _estimates;
+
 };
 
 } // namespace Storage
@@ -99,6 +116,16 @@ public:
 	}
 	QByteArray imageFormat(const QSize &shrinkBox = QSize()) const;
 	QPixmap imagePixmap(const QSize &shrinkBox = QSize()) const;
+
+	// Starts decoding the loaded image in the background if it was not
+	// decoded yet, returns true when imagePixmap() won't block on decoding.
+	bool imageReady(const QSize &shrinkBox = QSize()) const;
+
+	// Skips the background decoding if it did not finish yet, the next
+	// imageReady() call will start it again.
+	void cancelImageDecoding() const {
+		_imageDecoding = nullptr;
+	}
 	QString fileName() const {
 		return _fname;
 	}
@@ -128,6 +155,9 @@ public:
 	bool autoLoading() const {
 		return _autoLoading;
 	}
+	int priority() const {
+		return _priority;
+	}
 
 	virtual void stop() {
 	}
@@ -141,6 +171,7 @@ signals:
 
 protected:
 	void readImage(const QSize &shrinkBox) const;
+	void imageDecoded(QImage &&image, const QByteArray &format) const;
 
 	gsl::not_null<Storage::Downloader*> _downloader;
 	FileLoader *_prev = nullptr;
@@ -158,6 +189,15 @@ protected:
 	virtual bool tryLoadLocal() = 0;
 	virtual void cancelRequests() = 0;
 
+	// Opens _file for the LoadToFileOnly loaders.
+	virtual bool openFile();
+
+	// Called when the open _file is closed on cancel, returns true if the
+	// file should be kept on disk to resume the download later.
+	virtual bool keepPartialFile(bool failed) {
+		return false;
+	}
+
 	void startLoading(bool loadFirst, bool prior);
 	void removeFromQueue();
 	void cancel(bool failed);
@@ -181,6 +221,10 @@ protected:
 	mutable QByteArray _imageFormat;
 	mutable QPixmap _imagePixmap;
 
+	// Background decoding skips its work once this guard is destroyed.
+	mutable std::shared_ptr<bool> _imageDecoding;
+	mutable bool _imageDecoded = false;
+
 };
 
 class StorageImageLocation;
@@ -210,14 +254,25 @@ private:
 		MTP::DcId dcId = 0;
 		int dcIndex = 0;
 		int offset = 0;
+		int limit = 0;
+		TimeMs sent = 0;
 	};
 
 	bool tryLoadLocal() override;
 	void cancelRequests() override;
+	bool openFile() override;
+	bool keepPartialFile(bool failed) override;
+
+	MediaKey resumeKey() const;
+	void saveResumeState();
+	bool finishPartialFile();
+	void addCompleteRange(int32 from, int32 till);
+	void removeCompleteRange(int32 from, int32 till);
+	int32 nextCompleteFrom(int32 offset) const;
 
 	int partSize() const;
-	RequestData prepareRequest(int offset) const;
-	void makeRequest(int offset);
+	RequestData prepareRequest(int offset, int limit) const;
+	void makeRequest(int offset, int limit);
 
 	bool loadPart() override;
 	void normalPartLoaded(const MTPupload_File &result, mtpRequestId requestId);
@@ -230,9 +285,11 @@ private:
 	bool cdnPartFailed(const RPCError &error, mtpRequestId requestId);
 
 	void placeSentRequest(mtpRequestId requestId, const RequestData &requestData);
-	int finishSentRequestGetOffset(mtpRequestId requestId);
-	void switchToCDN(int offset, const MTPDupload_fileCdnRedirect &redirect);
-	void changeCDNParams(int offset, MTP::DcId dcId, const QByteArray &token, const QByteArray &encryptionKey, const QByteArray &encryptionIV);
+
+	// Pass the received bytes count to account the request in the estimation.
+	RequestData finishSentRequest(mtpRequestId requestId, int receivedBytes = -1);
+	void switchToCDN(const RequestData &requestData, const MTPDupload_fileCdnRedirect &redirect);
+	void changeCDNParams(const RequestData &requestData, MTP::DcId dcId, const QByteArray &token, const QByteArray &encryptionKey, const QByteArray &encryptionIV);
 
 	std::map<mtpRequestId, RequestData> _sentRequests;
 
@@ -254,6 +311,12 @@ private:
 	QByteArray _cdnEncryptionKey;
 	QByteArray _cdnEncryptionIV;
 
+	// Documents loaded to file are written to a sparse partial file,
+	// the complete ranges are saved in the local storage to resume them.
+	bool _resumable = false;
+	QVector<QPair<int32, int32>> _completeRanges;
+	int32 _unsavedBytes = 0;
+
 };
 
 class webFileLoaderPrivate;
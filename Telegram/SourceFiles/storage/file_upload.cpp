@@ -23,6 +23,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 namespace {
 
 constexpr auto kMaxUploadFileParallelSize = MTP::kUploadSessionsCount * 512 * 1024; // max 512kb uploaded at the same time in each session
+constexpr auto kMaxUploadFilesParallel = 4; // max 4 files uploaded at the same time
 
 } // namespace
 
@@ -74,28 +75,32 @@ void FileUploader::upload(const FullMsgId &msgId, const FileLoadResultPtr &file)
 	sendNext();
 }
 
-void FileUploader::currentFailed() {
-	Queue::iterator j = queue.find(uploading);
+void FileUploader::failed(const FullMsgId &msgId) {
+	for (auto i = requestsSent.begin(); i != requestsSent.end();) {
+		if (i->second.msgId == msgId) {
+			MTP::cancel(i->first);
+			sentSize -= i->second.size;
+			sentSizes[i->second.dc] -= i->second.size;
+			i = requestsSent.erase(i);
+		} else {
+			++i;
+		}
+	}
+
+	auto j = queue.find(msgId);
 	if (j != queue.end()) {
-		if (j->type() == SendMediaType::Photo) {
-			emit photoFailed(j.key());
-		} else if (j->type() == SendMediaType::File) {
-			DocumentData *doc = App::document(j->id());
+		auto type = j->type();
+		auto id = j->id();
+		queue.erase(j);
+		if (type == SendMediaType::Photo) {
+			emit photoFailed(msgId);
+		} else if (type == SendMediaType::File) {
+			auto doc = App::document(id);
 			if (doc->status == FileUploading) {
 				doc->status = FileUploadFailed;
 			}
-			emit documentFailed(j.key());
+			emit documentFailed(msgId);
 		}
-		queue.erase(j);
-	}
-
-	requestsSent.clear();
-	docRequestsSent.clear();
-	dcMap.clear();
-	uploading = FullMsgId();
-	sentSize = 0;
-	for (int i = 0; i < MTP::kUploadSessionsCount; ++i) {
-		sentSizes[i] = 0;
 	}
 
 	sendNext();
@@ -107,8 +112,103 @@ void FileUploader::killSessions() {
 	}
 }
 
+int64 FileUploader::File::remainingSize() {
+	auto result = int64(0);
+	for (auto &part : parts()) {
+		result += part.size();
+	}
+	if (docSentParts < docPartsCount) {
+		result += int64(docSize) - int64(docSentParts) * docPartSize;
+	}
+	return result;
+}
+
+bool FileUploader::finishReady() {
+	// Files may finish in any order, but the messages must be sent in the
+	// order they were queued, so a finished file waits for all the files
+	// queued before it to the same peer.
+	auto result = false;
+	auto waiting = OrderedSet<PeerId>();
+	for (auto i = queue.begin(); i != queue.end();) {
+		if (!i->allPartsSent() || i->sentRequests > 0 || waiting.contains(i->peer())) {
+			waiting.insert(i->peer());
+			++i;
+			continue;
+		}
+
+		// Remove the file before emitting, the slots may change the queue.
+		auto msgId = i.key();
+		auto silent = i->file && i->file->to.silent;
+		if (i->type() == SendMediaType::Photo) {
+			auto photoFilename = i->filename();
+			if (!photoFilename.endsWith(qstr(".jpg"), Qt::CaseInsensitive)) {
+				// Server has some extensions checking for inputMediaUploadedPhoto,
+				// so force the extension to be .jpg anyway. It doesn't matter,
+				// because the filename from inputFile is not used anywhere.
+				photoFilename += qstr(".jpg");
+			}
+			auto photo = MTP_inputFile(MTP_long(i->id()), MTP_int(i->partsCount), MTP_string(photoFilename), MTP_bytes(i->file ? i->file->filemd5 : i->media.jpeg_md5));
+			queue.erase(i);
+			emit photoReady(msgId, silent, photo);
+		} else if (i->type() == SendMediaType::File || i->type() == SendMediaType::Audio) {
+			QByteArray docMd5(32, Qt::Uninitialized);
+			hashMd5Hex(i->md5Hash.result(), docMd5.data());
+
+			auto doc = (i->docSize > UseBigFilesFrom) ? MTP_inputFileBig(MTP_long(i->id()), MTP_int(i->docPartsCount), MTP_string(i->filename())) : MTP_inputFile(MTP_long(i->id()), MTP_int(i->docPartsCount), MTP_string(i->filename()), MTP_bytes(docMd5));
+			if (i->partsCount) {
+				auto thumb = MTP_inputFile(MTP_long(i->thumbId()), MTP_int(i->partsCount), MTP_string(i->file ? i->file->thumbname : (qsl("thumb.") + i->media.thumbExt)), MTP_bytes(i->file ? i->file->thumbmd5 : i->media.jpeg_md5));
+				queue.erase(i);
+				emit thumbDocumentReady(msgId, silent, doc, thumb);
+			} else {
+				queue.erase(i);
+				emit documentReady(msgId, silent, doc);
+			}
+		} else {
+			queue.erase(i);
+		}
+		result = true;
+		waiting.clear();
+		i = queue.begin();
+	}
+	return result;
+}
+
+FileUploader::Queue::iterator FileUploader::chooseNext() {
+	// Shortest remaining first, so that small files (like the photos of an
+	// album) are not waiting behind a large document. Up to a few files are
+	// sent at the same time and each of them may keep only its fair share of
+	// the parallel size in flight, but always at least one part.
+	auto active = 0;
+	for (auto i = queue.begin(), e = queue.end(); i != e; ++i) {
+		if (i->started && !i->allPartsSent()) {
+			++active;
+		}
+	}
+	auto share = kMaxUploadFileParallelSize / qMin(queue.size(), kMaxUploadFilesParallel);
+
+	auto result = queue.end();
+	auto resultRemaining = int64(0);
+	for (auto i = queue.begin(), e = queue.end(); i != e; ++i) {
+		if (i->allPartsSent()) {
+			continue;
+		} else if (!i->started && active >= kMaxUploadFilesParallel) {
+			continue;
+		} else if (i->sentSize > 0 && i->sentSize >= share) {
+			continue;
+		}
+		auto remaining = i->remainingSize();
+		if (result == e || remaining < resultRemaining) {
+			result = i;
+			resultRemaining = remaining;
+		}
+	}
+	return result;
+}
+
 void FileUploader::sendNext() {
-	if (sentSize >= kMaxUploadFileParallelSize || _paused.msg) return;
+	if (_paused.msg) return;
+	finishReady();
+	if (sentSize >= kMaxUploadFileParallelSize) return;
 
 	bool killing = killSessionsTimer.isActive();
 	if (queue.isEmpty()) {
@@ -121,13 +221,31 @@ void FileUploader::sendNext() {
 	if (killing) {
 		killSessionsTimer.stop();
 	}
-	Queue::iterator i = uploading.msg ? queue.find(uploading) : queue.begin();
-	if (!uploading.msg) {
-		uploading = i.key();
-	} else if (i == queue.end()) {
-		i = queue.begin();
-		uploading = i.key();
+	auto i = chooseNext();
+	if (i != queue.end()) {
+		sendPart(i);
 	}
+}
+
+void FileUploader::sendRequest(Queue::iterator i, mtpRequestId requestId, int32 size, int dc, bool docPart) {
+	Request request;
+	request.msgId = i.key();
+	request.size = size;
+	request.dc = dc;
+	request.docPart = docPart;
+	requestsSent.emplace(requestId, request);
+	sentSize += size;
+	sentSizes[dc] += size;
+
+	i->started = true;
+	i->sentSize += size;
+	++i->sentRequests;
+	if (docPart) {
+		++i->docRequestsSent;
+	}
+}
+
+void FileUploader::sendPart(Queue::iterator i) {
 	int todc = 0;
 	for (int dc = 1; dc < MTP::kUploadSessionsCount; ++dc) {
 		if (sentSizes[dc] < sentSizes[todc]) {
@@ -135,61 +253,48 @@ void FileUploader::sendNext() {
 		}
 	}
 
-	UploadFileParts &parts(i->file ? (i->type() == SendMediaType::Photo ? i->file->fileparts : i->file->thumbparts) : i->media.parts);
-	uint64 partsOfId(i->file ? (i->type() == SendMediaType::Photo ? i->file->id : i->file->thumbId) : i->media.thumbId);
+	auto &parts = i->parts();
 	if (parts.isEmpty()) {
-		if (i->docSentParts >= i->docPartsCount) {
-			if (requestsSent.isEmpty() && docRequestsSent.isEmpty()) {
-				bool silent = i->file && i->file->to.silent;
-				if (i->type() == SendMediaType::Photo) {
-					auto photoFilename = i->filename();
-					if (!photoFilename.endsWith(qstr(".jpg"), Qt::CaseInsensitive)) {
-						// Server has some extensions checking for inputMediaUploadedPhoto,
-						// so force the extension to be .jpg anyway. It doesn't matter,
-						// because the filename from inputFile is not used anywhere.
-						photoFilename += qstr(".jpg");
-					}
-					emit photoReady(uploading, silent, MTP_inputFile(MTP_long(i->id()), MTP_int(i->partsCount), MTP_string(photoFilename), MTP_bytes(i->file ? i->file->filemd5 : i->media.jpeg_md5)));
-				} else if (i->type() == SendMediaType::File || i->type() == SendMediaType::Audio) {
-					QByteArray docMd5(32, Qt::Uninitialized);
-					hashMd5Hex(i->md5Hash.result(), docMd5.data());
-
-					MTPInputFile doc = (i->docSize > UseBigFilesFrom) ? MTP_inputFileBig(MTP_long(i->id()), MTP_int(i->docPartsCount), MTP_string(i->filename())) : MTP_inputFile(MTP_long(i->id()), MTP_int(i->docPartsCount), MTP_string(i->filename()), MTP_bytes(docMd5));
-					if (i->partsCount) {
-						emit thumbDocumentReady(uploading, silent, doc, MTP_inputFile(MTP_long(i->thumbId()), MTP_int(i->partsCount), MTP_string(i->file ? i->file->thumbname : (qsl("thumb.") + i->media.thumbExt)), MTP_bytes(i->file ? i->file->thumbmd5 : i->media.jpeg_md5)));
-					} else {
-						emit documentReady(uploading, silent, doc);
-					}
-				}
-				queue.remove(uploading);
-				uploading = FullMsgId();
-				sendNext();
-			}
-			return;
-		}
-
+		// Parts are built straight from the file mapping (or the content in
+		// memory), so the bytes are copied only once, into the request buffer.
 		QByteArray &content(i->file ? i->file->content : i->media.data);
+		auto offset = qint64(i->docSentParts) * i->docPartSize;
 		QByteArray toSend;
+		uchar *mapped = nullptr;
 		if (content.isEmpty()) {
 			if (!i->docFile) {
 				i->docFile.reset(new QFile(i->file ? i->file->filepath : i->media.file));
 				if (!i->docFile->open(QIODevice::ReadOnly)) {
-					currentFailed();
+					failed(i.key());
 					return;
 				}
 			}
-			toSend = i->docFile->read(i->docPartSize);
+			auto size = qMin(qint64(i->docPartSize), qint64(i->docSize) - offset);
+			if (size > 0) {
+				mapped = i->docFile->map(offset, size);
+			}
+			if (mapped) {
+				toSend = QByteArray::fromRawData(reinterpret_cast<const char*>(mapped), size);
+			} else if (i->docFile->seek(offset)) {
+				toSend = i->docFile->read(i->docPartSize);
+			}
 			if (i->docSize <= UseBigFilesFrom) {
 				i->md5Hash.feed(toSend.constData(), toSend.size());
 			}
 		} else {
-			toSend = content.mid(i->docSentParts * i->docPartSize, i->docPartSize);
+			auto size = qMin(qint64(i->docPartSize), qint64(content.size()) - offset);
+			if (size > 0) {
+				toSend = QByteArray::fromRawData(content.constData() + offset, size);
+			}
 			if ((i->type() == SendMediaType::File || i->type() == SendMediaType::Audio) && i->docSentParts <= UseBigFilesFrom) {
 				i->md5Hash.feed(toSend.constData(), toSend.size());
 			}
 		}
 		if (toSend.size() > i->docPartSize || (toSend.size() < i->docPartSize && i->docSentParts + 1 != i->docPartsCount)) {
-			currentFailed();
+			if (mapped) {
+				i->docFile->unmap(mapped);
+			}
+			failed(i.key());
 			return;
 		}
 		mtpRequestId requestId;
@@ -198,20 +303,20 @@ void FileUploader::sendNext() {
 		} else {
 			requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(i->id()), MTP_int(i->docSentParts), MTP_bytes(toSend)), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uploadDcId(todc));
 		}
-		docRequestsSent.insert(requestId, i->docSentParts);
-		dcMap.insert(requestId, todc);
-		sentSize += i->docPartSize;
-		sentSizes[todc] += i->docPartSize;
+
+		// The request is serialized already, the raw data is not referenced anymore.
+		toSend = QByteArray();
+		if (mapped) {
+			i->docFile->unmap(mapped);
+		}
+		sendRequest(i, requestId, i->docPartSize, todc, true);
 
 		i->docSentParts++;
 	} else {
-		UploadFileParts::iterator part = parts.begin();
+		auto part = parts.begin();
 
-		mtpRequestId requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(partsOfId), MTP_int(part.key()), MTP_bytes(part.value())), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uploadDcId(todc));
-		requestsSent.insert(requestId, part.value());
-		dcMap.insert(requestId, todc);
-		sentSize += part.value().size();
-		sentSizes[todc] += part.value().size();
+		auto requestId = MTP::send(MTPupload_SaveFilePart(MTP_long(i->partsOfId()), MTP_int(part.key()), MTP_bytes(part.value())), rpcDone(&FileUploader::partLoaded), rpcFail(&FileUploader::partFailed), MTP::uploadDcId(todc));
+		sendRequest(i, requestId, part.value().size(), todc, false);
 
 		parts.erase(part);
 	}
@@ -220,10 +325,14 @@ void FileUploader::sendNext() {
 
 void FileUploader::cancel(const FullMsgId &msgId) {
 	uploaded.remove(msgId);
-	if (uploading == msgId) {
-		currentFailed();
-	} else {
-		queue.remove(msgId);
+	auto i = queue.find(msgId);
+	if (i != queue.end()) {
+		if (i->started) {
+			failed(msgId);
+		} else {
+			queue.erase(i);
+			sendNext();
+		}
 	}
 }
 
@@ -242,15 +351,10 @@ void FileUploader::confirm(const FullMsgId &msgId) {
 void FileUploader::clear() {
 	uploaded.clear();
 	queue.clear();
-	for (QMap<mtpRequestId, QByteArray>::const_iterator i = requestsSent.cbegin(), e = requestsSent.cend(); i != e; ++i) {
-		MTP::cancel(i.key());
+	for (auto &request : requestsSent) {
+		MTP::cancel(request.first);
 	}
 	requestsSent.clear();
-	for (QMap<mtpRequestId, int32>::const_iterator i = docRequestsSent.cbegin(), e = docRequestsSent.cend(); i != e; ++i) {
-		MTP::cancel(i.key());
-	}
-	docRequestsSent.clear();
-	dcMap.clear();
 	sentSize = 0;
 	for (int i = 0; i < MTP::kUploadSessionsCount; ++i) {
 		MTP::stopSession(MTP::uploadDcId(i));
@@ -260,37 +364,26 @@ void FileUploader::clear() {
 }
 
 void FileUploader::partLoaded(const MTPBool &result, mtpRequestId requestId) {
-	QMap<mtpRequestId, int32>::iterator j = docRequestsSent.end();
-	QMap<mtpRequestId, QByteArray>::iterator i = requestsSent.find(requestId);
-	if (i == requestsSent.cend()) {
-		j = docRequestsSent.find(requestId);
-	}
-	if (i != requestsSent.cend() || j != docRequestsSent.cend()) {
-		if (mtpIsFalse(result)) { // failed to upload current file
-			currentFailed();
+	auto i = requestsSent.find(requestId);
+	if (i != requestsSent.end()) {
+		auto request = i->second;
+		requestsSent.erase(i);
+		sentSize -= request.size;
+		sentSizes[request.dc] -= request.size;
+
+		auto k = queue.find(request.msgId);
+		if (k == queue.end()) { // must not happen
+		} else if (mtpIsFalse(result)) { // failed to upload this file
+			failed(request.msgId);
 			return;
 		} else {
-			QMap<mtpRequestId, int32>::iterator dcIt = dcMap.find(requestId);
-			if (dcIt == dcMap.cend()) { // must not happen
-				currentFailed();
-				return;
+			k->sentSize -= request.size;
+			--k->sentRequests;
+			if (request.docPart) {
+				--k->docRequestsSent;
 			}
-			int32 dc = dcIt.value();
-			dcMap.erase(dcIt);
-
-			int32 sentPartSize = 0;
-			Queue::const_iterator k = queue.constFind(uploading);
-			if (i != requestsSent.cend()) {
-				sentPartSize = i.value().size();
-				requestsSent.erase(i);
-			} else {
-				sentPartSize = k->docPartSize;
-				docRequestsSent.erase(j);
-			}
-			sentSize -= sentPartSize;
-			sentSizes[dc] -= sentPartSize;
 			if (k->type() == SendMediaType::Photo) {
-				k->fileSentSize += sentPartSize;
+				k->fileSentSize += request.size;
 				PhotoData *photo = App::photo(k->id());
 				if (photo->uploading() && k->file) {
 					photo->uploadingData->size = k->file->partssize;
@@ -300,7 +393,7 @@ void FileUploader::partLoaded(const MTPBool &result, mtpRequestId requestId) {
 			} else if (k->type() == SendMediaType::File || k->type() == SendMediaType::Audio) {
 				DocumentData *doc = App::document(k->id());
 				if (doc->uploading()) {
-					doc->uploadOffset = (k->docSentParts - docRequestsSent.size()) * k->docPartSize;
+					doc->uploadOffset = (k->docSentParts - k->docRequestsSent) * k->docPartSize;
 					if (doc->uploadOffset > doc->size) {
 						doc->uploadOffset = doc->size;
 					}
@@ -316,9 +409,15 @@ void FileUploader::partLoaded(const MTPBool &result, mtpRequestId requestId) {
 bool FileUploader::partFailed(const RPCError &error, mtpRequestId requestId) {
 	if (MTP::isDefaultHandledError(error)) return false;
 
-	if (requestsSent.constFind(requestId) != requestsSent.cend() || docRequestsSent.constFind(requestId) != docRequestsSent.cend()) { // failed to upload current file
-		currentFailed();
+	auto i = requestsSent.find(requestId);
+	if (i != requestsSent.end()) { // failed to upload this file
+		auto request = i->second;
+		requestsSent.erase(i);
+		sentSize -= request.size;
+		sentSizes[request.dc] -= request.size;
+		failed(request.msgId);
+	} else {
+		sendNext();
 	}
-	sendNext();
 	return true;
 }
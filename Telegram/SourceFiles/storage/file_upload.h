@@ -93,10 +93,21 @@ private:
 			return (docPartsCount <= DocumentMaxPartsCount);
 		}
 
+		UploadFileParts &parts() {
+			return file ? (type() == SendMediaType::Photo ? file->fileparts : file->thumbparts) : media.parts;
+		}
+		uint64 partsOfId() const {
+			return file ? (type() == SendMediaType::Photo ? file->id : file->thumbId) : media.thumbId;
+		}
+		bool allPartsSent() {
+			return parts().isEmpty() && (docSentParts >= docPartsCount);
+		}
+		int64 remainingSize();
+
 		FileLoadResultPtr file;
 		SendMediaReady media;
 		int32 partsCount;
-		mutable int32 fileSentSize;
+		mutable int32 fileSentSize = 0;
 
 		uint64 id() const {
 			return file ? file->id : media.id;
@@ -110,6 +121,9 @@ private:
 		const QString &filename() const {
 			return file ? file->filename : media.filename;
 		}
+		PeerId peer() const {
+			return file ? file->to.peer : media.peer;
+		}
 
 		HashMd5 md5Hash;
 
@@ -118,21 +132,36 @@ private:
 		int32 docSize;
 		int32 docPartSize;
 		int32 docPartsCount;
+
+		// Requests of this file that are not answered yet.
+		int32 sentSize = 0;
+		int32 sentRequests = 0;
+		int32 docRequestsSent = 0;
+		bool started = false;
 	};
 	typedef QMap<FullMsgId, File> Queue;
 
+	struct Request {
+		FullMsgId msgId;
+		int32 size = 0;
+		int dc = 0;
+		bool docPart = false;
+	};
+
 	void partLoaded(const MTPBool &result, mtpRequestId requestId);
 	bool partFailed(const RPCError &err, mtpRequestId requestId);
 
-	void currentFailed();
+	Queue::iterator chooseNext();
+	void sendPart(Queue::iterator i);
+	void sendRequest(Queue::iterator i, mtpRequestId requestId, int32 size, int dc, bool docPart);
+	bool finishReady();
+	void failed(const FullMsgId &msgId);
 
-	QMap<mtpRequestId, QByteArray> requestsSent;
-	QMap<mtpRequestId, int32> docRequestsSent;
-	QMap<mtpRequestId, int32> dcMap;
+	std::map<mtpRequestId, Request> requestsSent;
 	uint32 sentSize;
 	uint32 sentSizes[MTP::kUploadSessionsCount];
 
-	FullMsgId uploading, _paused;
+	FullMsgId _paused;
 	Queue queue;
 	Queue uploaded;
 	QTimer nextTimer, killSessionsTimer;
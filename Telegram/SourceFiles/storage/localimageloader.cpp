@@ -28,6 +28,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "mainwindow.h"
 #include "lang.h"
 #include "boxes/confirm_box.h"
+#include "base/task_queue.h"
 
 namespace {
 
@@ -179,6 +180,114 @@ void TaskQueueWorker::onTaskAdded() {
 	_inTaskAdded = false;
 }
 
+struct TaskPool::Shared {
+	explicit Shared(int concurrency) : concurrency(concurrency) {
+	}
+
+	QMutex mutex;
+	QWaitCondition allStopped;
+
+	// (-priority, order) => task, so that the first one should go next.
+	std::map<std::pair<int, uint64>, TaskPtr> queued;
+	std::set<TaskId> processing, cancelled, processed;
+	uint64 order = 0;
+	int concurrency = 0;
+	int running = 0;
+	bool stopping = false;
+
+};
+
+TaskPool::TaskPool(int concurrency) : _shared(std::make_shared<Shared>(qMax(concurrency, 1))) {
+}
+
+TaskId TaskPool::addTask(TaskPtr task, int priority) {
+	auto result = task->id();
+	auto startWorker = false;
+	{
+		QMutexLocker lock(&_shared->mutex);
+		_shared->queued.emplace(std::make_pair(-priority, ++_shared->order), std::move(task));
+		if (_shared->running < _shared->concurrency) {
+			++_shared->running;
+			startWorker = true;
+		}
+	}
+	if (startWorker) {
+		base::TaskQueue::Normal().Put([shared = _shared] { Process(shared); });
+	}
+	return result;
+}
+
+void TaskPool::Process(std::shared_ptr<Shared> shared) {
+	while (true) {
+		auto task = TaskPtr();
+		{
+			QMutexLocker lock(&shared->mutex);
+			if (shared->stopping || shared->queued.empty()) {
+				if (!--shared->running) {
+					shared->allStopped.wakeAll();
+				}
+				return;
+			}
+			auto first = shared->queued.begin();
+			task = std::move(first->second);
+			shared->queued.erase(first);
+			shared->processing.insert(task->id());
+		}
+
+		task->process();
+
+		{
+			QMutexLocker lock(&shared->mutex);
+			shared->processing.erase(task->id());
+			if (shared->cancelled.erase(task->id()) || shared->stopping) {
+				continue;
+			}
+			shared->processed.insert(task->id());
+		}
+		base::TaskQueue::Main().Put([shared, task] {
+			{
+				QMutexLocker lock(&shared->mutex);
+				if (!shared->processed.erase(task->id())) {
+					return;
+				}
+			}
+			task->finish();
+		});
+	}
+}
+
+void TaskPool::cancelTask(TaskId id) {
+	QMutexLocker lock(&_shared->mutex);
+	for (auto i = _shared->queued.begin(), e = _shared->queued.end(); i != e; ++i) {
+		if (i->second->id() == id) {
+			_shared->queued.erase(i);
+			return;
+		}
+	}
+	if (_shared->processing.find(id) != _shared->processing.end()) {
+		_shared->cancelled.insert(id);
+	} else {
+		_shared->processed.erase(id);
+	}
+}
+
+void TaskPool::stop() {
+	QMutexLocker lock(&_shared->mutex);
+	_shared->stopping = true;
+	_shared->queued.clear();
+	while (_shared->running > 0) {
+		_shared->allStopped.wait(&_shared->mutex);
+	}
+	_shared->processing.clear();
+	_shared->cancelled.clear();
+	_shared->processed.clear();
+	_shared->stopping = false;
+}
+
+TaskPool::~TaskPool() {
+	stop();
+}
+
 FileLoadTask::FileLoadTask(const QString &filepath, std::unique_ptr<MediaInformation> information, SendMediaType type, const FileLoadTo &to, const QString &caption) : _id(rand_value<uint64>())
 , _to(to)
 , _filepath(filepath)
@@ -169,6 +169,29 @@ private:
 
 };
 
+// Processes tasks on the base::TaskQueue::Normal() thread pool, up to
+// concurrency tasks at the same time, higher priority tasks go first.
+// Like in TaskQueue the finish() method is called in the main thread.
+class TaskPool {
+public:
+	explicit TaskPool(int concurrency);
+
+	TaskId addTask(TaskPtr task, int priority = 0);
+	void cancelTask(TaskId id); // this task finish() won't be called
+
+	// Cancels all tasks and waits for the running ones to complete.
+	void stop();
+
+	~TaskPool();
+
+private:
+	struct Shared;
+	static void Process(std::shared_ptr<Shared> shared);
+
+	std::shared_ptr<Shared> _shared;
+
+};
+
 struct FileLoadTo {
 	FileLoadTo(const PeerId &peer, bool silent, MsgId replyTo)
 		: peer(peer)
@@ -22,6 +22,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 
 #include "storage/serialize_document.h"
 #include "storage/serialize_common.h"
+#include "storage/cache_store.h"
 #include "data/data_drafts.h"
 #include "window/themes/window_theme.h"
 #include "observer_peer.h"
@@ -66,6 +67,10 @@ bool _started = false;
 internal::Manager *_manager = nullptr;
 TaskQueue *_localLoader = nullptr;
 
+// Cached media is read, decrypted and decoded on several threads.
+constexpr auto kCacheLoadConcurrency = 4;
+TaskPool *_cacheLoader = nullptr;
+
 bool _working() {
 	return _manager && !_basePath.isEmpty();
 }
@@ -504,6 +509,9 @@ enum { // Local Storage Keys
 	lskSavedGifs = 0x0f, // no data
 	lskStickersKeys = 0x10, // no data
 	lskTrustedBots = 0x11, // no data
+	lskMapJournal = 0x12, // no data
+	lskDownloads = 0x13, // no data
+	lskHistoryCache = 0x14, // data: PeerId peer
 };
 
 enum {
@@ -575,6 +583,7 @@ enum {
 	dbiMtpAuthorization = 0x4b,
 	dbiLastSeenWarningSeenOld = 0x4c,
 	dbiAuthSessionData = 0x4d,
+	dbiCacheLimits = 0x4e,
 
 	dbiEncryptedWithSalt = 333,
 	dbiEncrypted = 444,
@@ -590,6 +599,17 @@ DraftsMap _draftsMap, _draftCursorsMap;
 typedef QMap<PeerId, bool> DraftsNotReadMap;
 DraftsNotReadMap _draftsNotReadMap;
 
+// The last messages of each chat, so that it can be painted before the server answers.
+using HistoryCacheMap = QMap<PeerId, FileKey>;
+HistoryCacheMap _historyCacheMap;
+constexpr auto kHistoryCacheMessagesCount = 50;
+
+// Only the caches of the most recently opened chats are kept, the order
+// of opening is not saved, so after a restart all chats are equally old.
+constexpr auto kHistoryCacheChatsCount = 64;
+QMap<PeerId, quint64> _historyCacheOpened;
+quint64 _historyCacheOpenTick = 0;
+
 typedef QPair<FileKey, qint32> FileDesc; // file, size
 
 typedef QMultiMap<MediaKey, FileLocation> FileLocations;
@@ -604,6 +624,15 @@ WebFilesMap _webFilesMap;
 uint64 _storageWebFilesSize = 0;
 FileKey _locationsKey = 0, _reportSpamStatusesKey = 0, _trustedBotsKey = 0;
 
+using DownloadStates = QMap<MediaKey, DownloadState>;
+DownloadStates _downloadStates;
+FileKey _downloadsKey = 0;
+
+// Partial files of the downloads that were not resumed for a long time are
+// removed, as well as the least recently written ones above the limit.
+constexpr auto kDownloadStatesMaxCount = 32;
+constexpr auto kDownloadStateMaxAge = 14 * 24 * 3600; // two weeks
+
 using TrustedBots = OrderedSet<uint64>;
 TrustedBots _trustedBots;
 bool _trustedBotsRead = false;
@@ -627,8 +656,18 @@ bool _recentHashtagsAndBotsWereRead = false;
 FileKey _savedPeersKey = 0;
 
 typedef QMap<StorageKey, FileDesc> StorageMap;
-StorageMap _imagesMap, _stickerImagesMap, _audiosMap;
-int32 _storageImagesSize = 0, _storageStickersSize = 0, _storageAudiosSize = 0;
+StorageMap _imagesMap, _stickerImagesMap, _audiosMap; // legacy, migrated to _cacheStore
+qint64 _storageImagesSize = 0, _storageStickersSize = 0, _storageAudiosSize = 0;
+
+constexpr auto kDefaultCacheTotalSizeLimit = qint64(1024) * 1024 * 1024;
+
+std::unique_ptr<Storage::CacheStore> _cacheStore;
+bool _cacheMaintenanceQueued = false;
+Storage::CacheLimits _cacheLimits = [] {
+	auto result = Storage::CacheLimits();
+	result.total = kDefaultCacheTotalSizeLimit;
+	return result;
+}();
 
 bool _mapChanged = false;
 int32 _oldMapVersion = 0, _oldSettingsVersion = 0;
@@ -648,6 +687,202 @@ StoredAuthSession &GetStoredAuthSessionCache() {
 }
 
 void _writeMap(WriteMapWhen when = WriteMapWhen::Soon);
+void _openCacheStore();
+void _startCacheMigration();
+void _checkCacheMaintenance();
+
+// The map file is rewritten only on checkpoints, frequent changes of the
+// drafts, history cache and media maps are appended to the map journal in between.
+constexpr char kMapJournalMagic[] = { 'T', 'D', 'J', '$' };
+constexpr auto kMapJournalMagicLen = int(sizeof(kMapJournalMagic));
+constexpr auto kMapJournalCheckpointSize = 256 * 1024;
+
+enum class MapJournalOp : quint32 {
+	Insert = 0x01,
+	Remove = 0x02,
+};
+
+quint64 _mapJournalGeneration = 0;
+std::unique_ptr<QFile> _mapJournal;
+
+QString _mapJournalPath() {
+	return _userBasePath + qsl("map_journal");
+}
+
+// Must be called right after the map with _mapJournalGeneration was written.
+void _resetMapJournal() {
+	_mapJournal = std::make_unique<QFile>(_mapJournalPath());
+	if (!_mapJournal->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		LOG(("App Error: could not open map journal for writing"));
+		_mapJournal = nullptr;
+		return;
+	}
+	qint32 version = AppVersion;
+	_mapJournal->write(kMapJournalMagic, kMapJournalMagicLen);
+	_mapJournal->write((const char*)&version, sizeof(version));
+	_mapJournal->write((const char*)&_mapJournalGeneration, sizeof(_mapJournalGeneration));
+	if (!_mapJournal->flush()) {
+		_mapJournal = nullptr;
+	}
+}
+
+bool _appendMapJournal(EncryptedDescriptor &data) {
+	if (!_mapJournal || !LocalKey || _mapChanged) {
+		return false;
+	}
+	auto encrypted = FileWriteDescriptor::prepareEncrypted(data);
+	QDataStream stream(_mapJournal.get());
+	stream.setVersion(QDataStream::Qt_5_1);
+	stream << encrypted;
+	if (stream.status() != QDataStream::Ok || !_mapJournal->flush()) {
+		LOG(("App Error: could not write to map journal"));
+		_mapJournal = nullptr;
+		return false;
+	}
+	if (_mapJournal->size() > kMapJournalCheckpointSize) {
+		_mapChanged = true;
+		_writeMap();
+	}
+	return true;
+}
+
+void _journalPeerMapChange(quint32 keyType, MapJournalOp op, const PeerId &peer, FileKey key = 0) {
+	EncryptedDescriptor data(sizeof(quint32) * 2 + sizeof(quint64) * 2);
+	data.stream << quint32(keyType) << quint32(op) << quint64(peer) << quint64(key);
+	if (!_appendMapJournal(data)) {
+		_mapChanged = true;
+		_writeMap((op == MapJournalOp::Insert) ? WriteMapWhen::Fast : WriteMapWhen::Soon);
+	}
+}
+
+void _journalStorageChange(quint32 keyType, MapJournalOp op, const StorageKey &location, const FileDesc &desc = FileDesc()) {
+	EncryptedDescriptor data(sizeof(quint32) * 2 + sizeof(quint64) * 3 + sizeof(qint32));
+	data.stream << quint32(keyType) << quint32(op) << quint64(location.first) << quint64(location.second);
+	data.stream << quint64(desc.first) << qint32(desc.second);
+	if (!_appendMapJournal(data)) {
+		_mapChanged = true;
+		_writeMap();
+	}
+}
+
+bool _applyMapJournalRecord(QDataStream &stream) {
+	quint32 keyType = 0, op = 0;
+	stream >> keyType >> op;
+	if (!_checkStreamStatus(stream)) {
+		return false;
+	}
+	auto insert = (op == quint32(MapJournalOp::Insert));
+	if (!insert && op != quint32(MapJournalOp::Remove)) {
+		LOG(("App Error: unknown op in map journal: %1").arg(op));
+		return false;
+	}
+	switch (keyType) {
+	case lskDraft:
+	case lskDraftPosition:
+	case lskHistoryCache: {
+		quint64 peer, key;
+		stream >> peer >> key;
+		if (!_checkStreamStatus(stream)) return false;
+
+		auto &map = (keyType == lskDraft) ? _draftsMap : (keyType == lskDraftPosition) ? _draftCursorsMap : _historyCacheMap;
+		if (insert) {
+			map.insert(peer, key);
+		} else {
+			map.remove(peer);
+		}
+		if (keyType == lskDraft) {
+			if (insert) {
+				_draftsNotReadMap.insert(peer, true);
+			} else {
+				_draftsNotReadMap.remove(peer);
+			}
+		}
+	} break;
+	case lskImages:
+	case lskStickerImages:
+	case lskAudios: {
+		quint64 first, second, key;
+		qint32 size;
+		stream >> first >> second >> key >> size;
+		if (!_checkStreamStatus(stream)) return false;
+
+		auto &map = (keyType == lskImages) ? _imagesMap : (keyType == lskStickerImages) ? _stickerImagesMap : _audiosMap;
+		auto &total = (keyType == lskImages) ? _storageImagesSize : (keyType == lskStickerImages) ? _storageStickersSize : _storageAudiosSize;
+		auto location = StorageKey(first, second);
+		auto i = map.find(location);
+		if (i != map.end()) {
+			total -= i.value().second;
+			map.erase(i);
+		}
+		if (insert) {
+			map.insert(location, FileDesc(key, size));
+			total += size;
+		}
+	} break;
+	default:
+	LOG(("App Error: unknown key type in map journal: %1").arg(keyType));
+	return false;
+	}
+	return true;
+}
+
+void _readMapJournal() {
+	_mapJournal = nullptr;
+	if (!_mapJournalGeneration) {
+		return;
+	}
+
+	auto validSize = qint64(0);
+	auto count = 0;
+	{
+		QFile f(_mapJournalPath());
+		if (f.open(QIODevice::ReadOnly)) {
+			char magic[kMapJournalMagicLen];
+			qint32 version = 0;
+			quint64 generation = 0;
+			if (f.read(magic, kMapJournalMagicLen) == kMapJournalMagicLen
+				&& !memcmp(magic, kMapJournalMagic, kMapJournalMagicLen)
+				&& f.read((char*)&version, sizeof(version)) == sizeof(version)
+				&& f.read((char*)&generation, sizeof(generation)) == sizeof(generation)
+				&& version <= AppVersion
+				&& generation == _mapJournalGeneration) {
+				validSize = f.pos();
+
+				QDataStream stream(&f);
+				stream.setVersion(QDataStream::Qt_5_1);
+				while (!stream.atEnd()) {
+					QByteArray encrypted;
+					stream >> encrypted;
+					if (stream.status() != QDataStream::Ok) {
+						break;
+					}
+					EncryptedDescriptor data;
+					if (!decryptLocal(data, encrypted) || !_applyMapJournalRecord(data.stream)) {
+						break;
+					}
+					validSize = f.pos();
+					++count;
+				}
+			}
+		}
+	}
+	if (!validSize) {
+		// Stale or missing journal, the map itself is complete.
+		_resetMapJournal();
+		return;
+	}
+	if (count) {
+		LOG(("App Info: replayed %1 map journal records").arg(count));
+	}
+
+	_mapJournal = std::make_unique<QFile>(_mapJournalPath());
+	if (!_mapJournal->open(QIODevice::ReadWrite)
+		|| !_mapJournal->resize(validSize)
+		|| !_mapJournal->seek(validSize)) {
+		LOG(("App Error: could not open map journal for appending"));
+		_mapJournal = nullptr;
+	}
+}
 
 void _writeLocations(WriteMapWhen when = WriteMapWhen::Soon) {
 	if (when != WriteMapWhen::Now) {
@@ -792,6 +1027,145 @@ void _readLocations() {
 	}
 }
 
+void _writeDownloads(WriteMapWhen when = WriteMapWhen::Soon) {
+	if (when != WriteMapWhen::Now) {
+		_manager->writeDownloads(when == WriteMapWhen::Fast);
+		return;
+	}
+	if (!_working()) return;
+
+	_manager->writingDownloads();
+	if (_downloadStates.isEmpty()) {
+		if (_downloadsKey) {
+			clearKey(_downloadsKey);
+			_downloadsKey = 0;
+			_mapChanged = true;
+			_writeMap();
+		}
+		return;
+	}
+	if (!_downloadsKey) {
+		_downloadsKey = genKey();
+		_mapChanged = true;
+		_writeMap(WriteMapWhen::Fast);
+	}
+	quint32 size = sizeof(quint32);
+	for (auto i = _downloadStates.cbegin(), e = _downloadStates.cend(); i != e; ++i) {
+		auto &state = i.value();
+
+		// location + path + size + ranges
+		size += sizeof(quint64) * 2 + Serialize::stringSize(state.path) + sizeof(qint32);
+		size += sizeof(quint32) + state.ranges.size() * sizeof(qint32) * 2;
+
+		// cdn dc + token + key + iv
+		size += sizeof(qint32) + Serialize::bytearraySize(state.cdnToken);
+		size += Serialize::bytearraySize(state.cdnEncryptionKey) + Serialize::bytearraySize(state.cdnEncryptionIV);
+	}
+
+	EncryptedDescriptor data(size);
+	data.stream << quint32(_downloadStates.size());
+	for (auto i = _downloadStates.cbegin(), e = _downloadStates.cend(); i != e; ++i) {
+		auto &state = i.value();
+		data.stream << quint64(i.key().first) << quint64(i.key().second) << state.path << qint32(state.size);
+		data.stream << quint32(state.ranges.size());
+		for (auto &range : state.ranges) {
+			data.stream << qint32(range.first) << qint32(range.second);
+		}
+		data.stream << qint32(state.cdnDcId) << state.cdnToken << state.cdnEncryptionKey << state.cdnEncryptionIV;
+	}
+
+	FileWriteDescriptor file(_downloadsKey);
+	file.writeEncrypted(data);
+}
+
+void _removeDownloadPartFile(const DownloadState &state) {
+	if (!state.path.isEmpty()) {
+		QFile::remove(state.path);
+	}
+}
+
+void _clearDownloadStates() {
+	for_const (auto &state, _downloadStates) {
+		_removeDownloadPartFile(state);
+	}
+	_downloadStates.clear();
+}
+
+// Returns true if some states were removed, the just written state is kept.
+bool _expireDownloadStates(const MediaKey &keep = MediaKey()) {
+	auto now = QDateTime::currentDateTime();
+	auto result = false;
+	auto candidates = std::vector<QPair<QDateTime, MediaKey>>();
+	for (auto i = _downloadStates.begin(); i != _downloadStates.end();) {
+		if (i.key() == keep) {
+			++i;
+			continue;
+		}
+		auto info = QFileInfo(i.value().path);
+		auto modified = info.lastModified();
+		if (!info.isFile() || modified.secsTo(now) > kDownloadStateMaxAge) {
+			_removeDownloadPartFile(i.value());
+			i = _downloadStates.erase(i);
+			result = true;
+		} else {
+			candidates.push_back(qMakePair(modified, i.key()));
+			++i;
+		}
+	}
+	auto excess = _downloadStates.size() - kDownloadStatesMaxCount;
+	if (excess > 0) {
+		auto till = candidates.begin() + qMin(excess, int(candidates.size()));
+		std::nth_element(candidates.begin(), till, candidates.end());
+		for (auto i = candidates.begin(); i != till; ++i) {
+			auto j = _downloadStates.find(i->second);
+			_removeDownloadPartFile(j.value());
+			_downloadStates.erase(j);
+		}
+		result = true;
+	}
+	return result;
+}
+
+void _readDownloads() {
+	FileReadDescriptor downloads;
+	if (!readEncryptedFile(downloads, _downloadsKey)) {
+		clearKey(_downloadsKey);
+		_downloadsKey = 0;
+		_mapChanged = true;
+		_writeMap();
+		return;
+	}
+
+	quint32 count = 0;
+	downloads.stream >> count;
+	for (quint32 i = 0; i < count; ++i) {
+		quint64 first = 0, second = 0;
+		quint32 rangesCount = 0;
+		qint32 size = 0, cdnDcId = 0;
+		auto state = DownloadState();
+		downloads.stream >> first >> second >> state.path >> size >> rangesCount;
+		if (!_checkStreamStatus(downloads.stream)) {
+			return;
+		}
+		state.size = size;
+		state.ranges.reserve(rangesCount);
+		for (quint32 j = 0; j < rangesCount; ++j) {
+			qint32 from = 0, till = 0;
+			downloads.stream >> from >> till;
+			state.ranges.push_back(qMakePair(from, till));
+		}
+		downloads.stream >> cdnDcId >> state.cdnToken >> state.cdnEncryptionKey >> state.cdnEncryptionIV;
+		if (!_checkStreamStatus(downloads.stream)) {
+			return;
+		}
+		state.cdnDcId = cdnDcId;
+		_downloadStates.insert(MediaKey(first, second), state);
+	}
+	if (_expireDownloadStates()) {
+		_writeDownloads();
+	}
+}
+
 void _writeReportSpamStatuses() {
 	if (!_working()) return;
 
@@ -1497,6 +1871,26 @@ bool _readSetting(quint32 blockId, QDataStream &stream, int version, ReadSetting
 		Global::SetVideoVolume(snap(v / 1e6, 0., 1.));
 	} break;
 
+	case dbiCacheLimits: {
+		qint64 total;
+		qint32 count;
+		stream >> total >> count;
+		if (!_checkStreamStatus(stream)) return false;
+
+		auto limits = Storage::CacheLimits();
+		limits.total = qMax(total, qint64(0));
+		for (auto i = 0; i != count; ++i) {
+			qint64 limit;
+			stream >> limit;
+			if (!_checkStreamStatus(stream)) return false;
+
+			if (i < Storage::kCacheCategoriesCount) {
+				limits.categories[i] = qMax(limit, qint64(0));
+			}
+		}
+		_cacheLimits = limits;
+	} break;
+
 	default:
 	LOG(("App Error: unknown blockId in _readSetting: %1").arg(blockId));
 	return false;
@@ -1739,6 +2133,7 @@ void _writeUserSettings() {
 	if (!userData.isEmpty()) {
 		size += sizeof(quint32) + Serialize::bytearraySize(userData);
 	}
+	size += sizeof(quint32) + sizeof(qint64) + sizeof(qint32) + Storage::kCacheCategoriesCount * sizeof(qint64);
 
 	EncryptedDescriptor data(size);
 	data.stream << quint32(dbiSendKey) << qint32(cCtrlEnter() ? dbiskCtrlEnter : dbiskEnter);
@@ -1768,6 +2163,10 @@ void _writeUserSettings() {
 	if (!userData.isEmpty()) {
 		data.stream << quint32(dbiAuthSessionData) << userData;
 	}
+	data.stream << quint32(dbiCacheLimits) << qint64(_cacheLimits.total) << qint32(Storage::kCacheCategoriesCount);
+	for (auto limit : _cacheLimits.categories) {
+		data.stream << qint64(limit);
+	}
 
 	{
 		data.stream << quint32(dbiRecentEmoji) << recentEmojiPreloadData;
@@ -1917,13 +2316,16 @@ ReadMapState _readMap(const QByteArray &pass) {
 
 	DraftsMap draftsMap, draftCursorsMap;
 	DraftsNotReadMap draftsNotReadMap;
+	HistoryCacheMap historyCacheMap;
 	StorageMap imagesMap, stickerImagesMap, audiosMap;
 	qint64 storageImagesSize = 0, storageStickersSize = 0, storageAudiosSize = 0;
 	quint64 locationsKey = 0, reportSpamStatusesKey = 0, trustedBotsKey = 0;
+	quint64 downloadsKey = 0;
 	quint64 recentStickersKeyOld = 0;
 	quint64 installedStickersKey = 0, featuredStickersKey = 0, recentStickersKey = 0, archivedStickersKey = 0;
 	quint64 savedGifsKey = 0;
 	quint64 backgroundKey = 0, userSettingsKey = 0, recentHashtagsAndBotsKey = 0, savedPeersKey = 0;
+	quint64 mapJournalGeneration = 0;
 	while (!map.stream.atEnd()) {
 		quint32 keyType;
 		map.stream >> keyType;
@@ -1949,6 +2351,16 @@ ReadMapState _readMap(const QByteArray &pass) {
 				draftCursorsMap.insert(p, key);
 			}
 		} break;
+		case lskHistoryCache: {
+			quint32 count = 0;
+			map.stream >> count;
+			for (quint32 i = 0; i < count; ++i) {
+				FileKey key;
+				quint64 p;
+				map.stream >> key >> p;
+				historyCacheMap.insert(p, key);
+			}
+		} break;
 		case lskImages: {
 			quint32 count = 0;
 			map.stream >> count;
@@ -1988,6 +2400,9 @@ ReadMapState _readMap(const QByteArray &pass) {
 		case lskLocations: {
 			map.stream >> locationsKey;
 		} break;
+		case lskDownloads: {
+			map.stream >> downloadsKey;
+		} break;
 		case lskReportSpamStatuses: {
 			map.stream >> reportSpamStatusesKey;
 		} break;
@@ -2022,6 +2437,9 @@ ReadMapState _readMap(const QByteArray &pass) {
 		case lskSavedPeers: {
 			map.stream >> savedPeersKey;
 		} break;
+		case lskMapJournal: {
+			map.stream >> mapJournalGeneration;
+		} break;
 		default:
 		LOG(("App Error: unknown key type in encrypted map: %1").arg(keyType));
 		return ReadMapFailed;
@@ -2034,6 +2452,7 @@ ReadMapState _readMap(const QByteArray &pass) {
 	_draftsMap = draftsMap;
 	_draftCursorsMap = draftCursorsMap;
 	_draftsNotReadMap = draftsNotReadMap;
+	_historyCacheMap = historyCacheMap;
 
 	_imagesMap = imagesMap;
 	_storageImagesSize = storageImagesSize;
@@ -2043,6 +2462,7 @@ ReadMapState _readMap(const QByteArray &pass) {
 	_storageAudiosSize = storageAudiosSize;
 
 	_locationsKey = locationsKey;
+	_downloadsKey = downloadsKey;
 	_reportSpamStatusesKey = reportSpamStatusesKey;
 	_trustedBotsKey = trustedBotsKey;
 	_recentStickersKeyOld = recentStickersKeyOld;
@@ -2055,6 +2475,8 @@ ReadMapState _readMap(const QByteArray &pass) {
 	_backgroundKey = backgroundKey;
 	_userSettingsKey = userSettingsKey;
 	_recentHashtagsAndBotsKey = recentHashtagsAndBotsKey;
+	_mapJournalGeneration = mapJournalGeneration;
+	_readMapJournal();
 	_oldMapVersion = mapData.version;
 	if (_oldMapVersion < AppVersion) {
 		_mapChanged = true;
@@ -2066,13 +2488,21 @@ ReadMapState _readMap(const QByteArray &pass) {
 	if (_locationsKey) {
 		_readLocations();
 	}
+	if (_downloadsKey) {
+		_readDownloads();
+	}
 	if (_reportSpamStatusesKey) {
 		_readReportSpamStatuses();
 	}
+	_openCacheStore();
+	_startCacheMigration();
 
 	_readUserSettings();
 	_readMtpData();
 
+	_cacheStore->setLimits(_cacheLimits);
+	_checkCacheMaintenance();
+
 	Messenger::Instance().setAuthSessionFromStorage(std::move(StoredAuthSessionCache));
 
 	LOG(("Map read time: %1").arg(getms() - ms));
@@ -2117,10 +2547,12 @@ void _writeMap(WriteMapWhen when) {
 	uint32 mapSize = 0;
 	if (!_draftsMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _draftsMap.size() * sizeof(quint64) * 2;
 	if (!_draftCursorsMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _draftCursorsMap.size() * sizeof(quint64) * 2;
+	if (!_historyCacheMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _historyCacheMap.size() * sizeof(quint64) * 2;
 	if (!_imagesMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _imagesMap.size() * (sizeof(quint64) * 3 + sizeof(qint32));
 	if (!_stickerImagesMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _stickerImagesMap.size() * (sizeof(quint64) * 3 + sizeof(qint32));
 	if (!_audiosMap.isEmpty()) mapSize += sizeof(quint32) * 2 + _audiosMap.size() * (sizeof(quint64) * 3 + sizeof(qint32));
 	if (_locationsKey) mapSize += sizeof(quint32) + sizeof(quint64);
+	if (_downloadsKey) mapSize += sizeof(quint32) + sizeof(quint64);
 	if (_reportSpamStatusesKey) mapSize += sizeof(quint32) + sizeof(quint64);
 	if (_trustedBotsKey) mapSize += sizeof(quint32) + sizeof(quint64);
 	if (_recentStickersKeyOld) mapSize += sizeof(quint32) + sizeof(quint64);
@@ -2132,6 +2564,7 @@ void _writeMap(WriteMapWhen when) {
 	if (_backgroundKey) mapSize += sizeof(quint32) + sizeof(quint64);
 	if (_userSettingsKey) mapSize += sizeof(quint32) + sizeof(quint64);
 	if (_recentHashtagsAndBotsKey) mapSize += sizeof(quint32) + sizeof(quint64);
+	mapSize += sizeof(quint32) + sizeof(quint64);
 	EncryptedDescriptor mapData(mapSize);
 	if (!_draftsMap.isEmpty()) {
 		mapData.stream << quint32(lskDraft) << quint32(_draftsMap.size());
@@ -2145,6 +2578,12 @@ void _writeMap(WriteMapWhen when) {
 			mapData.stream << quint64(i.value()) << quint64(i.key());
 		}
 	}
+	if (!_historyCacheMap.isEmpty()) {
+		mapData.stream << quint32(lskHistoryCache) << quint32(_historyCacheMap.size());
+		for (auto i = _historyCacheMap.cbegin(), e = _historyCacheMap.cend(); i != e; ++i) {
+			mapData.stream << quint64(i.value()) << quint64(i.key());
+		}
+	}
 	if (!_imagesMap.isEmpty()) {
 		mapData.stream << quint32(lskImages) << quint32(_imagesMap.size());
 		for (StorageMap::const_iterator i = _imagesMap.cbegin(), e = _imagesMap.cend(); i != e; ++i) {
@@ -2166,6 +2605,9 @@ void _writeMap(WriteMapWhen when) {
 	if (_locationsKey) {
 		mapData.stream << quint32(lskLocations) << quint64(_locationsKey);
 	}
+	if (_downloadsKey) {
+		mapData.stream << quint32(lskDownloads) << quint64(_downloadsKey);
+	}
 	if (_reportSpamStatusesKey) {
 		mapData.stream << quint32(lskReportSpamStatuses) << quint64(_reportSpamStatusesKey);
 	}
@@ -2194,9 +2636,15 @@ void _writeMap(WriteMapWhen when) {
 	if (_recentHashtagsAndBotsKey) {
 		mapData.stream << quint32(lskRecentHashtagsAndBots) << quint64(_recentHashtagsAndBotsKey);
 	}
+	do {
+		_mapJournalGeneration = rand_value<quint64>();
+	} while (!_mapJournalGeneration);
+	mapData.stream << quint32(lskMapJournal) << quint64(_mapJournalGeneration);
 	map.writeEncrypted(mapData);
+	map.finish();
 
 	_mapChanged = false;
+	_resetMapJournal();
 }
 
 } // namespace
@@ -2207,7 +2655,13 @@ void finish() {
 		_manager->finish();
 		_manager->deleteLater();
 		_manager = 0;
+		delete base::take(_cacheLoader);
 		delete base::take(_localLoader);
+		if (_cacheStore) {
+			auto stats = _cacheStore->stats();
+			LOG(("Cache Info: %1 hits, %2 misses, %3 evicted (%4 bytes)").arg(stats.hits).arg(stats.misses).arg(stats.evicted).arg(stats.evictedBytes));
+			_cacheStore.reset();
+		}
 	}
 }
 
@@ -2218,6 +2672,7 @@ void start() {
 
 	_manager = new internal::Manager();
 	_localLoader = new TaskQueue(0, FileLoaderQueueStopTimeout);
+	_cacheLoader = new TaskPool(kCacheLoadConcurrency);
 
 	_basePath = cWorkingDir() + qsl("tdata/");
 	if (!QDir().exists(_basePath)) QDir().mkpath(_basePath);
@@ -2347,6 +2802,9 @@ void writeMtpData() {
 }
 
 void reset() {
+	if (_cacheLoader) {
+		_cacheLoader->stop();
+	}
 	if (_localLoader) {
 		_localLoader->stop();
 	}
@@ -2354,6 +2812,8 @@ void reset() {
 	_passKeySalt.clear(); // reset passcode, local key
 	_draftsMap.clear();
 	_draftCursorsMap.clear();
+	_historyCacheMap.clear();
+	_historyCacheOpened.clear();
 	_fileLocations.clear();
 	_fileLocationPairs.clear();
 	_fileLocationAliases.clear();
@@ -2362,9 +2822,15 @@ void reset() {
 	_stickerImagesMap.clear();
 	_audiosMap.clear();
 	_storageImagesSize = _storageStickersSize = _storageAudiosSize = 0;
+	if (_cacheStore) {
+		_cacheStore->clear();
+	}
+	_cacheMaintenanceQueued = false;
 	_webFilesMap.clear();
 	_storageWebFilesSize = 0;
 	_locationsKey = _reportSpamStatusesKey = _trustedBotsKey = 0;
+	_clearDownloadStates();
+	_downloadsKey = 0;
 	_recentStickersKeyOld = 0;
 	_installedStickersKey = _featuredStickersKey = _recentStickersKey = _archivedStickersKey = 0;
 	_savedGifsKey = 0;
@@ -2402,6 +2868,11 @@ ReadMapState readMap(const QByteArray &pass) {
 	if (result == ReadMapFailed) {
 		_mapChanged = true;
 		_writeMap(WriteMapWhen::Now);
+
+		// The records of the old cache are encrypted with the old local key.
+		QDir(_userBasePath + qsl("cache/")).removeRecursively();
+		_openCacheStore();
+		_cacheStore->setLimits(_cacheLimits);
 	}
 	return result;
 }
@@ -2422,8 +2893,7 @@ void writeDrafts(const PeerId &peer, const MessageDraft &localDraft, const Messa
 		if (i != _draftsMap.cend()) {
 			clearKey(i.value());
 			_draftsMap.erase(i);
-			_mapChanged = true;
-			_writeMap();
+			_journalPeerMapChange(lskDraft, MapJournalOp::Remove, peer);
 		}
 
 		_draftsNotReadMap.remove(peer);
@@ -2431,8 +2901,7 @@ void writeDrafts(const PeerId &peer, const MessageDraft &localDraft, const Messa
 		auto i = _draftsMap.constFind(peer);
 		if (i == _draftsMap.cend()) {
 			i = _draftsMap.insert(peer, genKey());
-			_mapChanged = true;
-			_writeMap(WriteMapWhen::Fast);
+			_journalPeerMapChange(lskDraft, MapJournalOp::Insert, peer, i.value());
 		}
 
 		auto msgTags = Ui::FlatTextarea::serializeTagsList(localDraft.textWithTags.tags);
@@ -2461,8 +2930,7 @@ void clearDraftCursors(const PeerId &peer) {
 	if (i != _draftCursorsMap.cend()) {
 		clearKey(i.value());
 		_draftCursorsMap.erase(i);
-		_mapChanged = true;
-		_writeMap();
+		_journalPeerMapChange(lskDraftPosition, MapJournalOp::Remove, peer);
 	}
 }
 
@@ -2571,8 +3039,7 @@ void writeDraftCursors(const PeerId &peer, const MessageCursor &msgCursor, const
 		DraftsMap::const_iterator i = _draftCursorsMap.constFind(peer);
 		if (i == _draftCursorsMap.cend()) {
 			i = _draftCursorsMap.insert(peer, genKey());
-			_mapChanged = true;
-			_writeMap(WriteMapWhen::Fast);
+			_journalPeerMapChange(lskDraftPosition, MapJournalOp::Insert, peer, i.value());
 		}
 
 		EncryptedDescriptor data(sizeof(quint64) + sizeof(qint32) * 3);
@@ -2592,6 +3059,232 @@ bool hasDraft(const PeerId &peer) {
 	return _draftsMap.contains(peer);
 }
 
+namespace {
+
+void _collectMessagePeers(const MTPMessage &message, OrderedSet<PeerId> &peers) {
+	auto addUser = [&peers](const MTPint &userId) {
+		peers.insert(peerFromUser(userId));
+	};
+	switch (message.type()) {
+	case mtpc_message: {
+		auto &d = message.c_message();
+		peers.insert(peerFromMTP(d.vto_id));
+		if (d.has_from_id()) {
+			addUser(d.vfrom_id);
+		}
+		if (d.has_via_bot_id()) {
+			addUser(d.vvia_bot_id);
+		}
+		if (d.has_fwd_from() && d.vfwd_from.type() == mtpc_messageFwdHeader) {
+			auto &info = d.vfwd_from.c_messageFwdHeader();
+			if (info.has_from_id()) {
+				addUser(info.vfrom_id);
+			}
+			if (info.has_channel_id()) {
+				peers.insert(peerFromChannel(info.vchannel_id));
+			}
+		}
+		if (d.has_media() && d.vmedia.type() == mtpc_messageMediaContact) {
+			addUser(d.vmedia.c_messageMediaContact().vuser_id);
+		}
+		if (d.has_entities()) {
+			for_const (auto &entity, d.ventities.v) {
+				if (entity.type() == mtpc_messageEntityMentionName) {
+					addUser(entity.c_messageEntityMentionName().vuser_id);
+				}
+			}
+		}
+	} break;
+	case mtpc_messageService: {
+		auto &d = message.c_messageService();
+		peers.insert(peerFromMTP(d.vto_id));
+		if (d.has_from_id()) {
+			addUser(d.vfrom_id);
+		}
+		switch (d.vaction.type()) {
+		case mtpc_messageActionChatCreate: {
+			for_const (auto &userId, d.vaction.c_messageActionChatCreate().vusers.v) {
+				addUser(userId);
+			}
+		} break;
+		case mtpc_messageActionChatAddUser: {
+			for_const (auto &userId, d.vaction.c_messageActionChatAddUser().vusers.v) {
+				addUser(userId);
+			}
+		} break;
+		case mtpc_messageActionChatDeleteUser: addUser(d.vaction.c_messageActionChatDeleteUser().vuser_id); break;
+		case mtpc_messageActionChatJoinedByLink: addUser(d.vaction.c_messageActionChatJoinedByLink().vinviter_id); break;
+		case mtpc_messageActionChatMigrateTo: peers.insert(peerFromChannel(d.vaction.c_messageActionChatMigrateTo().vchannel_id)); break;
+		case mtpc_messageActionChannelMigrateFrom: peers.insert(peerFromChat(d.vaction.c_messageActionChannelMigrateFrom().vchat_id)); break;
+		}
+	} break;
+	}
+}
+
+PeerId _chatPeerId(const MTPChat &chat) {
+	switch (chat.type()) {
+	case mtpc_chatEmpty: return peerFromChat(chat.c_chatEmpty().vid);
+	case mtpc_chat: return peerFromChat(chat.c_chat().vid);
+	case mtpc_chatForbidden: return peerFromChat(chat.c_chatForbidden().vid);
+	case mtpc_channel: return peerFromChannel(chat.c_channel().vid);
+	case mtpc_channelForbidden: return peerFromChannel(chat.c_channelForbidden().vid);
+	}
+	return 0;
+}
+
+PeerId _userPeerId(const MTPUser &user) {
+	switch (user.type()) {
+	case mtpc_userEmpty: return peerFromUser(user.c_userEmpty().vid);
+	case mtpc_user: return peerFromUser(user.c_user().vid);
+	}
+	return 0;
+}
+
+void _markHistoryCacheOpened(const PeerId &peer) {
+	_historyCacheOpened[peer] = ++_historyCacheOpenTick;
+}
+
+void _checkHistoryCacheCount(const PeerId &keep) {
+	while (_historyCacheMap.size() > kHistoryCacheChatsCount) {
+		auto oldest = PeerId(0);
+		auto oldestOpened = quint64(0);
+		for (auto i = _historyCacheMap.cbegin(), e = _historyCacheMap.cend(); i != e; ++i) {
+			if (i.key() == keep) {
+				continue;
+			}
+			auto opened = _historyCacheOpened.value(i.key(), 0);
+			if (!oldest || opened < oldestOpened) {
+				oldest = i.key();
+				oldestOpened = opened;
+			}
+		}
+		if (!oldest) {
+			break;
+		}
+		clearHistoryCache(oldest);
+	}
+}
+
+} // namespace
+
+void writeHistoryCache(const PeerId &peer, const MTPmessages_Messages &slice) {
+	if (!_working()) return;
+
+	const QVector<MTPMessage> *messages = nullptr;
+	const QVector<MTPChat> *chats = nullptr;
+	const QVector<MTPUser> *users = nullptr;
+	switch (slice.type()) {
+	case mtpc_messages_messages: {
+		auto &d = slice.c_messages_messages();
+		messages = &d.vmessages.v;
+		chats = &d.vchats.v;
+		users = &d.vusers.v;
+	} break;
+	case mtpc_messages_messagesSlice: {
+		auto &d = slice.c_messages_messagesSlice();
+		messages = &d.vmessages.v;
+		chats = &d.vchats.v;
+		users = &d.vusers.v;
+	} break;
+	case mtpc_messages_channelMessages: {
+		auto &d = slice.c_messages_channelMessages();
+		messages = &d.vmessages.v;
+		chats = &d.vchats.v;
+		users = &d.vusers.v;
+	} break;
+	}
+	if (!messages || messages->isEmpty()) {
+		clearHistoryCache(peer);
+		return;
+	}
+
+	_markHistoryCacheOpened(peer);
+	auto i = _historyCacheMap.constFind(peer);
+	if (i == _historyCacheMap.cend()) {
+		i = _historyCacheMap.insert(peer, genKey());
+		_journalPeerMapChange(lskHistoryCache, MapJournalOp::Insert, peer, i.value());
+		_checkHistoryCacheCount(peer);
+		i = _historyCacheMap.constFind(peer);
+	}
+
+	// Messages come from the newest one, keep only the last screen
+	// and only the users and chats that those messages refer to.
+	auto keptMessages = messages->mid(0, kHistoryCacheMessagesCount);
+	auto peers = OrderedSet<PeerId>();
+	peers.insert(peer);
+	for_const (auto &message, keptMessages) {
+		_collectMessagePeers(message, peers);
+	}
+	auto keptChats = QVector<MTPChat>();
+	for_const (auto &chat, *chats) {
+		if (peers.contains(_chatPeerId(chat))) {
+			keptChats.push_back(chat);
+		}
+	}
+	auto keptUsers = QVector<MTPUser>();
+	for_const (auto &user, *users) {
+		if (peers.contains(_userPeerId(user))) {
+			keptUsers.push_back(user);
+		}
+	}
+	auto kept = MTP_messages_messages(MTP_vector<MTPMessage>(keptMessages), MTP_vector<MTPChat>(keptChats), MTP_vector<MTPUser>(keptUsers));
+	auto buffer = mtpBuffer();
+	buffer.reserve(kept.innerLength() >> 2);
+	kept.write(buffer);
+	auto serialized = QByteArray::fromRawData(reinterpret_cast<const char*>(buffer.constData()), buffer.size() * sizeof(mtpPrime));
+
+	EncryptedDescriptor data(sizeof(quint64) + Serialize::bytearraySize(serialized));
+	data.stream << quint64(peer) << serialized;
+
+	FileWriteDescriptor file(i.value());
+	file.writeEncrypted(data);
+}
+
+bool readHistoryCache(const PeerId &peer, MTPmessages_Messages &result) {
+	auto i = _historyCacheMap.constFind(peer);
+	if (i == _historyCacheMap.cend()) {
+		return false;
+	}
+	_markHistoryCacheOpened(peer);
+
+	FileReadDescriptor cache;
+	if (!readEncryptedFile(cache, i.value())) {
+		clearHistoryCache(peer);
+		return false;
+	}
+
+	quint64 cachePeer = 0;
+	QByteArray serialized;
+	cache.stream >> cachePeer >> serialized;
+	if (!_checkStreamStatus(cache.stream) || cachePeer != peer || serialized.size() % sizeof(mtpPrime)) {
+		clearHistoryCache(peer);
+		return false;
+	}
+
+	try {
+		auto from = reinterpret_cast<const mtpPrime*>(serialized.constData());
+		auto end = from + (serialized.size() / sizeof(mtpPrime));
+		result.read(from, end);
+	} catch (Exception &e) {
+		LOG(("App Error: could not parse history cache, %1").arg(e.what()));
+		clearHistoryCache(peer);
+		return false;
+	}
+	return true;
+}
+
+void clearHistoryCache(const PeerId &peer) {
+	if (!_working()) return;
+
+	auto i = _historyCacheMap.find(peer);
+	if (i != _historyCacheMap.cend()) {
+		clearKey(i.value());
+		_historyCacheMap.erase(i);
+		_historyCacheOpened.remove(peer);
+		_journalPeerMapChange(lskHistoryCache, MapJournalOp::Remove, peer);
+	}
+}
+
 void writeFileLocation(MediaKey location, const FileLocation &local) {
 	if (local.fname.isEmpty()) return;
 
@@ -2645,82 +3338,290 @@ FileLocation readFileLocation(MediaKey location, bool check) {
 	return FileLocation();
 }
 
-qint32 _storageImageSize(qint32 rawlen) {
-	// fulllen + storagekey + type + len + data
-	qint32 result = sizeof(uint32) + sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + rawlen;
-	if (result & 0x0F) result += 0x10 - (result & 0x0F);
-	result += tdfMagicLen + sizeof(qint32) + sizeof(quint32) + 0x10 + 0x10; // magic + version + len of encrypted + part of sha1 + md5
-	return result;
+void writeDownloadState(const MediaKey &location, const DownloadState &state) {
+	if (!_working()) return;
+
+	auto added = !_downloadStates.contains(location);
+	_downloadStates.insert(location, state);
+	if (added) {
+		_expireDownloadStates(location);
+	}
+	_writeDownloads();
 }
 
-qint32 _storageStickerSize(qint32 rawlen) {
-	// fulllen + storagekey + len + data
-	qint32 result = sizeof(uint32) + sizeof(quint64) * 2 + sizeof(quint32) + rawlen;
-	if (result & 0x0F) result += 0x10 - (result & 0x0F);
-	result += tdfMagicLen + sizeof(qint32) + sizeof(quint32) + 0x10 + 0x10; // magic + version + len of encrypted + part of sha1 + md5
-	return result;
+DownloadState readDownloadState(const MediaKey &location) {
+	return _downloadStates.value(location);
 }
 
-qint32 _storageAudioSize(qint32 rawlen) {
-	// fulllen + storagekey + len + data
-	qint32 result = sizeof(uint32) + sizeof(quint64) * 2 + sizeof(quint32) + rawlen;
-	if (result & 0x0F) result += 0x10 - (result & 0x0F);
-	result += tdfMagicLen + sizeof(qint32) + sizeof(quint32) + 0x10 + 0x10; // magic + version + len of encrypted + part of sha1 + md5
-	return result;
+void removeDownloadState(const MediaKey &location) {
+	if (_working() && _downloadStates.remove(location)) {
+		_writeDownloads(WriteMapWhen::Fast);
+	}
+}
+
+namespace {
+
+StorageKey _webFileKey(const QString &url) {
+	auto utf8 = url.toUtf8();
+	quint64 hash[2];
+	hashMd5(utf8.constData(), utf8.size(), hash);
+	return StorageKey(hash[0], hash[1]);
+}
+
+StorageMap *_legacyMap(Storage::CacheCategory category) {
+	switch (category) {
+	case Storage::CacheCategory::Image: return &_imagesMap;
+	case Storage::CacheCategory::StickerImage: return &_stickerImagesMap;
+	case Storage::CacheCategory::Audio: return &_audiosMap;
+	}
+	return nullptr;
+}
+
+quint32 _legacyKeyType(Storage::CacheCategory category) {
+	switch (category) {
+	case Storage::CacheCategory::Image: return lskImages;
+	case Storage::CacheCategory::StickerImage: return lskStickerImages;
+	case Storage::CacheCategory::Audio: return lskAudios;
+	}
+	Unexpected("Category in _legacyKeyType.");
+}
+
+qint64 *_legacySize(Storage::CacheCategory category) {
+	switch (category) {
+	case Storage::CacheCategory::Image: return &_storageImagesSize;
+	case Storage::CacheCategory::StickerImage: return &_storageStickersSize;
+	case Storage::CacheCategory::Audio: return &_storageAudiosSize;
+	}
+	return nullptr;
+}
+
+bool _cacheStoreWorking() {
+	return _working() && _cacheStore && _cacheStore->valid();
+}
+
+class CacheMaintenanceTask : public Task {
+public:
+	void process() override {
+		_cacheStore->evict();
+		_cacheStore->compact();
+	}
+	void finish() override {
+		_cacheMaintenanceQueued = false;
+	}
+
+};
+
+void _checkCacheMaintenance() {
+	if (_cacheMaintenanceQueued || !_localLoader || !_cacheStoreWorking()) {
+		return;
+	}
+	if (_cacheStore->evictionNeeded() || _cacheStore->compactionNeeded()) {
+		_cacheMaintenanceQueued = true;
+		_localLoader->addTask(MakeShared<CacheMaintenanceTask>());
+	}
+}
+
+void _clearLegacy(Storage::CacheCategory category, const StorageKey &location) {
+	auto map = _legacyMap(category);
+	auto i = map->find(location);
+	if (i != map->end()) {
+		clearKey(i.value().first, FileOption::User);
+		*_legacySize(category) -= i.value().second;
+		map->erase(i);
+		_journalStorageChange(_legacyKeyType(category), MapJournalOp::Remove, location);
+	}
+}
+
+bool _hasCached(Storage::CacheCategory category, const StorageKey &location) {
+	if (_cacheStoreWorking() && _cacheStore->contains(category, location)) {
+		return true;
+	}
+	auto map = _legacyMap(category);
+	return map->constFind(location) != map->cend();
 }
 
+void _writeCached(Storage::CacheCategory category, const StorageKey &location, EncryptedDescriptor &data) {
+	if (_cacheStore->put(category, location, FileWriteDescriptor::prepareEncrypted(data))) {
+		_clearLegacy(category, location);
+		_checkCacheMaintenance();
+	}
+}
+
+void _removeCached(Storage::CacheCategory category, const StorageKey &location) {
+	if (_cacheStoreWorking()) {
+		_cacheStore->remove(category, location);
+		_checkCacheMaintenance();
+	}
+}
+
+// Removes the files of the migrated legacy cache entries, after they were
+// removed from the maps, so that the main thread never looks for them.
+class LegacyFilesRemoveTask : public Task {
+public:
+	LegacyFilesRemoveTask(std::vector<FileKey> &&keys) : _keys(std::move(keys)) {
+	}
+	void process() override {
+		for (auto key : _keys) {
+			clearKey(key, FileOption::User);
+		}
+	}
+	void finish() override {
+	}
+
+private:
+	std::vector<FileKey> _keys;
+
+};
+
+// Moves the cached media from separate files to the cache store.
+class CacheMigrationTask : public Task {
+public:
+	CacheMigrationTask() : _generation(_cacheStore->generation()) {
+		for (auto category : { Storage::CacheCategory::Image, Storage::CacheCategory::StickerImage, Storage::CacheCategory::Audio }) {
+			auto map = _legacyMap(category);
+			for (auto i = map->cbegin(), e = map->cend(); i != e; ++i) {
+				_entries.push_back({ category, i.key(), i.value().first, QString(), false });
+			}
+		}
+		for (auto i = _webFilesMap.cbegin(), e = _webFilesMap.cend(); i != e; ++i) {
+			_entries.push_back({ Storage::CacheCategory::WebFile, _webFileKey(i.key()), i.value().first, i.key(), false });
+		}
+	}
+	void process() override {
+		for (auto &entry : _entries) {
+			if (QThread::currentThread()->isInterruptionRequested()) {
+				return;
+			}
+			FileReadDescriptor file;
+			if (readFile(file, toFilePart(entry.key), FileOption::User)) {
+				QByteArray encrypted;
+				file.stream >> encrypted;
+				if (!_checkStreamStatus(file.stream) || !_cacheStore->put(entry.category, entry.location, encrypted, _generation)) {
+					continue;
+				}
+			}
+			entry.migrated = true;
+		}
+	}
+	void finish() override {
+		auto webFilesChanged = false;
+		auto removed = std::vector<FileKey>();
+		for_const (auto &entry, _entries) {
+			if (!entry.migrated) {
+				continue;
+			}
+			if (entry.category == Storage::CacheCategory::WebFile) {
+				auto i = _webFilesMap.find(entry.url);
+				if (i != _webFilesMap.end() && i.value().first == entry.key) {
+					_storageWebFilesSize -= i.value().second;
+					_webFilesMap.erase(i);
+					removed.push_back(entry.key);
+					webFilesChanged = true;
+				}
+				continue;
+			}
+			auto map = _legacyMap(entry.category);
+			auto i = map->find(entry.location);
+			if (i != map->end() && i.value().first == entry.key) {
+				*_legacySize(entry.category) -= i.value().second;
+				map->erase(i);
+				removed.push_back(entry.key);
+				_mapChanged = true;
+			}
+		}
+		if (_mapChanged) {
+			_writeMap();
+		}
+		if (webFilesChanged) {
+			_writeLocations();
+		}
+		LOG(("App Info: migrated %1 cached files to the cache store").arg(removed.size()));
+		if (!removed.empty() && _localLoader) {
+			_localLoader->addTask(MakeShared<LegacyFilesRemoveTask>(std::move(removed)));
+		}
+	}
+
+private:
+	struct Entry {
+		Storage::CacheCategory category;
+		StorageKey location;
+		FileKey key;
+		QString url;
+		bool migrated;
+	};
+	std::vector<Entry> _entries;
+	int _generation = 0;
+
+};
+
+void _openCacheStore() {
+	// Opening scans all the segment headers, so it is done only once the
+	// map was read and the local key is known.
+	_cacheStore = std::make_unique<Storage::CacheStore>(_userBasePath + qsl("cache/"));
+	_cacheStore->open();
+}
+
+void _startCacheMigration() {
+	if (!_localLoader || !_cacheStoreWorking()) {
+		return;
+	}
+	if (_imagesMap.isEmpty() && _stickerImagesMap.isEmpty() && _audiosMap.isEmpty() && _webFilesMap.isEmpty()) {
+		return;
+	}
+	_localLoader->addTask(MakeShared<CacheMigrationTask>());
+}
+
+} // namespace
+
 void writeImage(const StorageKey &location, const ImagePtr &image) {
 	if (image->isNull() || !image->loaded()) return;
-	if (_imagesMap.constFind(location) != _imagesMap.cend()) return;
+	if (_hasCached(Storage::CacheCategory::Image, location)) return;
 
 	image->forget();
 	writeImage(location, StorageImageSaved(image->savedData()), false);
 }
 
 void writeImage(const StorageKey &location, const StorageImageSaved &image, bool overwrite) {
-	if (!_working()) return;
-
-	qint32 size = _storageImageSize(image.data.size());
-	StorageMap::const_iterator i = _imagesMap.constFind(location);
-	if (i == _imagesMap.cend()) {
-		i = _imagesMap.insert(location, FileDesc(genKey(FileOption::User), size));
-		_storageImagesSize += size;
-		_mapChanged = true;
-		_writeMap();
-	} else if (!overwrite) {
-		return;
-	}
+	if (!_cacheStoreWorking()) return;
+	if (!overwrite && _hasCached(Storage::CacheCategory::Image, location)) return;
 
 	auto legacyTypeField = 0;
 
 	EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + image.data.size());
 	data.stream << quint64(location.first) << quint64(location.second) << quint32(legacyTypeField) << image.data;
-
-	FileWriteDescriptor file(i.value().first, FileOption::User);
-	file.writeEncrypted(data);
-	if (i.value().second != size) {
-		_storageImagesSize += size;
-		_storageImagesSize -= i.value().second;
-		_imagesMap[location].second = size;
-	}
+	_writeCached(Storage::CacheCategory::Image, location, data);
 }
 
 class AbstractCachedLoadTask : public Task {
 public:
 
-	AbstractCachedLoadTask(const FileKey &key, const StorageKey &location, bool readImageFlag, mtpFileLoader *loader) :
-		_key(key), _location(location), _readImageFlag(readImageFlag), _loader(loader), _result(0) {
+	AbstractCachedLoadTask(Storage::CacheCategory category, const StorageKey &location, bool readImageFlag, mtpFileLoader *loader) :
+		_category(category), _location(location), _readImageFlag(readImageFlag), _loader(loader), _result(0) {
+		auto map = _legacyMap(category);
+		auto i = map->constFind(location);
+		if (i != map->cend() && !_cacheStore->contains(category, location)) {
+			_legacyKey = i.value().first;
+		}
 	}
 	void process() {
-		FileReadDescriptor image;
-		if (!readEncryptedFile(image, _key, FileOption::User)) {
+		QByteArray encrypted;
+		if (_legacyKey) {
+			FileReadDescriptor file;
+			if (!readFile(file, toFilePart(_legacyKey), FileOption::User)) {
+				return;
+			}
+			file.stream >> encrypted;
+		} else {
+			encrypted = _cacheStore->get(_category, _location);
+		}
+		EncryptedDescriptor data;
+		if (encrypted.isEmpty() || !decryptLocal(data, encrypted)) {
 			return;
 		}
 
 		QByteArray imageData;
 		quint64 locFirst, locSecond;
-		quint32 legacyTypeField = 0;
-		readFromStream(image.stream, locFirst, locSecond, imageData);
+		readFromStream(data.stream, locFirst, locSecond, imageData);
 
 		// we're saving files now before we have actual location
 		//if (locFirst != _location.first || locSecond != _location.second) {
@@ -2738,13 +3639,27 @@ public:
 		}
 	}
 	virtual void readFromStream(QDataStream &stream, quint64 &first, quint64 &second, QByteArray &data) = 0;
-	virtual void clearInMap() = 0;
 	virtual ~AbstractCachedLoadTask() {
 		delete base::take(_result);
 	}
 
 protected:
-	FileKey _key;
+	void clearInMap() {
+		if (!_legacyKey) {
+			_removeCached(_category, _location);
+			return;
+		}
+		auto map = _legacyMap(_category);
+		auto j = map->find(_location);
+		if (j != map->cend() && j->first == _legacyKey) {
+			clearKey(_legacyKey, FileOption::User);
+			*_legacySize(_category) -= j->second;
+			map->erase(j);
+		}
+	}
+
+	Storage::CacheCategory _category;
+	FileKey _legacyKey = 0;
 	StorageKey _location;
 	bool _readImageFlag;
 	struct Result {
@@ -2769,229 +3684,195 @@ protected:
 
 class ImageLoadTask : public AbstractCachedLoadTask {
 public:
-	ImageLoadTask(const FileKey &key, const StorageKey &location, mtpFileLoader *loader) :
-	AbstractCachedLoadTask(key, location, true, loader) {
+	ImageLoadTask(const StorageKey &location, mtpFileLoader *loader) :
+	AbstractCachedLoadTask(Storage::CacheCategory::Image, location, true, loader) {
 	}
 	void readFromStream(QDataStream &stream, quint64 &first, quint64 &second, QByteArray &data) override {
 		qint32 legacyTypeField = 0;
 		stream >> first >> second >> legacyTypeField >> data;
 	}
-	void clearInMap() override {
-		StorageMap::iterator j = _imagesMap.find(_location);
-		if (j != _imagesMap.cend() && j->first == _key) {
-			clearKey(_key, FileOption::User);
-			_storageImagesSize -= j->second;
-			_imagesMap.erase(j);
-		}
-	}
 };
 
 TaskId startImageLoad(const StorageKey &location, mtpFileLoader *loader) {
-	StorageMap::const_iterator j = _imagesMap.constFind(location);
-	if (j == _imagesMap.cend() || !_localLoader) {
+	if (!_cacheLoader || !_cacheStoreWorking() || !_hasCached(Storage::CacheCategory::Image, location)) {
 		return 0;
 	}
-	return _localLoader->addTask(MakeShared<ImageLoadTask>(j->first, location, loader));
+	return _cacheLoader->addTask(MakeShared<ImageLoadTask>(location, loader), loader->priority());
 }
 
 int32 hasImages() {
-	return _imagesMap.size();
+	auto result = _imagesMap.size();
+	if (_cacheStore) result += _cacheStore->count(Storage::CacheCategory::Image);
+	return result;
 }
 
 qint64 storageImagesSize() {
-	return _storageImagesSize;
+	auto result = _storageImagesSize;
+	if (_cacheStore) result += _cacheStore->size(Storage::CacheCategory::Image);
+	return result;
 }
 
 void writeStickerImage(const StorageKey &location, const QByteArray &sticker, bool overwrite) {
-	if (!_working()) return;
+	if (!_cacheStoreWorking()) return;
+	if (!overwrite && _hasCached(Storage::CacheCategory::StickerImage, location)) return;
 
-	qint32 size = _storageStickerSize(sticker.size());
-	StorageMap::const_iterator i = _stickerImagesMap.constFind(location);
-	if (i == _stickerImagesMap.cend()) {
-		i = _stickerImagesMap.insert(location, FileDesc(genKey(FileOption::User), size));
-		_storageStickersSize += size;
-		_mapChanged = true;
-		_writeMap();
-	} else if (!overwrite) {
-		return;
-	}
 	EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + sticker.size());
 	data.stream << quint64(location.first) << quint64(location.second) << sticker;
-	FileWriteDescriptor file(i.value().first, FileOption::User);
-	file.writeEncrypted(data);
-	if (i.value().second != size) {
-		_storageStickersSize += size;
-		_storageStickersSize -= i.value().second;
-		_stickerImagesMap[location].second = size;
-	}
+	_writeCached(Storage::CacheCategory::StickerImage, location, data);
 }
 
 class StickerImageLoadTask : public AbstractCachedLoadTask {
 public:
-	StickerImageLoadTask(const FileKey &key, const StorageKey &location, mtpFileLoader *loader) :
-	AbstractCachedLoadTask(key, location, true, loader) {
+	StickerImageLoadTask(const StorageKey &location, mtpFileLoader *loader) :
+	AbstractCachedLoadTask(Storage::CacheCategory::StickerImage, location, true, loader) {
 	}
 	void readFromStream(QDataStream &stream, quint64 &first, quint64 &second, QByteArray &data) {
 		stream >> first >> second >> data;
 	}
-	void clearInMap() {
-		auto j = _stickerImagesMap.find(_location);
-		if (j != _stickerImagesMap.cend() && j->first == _key) {
-			clearKey(j.value().first, FileOption::User);
-			_storageStickersSize -= j.value().second;
-			_stickerImagesMap.erase(j);
-		}
-	}
 };
 
+bool _copyCached(Storage::CacheCategory category, const StorageKey &oldLocation, const StorageKey &newLocation) {
+	if (_cacheStoreWorking() && _cacheStore->copy(category, oldLocation, newLocation)) {
+		_checkCacheMaintenance();
+		return true;
+	}
+	auto map = _legacyMap(category);
+	auto i = map->constFind(oldLocation);
+	if (i == map->cend()) {
+		return false;
+	}
+	auto desc = i.value();
+	map->insert(newLocation, desc);
+	*_legacySize(category) += desc.second;
+	_journalStorageChange(_legacyKeyType(category), MapJournalOp::Insert, newLocation, desc);
+	return true;
+}
+
 TaskId startStickerImageLoad(const StorageKey &location, mtpFileLoader *loader) {
-	auto j = _stickerImagesMap.constFind(location);
-	if (j == _stickerImagesMap.cend() || !_localLoader) {
+	if (!_cacheLoader || !_cacheStoreWorking() || !_hasCached(Storage::CacheCategory::StickerImage, location)) {
 		return 0;
 	}
-	return _localLoader->addTask(MakeShared<StickerImageLoadTask>(j->first, location, loader));
+	return _cacheLoader->addTask(MakeShared<StickerImageLoadTask>(location, loader), loader->priority());
 }
 
 bool willStickerImageLoad(const StorageKey &location) {
-	return _stickerImagesMap.constFind(location) != _stickerImagesMap.cend();
+	return _hasCached(Storage::CacheCategory::StickerImage, location);
 }
 
 bool copyStickerImage(const StorageKey &oldLocation, const StorageKey &newLocation) {
-	auto i = _stickerImagesMap.constFind(oldLocation);
-	if (i == _stickerImagesMap.cend()) {
-		return false;
-	}
-	_stickerImagesMap.insert(newLocation, i.value());
-	_mapChanged = true;
-	_writeMap();
-	return true;
+	return _copyCached(Storage::CacheCategory::StickerImage, oldLocation, newLocation);
 }
 
 int32 hasStickers() {
-	return _stickerImagesMap.size();
+	auto result = _stickerImagesMap.size();
+	if (_cacheStore) result += _cacheStore->count(Storage::CacheCategory::StickerImage);
+	return result;
 }
 
 qint64 storageStickersSize() {
-	return _storageStickersSize;
+	auto result = _storageStickersSize;
+	if (_cacheStore) result += _cacheStore->size(Storage::CacheCategory::StickerImage);
+	return result;
 }
 
 void writeAudio(const StorageKey &location, const QByteArray &audio, bool overwrite) {
-	if (!_working()) return;
+	if (!_cacheStoreWorking()) return;
+	if (!overwrite && _hasCached(Storage::CacheCategory::Audio, location)) return;
 
-	qint32 size = _storageAudioSize(audio.size());
-	StorageMap::const_iterator i = _audiosMap.constFind(location);
-	if (i == _audiosMap.cend()) {
-		i = _audiosMap.insert(location, FileDesc(genKey(FileOption::User), size));
-		_storageAudiosSize += size;
-		_mapChanged = true;
-		_writeMap();
-	} else if (!overwrite) {
-		return;
-	}
 	EncryptedDescriptor data(sizeof(quint64) * 2 + sizeof(quint32) + sizeof(quint32) + audio.size());
 	data.stream << quint64(location.first) << quint64(location.second) << audio;
-	FileWriteDescriptor file(i.value().first, FileOption::User);
-	file.writeEncrypted(data);
-	if (i.value().second != size) {
-		_storageAudiosSize += size;
-		_storageAudiosSize -= i.value().second;
-		_audiosMap[location].second = size;
-	}
+	_writeCached(Storage::CacheCategory::Audio, location, data);
 }
 
 class AudioLoadTask : public AbstractCachedLoadTask {
 public:
-	AudioLoadTask(const FileKey &key, const StorageKey &location, mtpFileLoader *loader) :
-	AbstractCachedLoadTask(key, location, false, loader) {
+	AudioLoadTask(const StorageKey &location, mtpFileLoader *loader) :
+	AbstractCachedLoadTask(Storage::CacheCategory::Audio, location, false, loader) {
 	}
 	void readFromStream(QDataStream &stream, quint64 &first, quint64 &second, QByteArray &data) {
 		stream >> first >> second >> data;
 	}
-	void clearInMap() {
-		auto j = _audiosMap.find(_location);
-		if (j != _audiosMap.cend() && j->first == _key) {
-			clearKey(j.value().first, FileOption::User);
-			_storageAudiosSize -= j.value().second;
-			_audiosMap.erase(j);
-		}
-	}
 };
 
 TaskId startAudioLoad(const StorageKey &location, mtpFileLoader *loader) {
-	auto j = _audiosMap.constFind(location);
-	if (j == _audiosMap.cend() || !_localLoader) {
+	if (!_cacheLoader || !_cacheStoreWorking() || !_hasCached(Storage::CacheCategory::Audio, location)) {
 		return 0;
 	}
-	return _localLoader->addTask(MakeShared<AudioLoadTask>(j->first, location, loader));
+	return _cacheLoader->addTask(MakeShared<AudioLoadTask>(location, loader), loader->priority());
 }
 
 bool copyAudio(const StorageKey &oldLocation, const StorageKey &newLocation) {
-	auto i = _audiosMap.constFind(oldLocation);
-	if (i == _audiosMap.cend()) {
-		return false;
-	}
-	_audiosMap.insert(newLocation, i.value());
-	_mapChanged = true;
-	_writeMap();
-	return true;
+	return _copyCached(Storage::CacheCategory::Audio, oldLocation, newLocation);
 }
 
 int32 hasAudios() {
-	return _audiosMap.size();
+	auto result = _audiosMap.size();
+	if (_cacheStore) result += _cacheStore->count(Storage::CacheCategory::Audio);
+	return result;
 }
 
 qint64 storageAudiosSize() {
-	return _storageAudiosSize;
-}
-
-qint32 _storageWebFileSize(const QString &url, qint32 rawlen) {
-	// fulllen + url + len + data
-	qint32 result = sizeof(uint32) + Serialize::stringSize(url) + sizeof(quint32) + rawlen;
-	if (result & 0x0F) result += 0x10 - (result & 0x0F);
-	result += tdfMagicLen + sizeof(qint32) + sizeof(quint32) + 0x10 + 0x10; // magic + version + len of encrypted + part of sha1 + md5
+	auto result = _storageAudiosSize;
+	if (_cacheStore) result += _cacheStore->size(Storage::CacheCategory::Audio);
 	return result;
 }
 
 void writeWebFile(const QString &url, const QByteArray &content, bool overwrite) {
-	if (!_working()) return;
+	if (!_cacheStoreWorking()) return;
 
-	qint32 size = _storageWebFileSize(url, content.size());
-	WebFilesMap::const_iterator i = _webFilesMap.constFind(url);
-	if (i == _webFilesMap.cend()) {
-		i = _webFilesMap.insert(url, FileDesc(genKey(FileOption::User), size));
-		_storageWebFilesSize += size;
-		_writeLocations();
-	} else if (!overwrite) {
+	auto location = _webFileKey(url);
+	auto legacy = _webFilesMap.constFind(url);
+	if (!overwrite && (legacy != _webFilesMap.cend() || _cacheStore->contains(Storage::CacheCategory::WebFile, location))) {
 		return;
 	}
 	EncryptedDescriptor data(Serialize::stringSize(url) + sizeof(quint32) + sizeof(quint32) + content.size());
 	data.stream << url << content;
-	FileWriteDescriptor file(i.value().first, FileOption::User);
-	file.writeEncrypted(data);
-	if (i.value().second != size) {
-		_storageWebFilesSize += size;
-		_storageWebFilesSize -= i.value().second;
-		_webFilesMap[url].second = size;
+	if (!_cacheStore->put(Storage::CacheCategory::WebFile, location, FileWriteDescriptor::prepareEncrypted(data))) {
+		return;
 	}
+	if (legacy != _webFilesMap.cend()) {
+		clearKey(legacy.value().first, FileOption::User);
+		_storageWebFilesSize -= legacy.value().second;
+		_webFilesMap.remove(url);
+		_writeLocations();
+	}
+	_checkCacheMaintenance();
 }
 
 class WebFileLoadTask : public Task {
 public:
-	WebFileLoadTask(const FileKey &key, const QString &url, webFileLoader *loader)
-		: _key(key)
-		, _url(url)
+	WebFileLoadTask(const QString &url, webFileLoader *loader)
+		: _url(url)
+		, _location(_webFileKey(url))
 		, _loader(loader)
 		, _result(0) {
+		auto i = _webFilesMap.constFind(url);
+		if (i != _webFilesMap.cend() && !_cacheStore->contains(Storage::CacheCategory::WebFile, _location)) {
+			_legacyKey = i.value().first;
+		}
 	}
 	void process() {
-		FileReadDescriptor image;
-		if (!readEncryptedFile(image, _key, FileOption::User)) {
+		QByteArray encrypted;
+		if (_legacyKey) {
+			FileReadDescriptor file;
+			if (!readFile(file, toFilePart(_legacyKey), FileOption::User)) {
+				return;
+			}
+			file.stream >> encrypted;
+		} else {
+			encrypted = _cacheStore->get(Storage::CacheCategory::WebFile, _location);
+		}
+		EncryptedDescriptor data;
+		if (encrypted.isEmpty() || !decryptLocal(data, encrypted)) {
 			return;
 		}
 
 		QByteArray imageData;
 		QString url;
-		image.stream >> url >> imageData;
+		data.stream >> url >> imageData;
+		if (url != _url) {
+			return;
+		}
 
 		_result = new Result(imageData);
 	}
@@ -2999,11 +3880,15 @@ public:
 		if (_result) {
 			_loader->localLoaded(_result->image, _result->format, _result->pixmap);
 		} else {
-			WebFilesMap::iterator j = _webFilesMap.find(_url);
-			if (j != _webFilesMap.cend() && j->first == _key) {
-				clearKey(j.value().first, FileOption::User);
-				_storageWebFilesSize -= j.value().second;
-				_webFilesMap.erase(j);
+			if (_legacyKey) {
+				WebFilesMap::iterator j = _webFilesMap.find(_url);
+				if (j != _webFilesMap.cend() && j->first == _legacyKey) {
+					clearKey(j.value().first, FileOption::User);
+					_storageWebFilesSize -= j.value().second;
+					_webFilesMap.erase(j);
+				}
+			} else {
+				_removeCached(Storage::CacheCategory::WebFile, _location);
 			}
 			_loader->localLoaded(StorageImageSaved());
 		}
@@ -3013,8 +3898,9 @@ public:
 	}
 
 protected:
-	FileKey _key;
+	FileKey _legacyKey = 0;
 	QString _url;
+	StorageKey _location;
 	struct Result {
 		explicit Result(const QByteArray &data) : image(data) {
 			QByteArray guessFormat;
@@ -3034,19 +3920,42 @@ protected:
 };
 
 TaskId startWebFileLoad(const QString &url, webFileLoader *loader) {
-	WebFilesMap::const_iterator j = _webFilesMap.constFind(url);
-	if (j == _webFilesMap.cend() || !_localLoader) {
+	if (!_cacheLoader || !_cacheStoreWorking()) {
+		return 0;
+	}
+	if (_webFilesMap.constFind(url) == _webFilesMap.cend() && !_cacheStore->contains(Storage::CacheCategory::WebFile, _webFileKey(url))) {
 		return 0;
 	}
-	return _localLoader->addTask(MakeShared<WebFileLoadTask>(j->first, url, loader));
+	return _cacheLoader->addTask(MakeShared<WebFileLoadTask>(url, loader), loader->priority());
 }
 
 int32 hasWebFiles() {
-	return _webFilesMap.size();
+	auto result = _webFilesMap.size();
+	if (_cacheStore) result += _cacheStore->count(Storage::CacheCategory::WebFile);
+	return result;
+}
+
+Storage::CacheLimits cacheLimits() {
+	return _cacheLimits;
+}
+
+void setCacheLimits(const Storage::CacheLimits &limits) {
+	_cacheLimits = limits;
+	if (_cacheStore) {
+		_cacheStore->setLimits(_cacheLimits);
+		_checkCacheMaintenance();
+	}
+	_writeUserSettings();
+}
+
+Storage::CacheStats cacheStats() {
+	return _cacheStore ? _cacheStore->stats() : Storage::CacheStats();
 }
 
 qint64 storageWebFilesSize() {
-	return _storageWebFilesSize;
+	auto result = qint64(_storageWebFilesSize);
+	if (_cacheStore) result += _cacheStore->size(Storage::CacheCategory::WebFile);
+	return result;
 }
 
 class CountWaveformTask : public Task {
@@ -3121,6 +4030,9 @@ void countVoiceWaveform(DocumentData *document) {
 }
 
 void cancelTask(TaskId id) {
+	if (_cacheLoader) {
+		_cacheLoader->cancelTask(id);
+	}
 	if (_localLoader) {
 		_localLoader->cancelTask(id);
 	}
@@ -4340,6 +5252,9 @@ bool ClearManager::addTask(int task) {
 	if (!data->tasks.isEmpty() && (data->tasks.at(0) == ClearManagerAll)) return true;
 	if (task == ClearManagerAll) {
 		data->tasks.clear();
+		if (_cacheStore) {
+			_cacheStore->clear();
+		}
 		if (!_imagesMap.isEmpty()) {
 			_imagesMap.clear();
 			_storageImagesSize = 0;
@@ -4363,10 +5278,20 @@ bool ClearManager::addTask(int task) {
 			_draftCursorsMap.clear();
 			_mapChanged = true;
 		}
+		if (!_historyCacheMap.isEmpty()) {
+			_historyCacheMap.clear();
+			_mapChanged = true;
+		}
+		_historyCacheOpened.clear();
 		if (_locationsKey) {
 			_locationsKey = 0;
 			_mapChanged = true;
 		}
+		_clearDownloadStates();
+		if (_downloadsKey) {
+			_downloadsKey = 0;
+			_mapChanged = true;
+		}
 		if (_reportSpamStatusesKey) {
 			_reportSpamStatusesKey = 0;
 			_mapChanged = true;
@@ -4394,6 +5319,9 @@ bool ClearManager::addTask(int task) {
 		_writeMap();
 	} else {
 		if (task & ClearManagerStorage) {
+			if (_cacheStore) {
+				_cacheStore->clear();
+			}
 			if (data->images.isEmpty()) {
 				data->images = _imagesMap;
 			} else {
@@ -4529,7 +5457,7 @@ void ClearManager::onStart() {
 					if (!QDir(di.filePath()).removeRecursively()) result = false;
 				} else {
 					QString path = di.filePath();
-					if (!path.endsWith(qstr("map0")) && !path.endsWith(qstr("map1"))) {
+					if (!path.endsWith(qstr("map0")) && !path.endsWith(qstr("map1")) && !path.endsWith(qstr("map_journal"))) {
 						if (!QFile::remove(di.filePath())) result = false;
 					}
 				}
@@ -4579,6 +5507,8 @@ Manager::Manager() {
 	connect(&_mapWriteTimer, SIGNAL(timeout()), this, SLOT(mapWriteTimeout()));
 	_locationsWriteTimer.setSingleShot(true);
 	connect(&_locationsWriteTimer, SIGNAL(timeout()), this, SLOT(locationsWriteTimeout()));
+	_downloadsWriteTimer.setSingleShot(true);
+	connect(&_downloadsWriteTimer, SIGNAL(timeout()), this, SLOT(downloadsWriteTimeout()));
 }
 
 void Manager::writeMap(bool fast) {
@@ -4605,6 +5535,18 @@ void Manager::writingLocations() {
 	_locationsWriteTimer.stop();
 }
 
+void Manager::writeDownloads(bool fast) {
+	if (!_downloadsWriteTimer.isActive() || fast) {
+		_downloadsWriteTimer.start(fast ? 1 : WriteMapTimeout);
+	} else if (_downloadsWriteTimer.remainingTime() <= 0) {
+		downloadsWriteTimeout();
+	}
+}
+
+void Manager::writingDownloads() {
+	_downloadsWriteTimer.stop();
+}
+
 void Manager::mapWriteTimeout() {
 	_writeMap(WriteMapWhen::Now);
 }
@@ -4613,6 +5555,10 @@ void Manager::locationsWriteTimeout() {
 	_writeLocations(WriteMapWhen::Now);
 }
 
+void Manager::downloadsWriteTimeout() {
+	_writeDownloads(WriteMapWhen::Now);
+}
+
 void Manager::finish() {
 	if (_mapWriteTimer.isActive()) {
 		mapWriteTimeout();
@@ -4620,6 +5566,9 @@ void Manager::finish() {
 	if (_locationsWriteTimer.isActive()) {
 		locationsWriteTimeout();
 	}
+	if (_downloadsWriteTimer.isActive()) {
+		downloadsWriteTimeout();
+	}
 }
 
 } // namespace internal
@@ -22,6 +22,7 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 
 #include "core/basic_types.h"
 #include "storage/file_download.h"
+#include "storage/cache_store.h"
 #include "auth_session.h"
 
 namespace Window {
@@ -107,9 +108,28 @@ void writeDraftCursors(const PeerId &peer, const MessageCursor &localCursor, con
 bool hasDraftCursors(const PeerId &peer);
 bool hasDraft(const PeerId &peer);
 
+void writeHistoryCache(const PeerId &peer, const MTPmessages_Messages &slice);
+bool readHistoryCache(const PeerId &peer, MTPmessages_Messages &result);
+void clearHistoryCache(const PeerId &peer);
+
 void writeFileLocation(MediaKey location, const FileLocation &local);
 FileLocation readFileLocation(MediaKey location, bool check = true);
 
+// State of a partially downloaded document, to resume it after a restart.
+struct DownloadState {
+	QString path; // sparse partial file
+	qint32 size = 0;
+	QVector<QPair<qint32, qint32>> ranges; // sorted complete [from, till) ranges
+
+	MTP::DcId cdnDcId = 0;
+	QByteArray cdnToken;
+	QByteArray cdnEncryptionKey;
+	QByteArray cdnEncryptionIV;
+};
+void writeDownloadState(const MediaKey &location, const DownloadState &state);
+DownloadState readDownloadState(const MediaKey &location); // empty path if not found
+void removeDownloadState(const MediaKey &location);
+
 void writeImage(const StorageKey &location, const ImagePtr &img);
 void writeImage(const StorageKey &location, const StorageImageSaved &jpeg, bool overwrite = true);
 TaskId startImageLoad(const StorageKey &location, mtpFileLoader *loader);
@@ -134,6 +154,10 @@ TaskId startWebFileLoad(const QString &url, webFileLoader *loader);
 int32 hasWebFiles();
 qint64 storageWebFilesSize();
 
+Storage::CacheLimits cacheLimits();
+void setCacheLimits(const Storage::CacheLimits &limits);
+Storage::CacheStats cacheStats();
+
 void countVoiceWaveform(DocumentData *document);
 
 void cancelTask(TaskId id);
@@ -190,15 +214,19 @@ public:
 	void writingMap();
 	void writeLocations(bool fast);
 	void writingLocations();
+	void writeDownloads(bool fast);
+	void writingDownloads();
 	void finish();
 
 public slots:
 	void mapWriteTimeout();
 	void locationsWriteTimeout();
+	void downloadsWriteTimeout();
 
 private:
 	QTimer _mapWriteTimer;
 	QTimer _locationsWriteTimer;
+	QTimer _downloadsWriteTimer;
 
 };
 
@@ -1439,6 +1439,10 @@ void DocumentData::forget() {
 	thumb->forget();
 	if (sticker()) sticker()->img->forget();
 	replyPreview->forget();
+	forgetData();
+}
+
+void DocumentData::forgetData() {
 	_data.clear();
 }
 
@@ -1176,6 +1176,7 @@ public:
 	void performActionOnLoad();
 
 	void forget();
+	void forgetData(); // images are released by Image::forgetUnused()
 	ImagePtr makeReplyPreview();
 
 	StickerData *sticker() {
@@ -24,10 +24,20 @@ Copyright (c) 2014-2017 John Preston, https://desktop.telegram.org
 #include "storage/localstorage.h"
 #include "platform/platform_specific.h"
 #include "auth_session.h"
+#include "base/task_queue.h"
 
 namespace Images {
 namespace {
 
+// Blur scratch buffers up to this count of uint64 are kept for reuse.
+constexpr auto kBlurScratchKeptSize = size_t(640 * 640);
+
+std::vector<uint64> &BlurScratch() {
+	// Images are blurred in background tasks as well, one buffer per thread.
+	static auto result = new QThreadStorage<std::vector<uint64>>();
+	return result->localData();
+}
+
 FORCE_INLINE uint64 blurGetColors(const uchar *p) {
 	return (uint64)p[0] + ((uint64)p[1] << 16) + ((uint64)p[2] << 32) + ((uint64)p[3] << 48);
 }
@@ -93,7 +103,14 @@ QImage prepareBlur(QImage img) {
 				pix = img.bits();
 				if (!pix) return was;
 			}
-			uint64 *rgb = new uint64[w * h];
+			// Scratch for the horizontal pass result and the column sums.
+			auto scratchSize = size_t(w) * (h + 2);
+			auto temporary = std::vector<uint64>();
+			auto &scratch = (scratchSize <= kBlurScratchKeptSize) ? BlurScratch() : temporary;
+			if (scratch.size() < scratchSize) {
+				scratch.resize(scratchSize);
+			}
+			auto rgb = scratch.data();
 
 			int x, y, i;
 
@@ -133,43 +150,50 @@ x++;
 				yw += stride;
 			}
 
-			const int he = h - r1;
+			// Vertical pass goes row by row keeping the sums of all columns,
+			// so that both the scratch and the image are read sequentially.
+			auto rgbsums = rgb + w * h;
+			auto rgballsums = rgbsums + w;
 			for (x = 0; x < w; x++) {
-				uint64 rgballsum = -radius * rgb[x];
-				uint64 rgbsum = rgb[x] * ((r1 * (r1 + 1)) >> 1);
-				for (i = 1; i <= radius; i++) {
-					rgbsum += rgb[i * w + x] * (r1 - i);
-					rgballsum += rgb[i * w + x];
+				rgballsums[x] = -radius * rgb[x];
+				rgbsums[x] = rgb[x] * ((r1 * (r1 + 1)) >> 1);
+			}
+			for (i = 1; i <= radius; i++) {
+				auto row = rgb + i * w;
+				for (x = 0; x < w; x++) {
+					rgbsums[x] += row[x] * (r1 - i);
+					rgballsums[x] += row[x];
 				}
+			}
 
-				y = 0;
-				int yi = x * 4;
-
-#define update(start, middle, end) \
-uint64 res = rgbsum >> 4; \
-pix[yi] = res & 0xFF; \
-pix[yi + 1] = (res >> 16) & 0xFF; \
-pix[yi + 2] = (res >> 32) & 0xFF; \
-pix[yi + 3] = (res >> 48) & 0xFF; \
-rgballsum += rgb[x + (start) * w] - 2 * rgb[x + (middle) * w] + rgb[x + (end) * w]; \
-rgbsum += rgballsum; \
-y++; \
-yi += stride;
-
-				while (y < r1) {
-					update(0, y, y + r1);
-				}
-				while (y < he) {
-					update(y - r1, y, y + r1);
-				}
-				while (y < h) {
-					update(y - r1, y, h - 1);
+			const int he = h - r1;
+			auto update = [&](int start, int middle, int end) {
+				auto out = pix + y * stride;
+				auto startRow = rgb + start * w;
+				auto middleRow = rgb + middle * w;
+				auto endRow = rgb + end * w;
+				for (x = 0; x < w; x++) {
+					uint64 res = rgbsums[x] >> 4;
+					out[0] = res & 0xFF;
+					out[1] = (res >> 16) & 0xFF;
+					out[2] = (res >> 32) & 0xFF;
+					out[3] = (res >> 48) & 0xFF;
+					out += 4;
+					rgballsums[x] += startRow[x] - 2 * middleRow[x] + endRow[x];
+					rgbsums[x] += rgballsums[x];
 				}
-
-#undef update
+				y++;
+			};
+			y = 0;
+			while (y < r1) {
+				update(0, y, y + r1);
+			}
+			while (y < he) {
+				update(y - r1, y, y + r1);
+			}
+			while (y < h) {
+				update(y - r1, y, h - 1);
 			}
-
-			delete[] rgb;
 		}
 	}
 	return img;
@@ -372,6 +396,23 @@ WebFileImages webFileImages;
 
 int64 globalAcquiredSize = 0;
 
+// All images share one budget for their scaled pixmaps, when it is
+// exceeded the least recently used ones are dropped down to the kept size.
+constexpr auto kScaledPixmapsLimit = int64(64 * 1024 * 1024);
+constexpr auto kScaledPixmapsKept = kScaledPixmapsLimit * 3 / 4;
+
+// Images painted during this timeout are considered visible.
+constexpr auto kImageVisibleTimeout = TimeMs(2000);
+
+const Image *usedImagesFirst = nullptr;
+const Image *usedImagesLast = nullptr;
+int usedImagesCount = 0;
+
+ScaledPixmapsStats scaledStats;
+uint64 scaledUsageCounter = 0;
+bool scaledShrinkScheduled = false;
+std::set<const Image*> imagesWithScaled;
+
 uint64 PixKey(int width, int height, Images::Options options) {
 	return static_cast<uint64>(width) | (static_cast<uint64>(height) << 24) | (static_cast<uint64>(options) << 48);
 }
@@ -400,7 +441,7 @@ Image::Image(const QString &file, QByteArray fmt) : _forgot(false) {
 	_data = App::pixmapFromImageInPlace(App::readImage(file, &fmt, false, 0, &_saved));
 	_format = fmt;
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquireData();
 	}
 }
 
@@ -409,13 +450,13 @@ Image::Image(const QByteArray &filecontent, QByteArray fmt) : _forgot(false) {
 	_format = fmt;
 	_saved = filecontent;
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquireData();
 	}
 }
 
 Image::Image(const QPixmap &pixmap, QByteArray format) : _format(format), _forgot(false), _data(pixmap) {
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquireData();
 	}
 }
 
@@ -424,8 +465,182 @@ Image::Image(const QByteArray &filecontent, QByteArray fmt, const QPixmap &pixma
 	_format = fmt;
 	_saved = filecontent;
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquireData();
+	}
+}
+
+void Image::acquireData() const {
+	releaseData();
+
+	_acquiredSize = int64(_data.width()) * _data.height() * 4;
+	globalAcquiredSize += _acquiredSize;
+	_acquired = true;
+	_usedPrev = usedImagesLast;
+	_usedNext = nullptr;
+	if (usedImagesLast) {
+		usedImagesLast->_usedNext = this;
+	} else {
+		usedImagesFirst = this;
 	}
+	usedImagesLast = this;
+	++usedImagesCount;
+	_lastUsed = getms();
+}
+
+void Image::releaseData() const {
+	if (!_acquired) {
+		return;
+	}
+	globalAcquiredSize -= base::take(_acquiredSize);
+	_acquired = false;
+	if (_usedPrev) {
+		_usedPrev->_usedNext = _usedNext;
+	} else {
+		usedImagesFirst = _usedNext;
+	}
+	if (_usedNext) {
+		_usedNext->_usedPrev = _usedPrev;
+	} else {
+		usedImagesLast = _usedPrev;
+	}
+	_usedPrev = _usedNext = nullptr;
+	--usedImagesCount;
+}
+
+void Image::markUsed() const {
+	_lastUsed = getms();
+	if (!_acquired || usedImagesLast == this) {
+		return;
+	}
+
+	// Move to the end of the recency list.
+	if (_usedPrev) {
+		_usedPrev->_usedNext = _usedNext;
+	} else {
+		usedImagesFirst = _usedNext;
+	}
+	_usedNext->_usedPrev = _usedPrev;
+	_usedPrev = usedImagesLast;
+	_usedNext = nullptr;
+	usedImagesLast->_usedNext = this;
+	usedImagesLast = this;
+}
+
+void Image::forgetUnused(int64 limit) {
+	if (globalAcquiredSize <= limit) {
+		return;
+	}
+	auto was = globalAcquiredSize;
+	auto keep = limit * 3 / 4;
+	auto forgot = 0;
+	auto now = getms();
+	for (auto image = usedImagesFirst; image && globalAcquiredSize > keep;) {
+		if (now - image->_lastUsed < kImageVisibleTimeout) {
+			break; // All the following images were painted even later.
+		}
+		auto next = image->_usedNext;
+
+		// Images without the saved file content (reply previews, generated
+		// userpics) would have to be encoded right here to be forgotten.
+		if (!image->_saved.isEmpty()) {
+			image->forget();
+			if (image->_forgot) {
+				++forgot;
+			}
+		}
+		image = next;
+	}
+	if (!forgot) {
+		return; // Everything was painted just now, keep it while scrolling.
+	}
+	auto requests = scaledStats.hits + scaledStats.misses;
+	auto hitRate = requests ? (scaledStats.hits * 100 / requests) : 0;
+	DEBUG_LOG(("Image Cache: forgot %1 images, size %2 -> %3.").arg(forgot).arg(was).arg(globalAcquiredSize));
+	DEBUG_LOG(("Image Cache: decoded %1 in %2 images, scaled %3, scaled hit rate %4%").arg(globalAcquiredSize - scaledStats.size).arg(usedImagesCount).arg(scaledStats.size).arg(hitRate));
+}
+
+template <typename Prepare>
+const QPixmap &Image::cachedPix(uint64 key, Prepare prepare, QSize size) const {
+	markUsed();
+
+	auto i = _sizesCache.find(key);
+	if (i != _sizesCache.end()) {
+		if (size.isEmpty() || i->pix.size() == size) {
+			++scaledStats.hits;
+			i->lastUsed = ++scaledUsageCounter;
+			return i->pix;
+		}
+		forgetCachedPix(key);
+	}
+	++scaledStats.misses;
+
+	auto p = prepare();
+	if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
+	if (!p.isNull()) {
+		auto bytes = int64(p.width()) * p.height() * 4;
+		globalAcquiredSize += bytes;
+		scaledStats.size += bytes;
+	}
+	if (_sizesCache.isEmpty()) {
+		imagesWithScaled.insert(this);
+	}
+	i = _sizesCache.insert(key, CachedPix());
+	i->pix = std::move(p);
+	i->lastUsed = ++scaledUsageCounter;
+
+	// Pixmaps returned by reference must outlive the current paint,
+	// so the cache is shrunk later from the main loop.
+	if (scaledStats.size > kScaledPixmapsLimit && !scaledShrinkScheduled) {
+		scaledShrinkScheduled = true;
+		base::TaskQueue::Main().Put([] { shrinkScaledCache(); });
+	}
+	return i->pix;
+}
+
+void Image::forgetCachedPix(uint64 key) const {
+	auto i = _sizesCache.find(key);
+	if (i == _sizesCache.end()) {
+		return;
+	}
+	if (!i->pix.isNull()) {
+		auto bytes = int64(i->pix.width()) * i->pix.height() * 4;
+		globalAcquiredSize -= bytes;
+		scaledStats.size -= bytes;
+	}
+	_sizesCache.erase(i);
+	if (_sizesCache.isEmpty()) {
+		imagesWithScaled.erase(this);
+	}
+}
+
+void Image::shrinkScaledCache() {
+	scaledShrinkScheduled = false;
+	if (scaledStats.size <= kScaledPixmapsLimit) {
+		return;
+	}
+
+	struct Used {
+		uint64 lastUsed;
+		const Image *image;
+		uint64 key;
+	};
+	auto used = std::vector<Used>();
+	for (auto image : imagesWithScaled) {
+		for (auto i = image->_sizesCache.cbegin(), e = image->_sizesCache.cend(); i != e; ++i) {
+			used.push_back({ i->lastUsed, image, i.key() });
+		}
+	}
+	std::sort(used.begin(), used.end(), [](const Used &a, const Used &b) {
+		return a.lastUsed < b.lastUsed;
+	});
+	for (auto &entry : used) {
+		if (scaledStats.size <= kScaledPixmapsKept) {
+			break;
+		}
+		entry.image->forgetCachedPix(entry.key);
+	}
+	auto requests = scaledStats.hits + scaledStats.misses;
+	DEBUG_LOG(("Image Cache: scaled pixmaps shrunk to %1 bytes, hit rate %2%").arg(scaledStats.size).arg(requests ? (scaledStats.hits * 100 / requests) : 0));
 }
 
 const QPixmap &Image::pix(int32 w, int32 h) const {
@@ -438,17 +653,9 @@ const QPixmap &Image::pix(int32 w, int32 h) const {
         h *= cIntRetinaFactor();
     }
 	auto options = Images::Option::Smooth | Images::Option::None;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(w, h, options);
-        if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, w, h, options] {
+		return pixNoCache(w, h, options);
+	});
 }
 
 const QPixmap &Image::pixRounded(int32 w, int32 h, ImageRoundRadius radius, ImageRoundCorners corners) const {
@@ -474,17 +681,9 @@ const QPixmap &Image::pixRounded(int32 w, int32 h, ImageRoundRadius radius, Imag
 	} else if (radius == ImageRoundRadius::Ellipse) {
 		options |= Images::Option::Circled | cornerOptions(corners);
 	}
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(w, h, options);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, w, h, options] {
+		return pixNoCache(w, h, options);
+	});
 }
 
 const QPixmap &Image::pixCircled(int32 w, int32 h) const {
@@ -497,17 +696,9 @@ const QPixmap &Image::pixCircled(int32 w, int32 h) const {
 		h *= cIntRetinaFactor();
 	}
 	auto options = Images::Option::Smooth | Images::Option::Circled;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(w, h, options);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, w, h, options] {
+		return pixNoCache(w, h, options);
+	});
 }
 
 const QPixmap &Image::pixBlurredCircled(int32 w, int32 h) const {
@@ -520,17 +711,9 @@ const QPixmap &Image::pixBlurredCircled(int32 w, int32 h) const {
 		h *= cIntRetinaFactor();
 	}
 	auto options = Images::Option::Smooth | Images::Option::Circled | Images::Option::Blurred;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(w, h, options);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, w, h, options] {
+		return pixNoCache(w, h, options);
+	});
 }
 
 const QPixmap &Image::pixBlurred(int32 w, int32 h) const {
@@ -543,17 +726,9 @@ const QPixmap &Image::pixBlurred(int32 w, int32 h) const {
 		h *= cIntRetinaFactor();
 	}
 	auto options = Images::Option::Smooth | Images::Option::Blurred;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(w, h, options);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, w, h, options] {
+		return pixNoCache(w, h, options);
+	});
 }
 
 const QPixmap &Image::pixColored(style::color add, int32 w, int32 h) const {
@@ -566,17 +741,9 @@ const QPixmap &Image::pixColored(style::color add, int32 w, int32 h) const {
 		h *= cIntRetinaFactor();
 	}
 	auto options = Images::Option::Smooth | Images::Option::Colored;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixColoredNoCache(add, w, h, true);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, &add, w, h] {
+		return pixColoredNoCache(add, w, h, true);
+	});
 }
 
 const QPixmap &Image::pixBlurredColored(style::color add, int32 w, int32 h) const {
@@ -589,17 +756,9 @@ const QPixmap &Image::pixBlurredColored(style::color add, int32 w, int32 h) cons
 		h *= cIntRetinaFactor();
 	}
 	auto options = Images::Option::Blurred | Images::Option::Smooth | Images::Option::Colored;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixBlurredColoredNoCache(add, w, h);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	return cachedPix(PixKey(w, h, options), [this, &add, w, h] {
+		return pixBlurredColoredNoCache(add, w, h);
+	});
 }
 
 const QPixmap &Image::pixSingle(int32 w, int32 h, int32 outerw, int32 outerh, ImageRoundRadius radius, ImageRoundCorners corners) const {
@@ -627,20 +786,10 @@ const QPixmap &Image::pixSingle(int32 w, int32 h, int32 outerw, int32 outerh, Im
 		options |= Images::Option::Circled | cornerOptions(corners);
 	}
 
-	auto k = SinglePixKey(options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend() || i->width() != (outerw * cIntRetinaFactor()) || i->height() != (outerh * cIntRetinaFactor())) {
-		if (i != _sizesCache.cend()) {
-			globalAcquiredSize -= int64(i->width()) * i->height() * 4;
-		}
-		auto p = pixNoCache(w, h, options, outerw, outerh);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	auto size = QSize(outerw, outerh) * cIntRetinaFactor();
+	return cachedPix(SinglePixKey(options), [this, w, h, options, outerw, outerh] {
+		return pixNoCache(w, h, options, outerw, outerh);
+	}, size);
 }
 
 const QPixmap &Image::pixBlurredSingle(int w, int h, int32 outerw, int32 outerh, ImageRoundRadius radius, ImageRoundCorners corners) const {
@@ -668,25 +817,16 @@ const QPixmap &Image::pixBlurredSingle(int w, int h, int32 outerw, int32 outerh,
 		options |= Images::Option::Circled | cornerOptions(corners);
 	}
 
-	auto k = SinglePixKey(options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend() || i->width() != (outerw * cIntRetinaFactor()) || i->height() != (outerh * cIntRetinaFactor())) {
-		if (i != _sizesCache.cend()) {
-			globalAcquiredSize -= int64(i->width()) * i->height() * 4;
-		}
-		auto p = pixNoCache(w, h, options, outerw, outerh);
-		if (cRetina()) p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		if (!p.isNull()) {
-			globalAcquiredSize += int64(p.width()) * p.height() * 4;
-		}
-	}
-	return i.value();
+	auto size = QSize(outerw, outerh) * cIntRetinaFactor();
+	return cachedPix(SinglePixKey(options), [this, w, h, options, outerw, outerh] {
+		return pixNoCache(w, h, options, outerw, outerh);
+	}, size);
 }
 
 QPixmap Image::pixNoCache(int w, int h, Images::Options options, int outerw, int outerh) const {
 	if (!loading()) const_cast<Image*>(this)->load();
 	restore();
+	markUsed();
 
 	if (_data.isNull()) {
 		if (h <= 0 && height() > 0) {
@@ -778,7 +918,7 @@ void Image::forget() const {
 			}
 		}
 	}
-	globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+	releaseData();
 	_data = QPixmap();
 	_forgot = true;
 }
@@ -794,24 +934,29 @@ void Image::restore() const {
 	_data = QPixmap::fromImageReader(&reader, Qt::ColorOnly);
 
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquireData();
 	}
 	_forgot = false;
 }
 
 void Image::invalidateSizeCache() const {
-	for (auto &pix : _sizesCache) {
-		if (!pix.isNull()) {
-			globalAcquiredSize -= int64(pix.width()) * pix.height() * 4;
+	for (auto &cached : _sizesCache) {
+		if (!cached.pix.isNull()) {
+			auto bytes = int64(cached.pix.width()) * cached.pix.height() * 4;
+			globalAcquiredSize -= bytes;
+			scaledStats.size -= bytes;
 		}
 	}
+	if (!_sizesCache.isEmpty()) {
+		imagesWithScaled.erase(this);
+	}
 	_sizesCache.clear();
 }
 
 Image::~Image() {
 	invalidateSizeCache();
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		releaseData();
 	}
 }
 
@@ -838,8 +983,13 @@ int64 imageCacheSize() {
 	return globalAcquiredSize;
 }
 
+ScaledPixmapsStats scaledPixmapsStats() {
+	return scaledStats;
+}
+
 void RemoteImage::doCheckload() const {
 	if (!amLoading() || !_loader->finished()) return;
+	if (!_loader->imageReady(shrinkBox())) return;
 
 	QPixmap data = _loader->imagePixmap(shrinkBox());
 	if (data.isNull()) {
@@ -848,14 +998,14 @@ void RemoteImage::doCheckload() const {
 	}
 
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		releaseData();
 	}
 
 	_format = _loader->imageFormat(shrinkBox());
 	_data = data;
 	_saved = _loader->bytes();
 	const_cast<RemoteImage*>(this)->setInformation(_saved.size(), _data.width(), _data.height());
-	globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+	acquireData();
 
 	invalidateSizeCache();
 
@@ -881,12 +1031,12 @@ void RemoteImage::setData(QByteArray &bytes, const QByteArray &bytesFormat) {
 	QBuffer buffer(&bytes);
 
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		releaseData();
 	}
 	QByteArray fmt(bytesFormat);
 	_data = App::pixmapFromImageInPlace(App::readImage(bytes, &fmt, false));
 	if (!_data.isNull()) {
-		globalAcquiredSize += int64(_data.width()) * _data.height() * 4;
+		acquireData();
 		setInformation(bytes.size(), _data.width(), _data.height());
 	}
 
@@ -944,9 +1094,16 @@ void RemoteImage::loadEvenCancelled(bool loadFirst, bool prior) {
 	return load(loadFirst, prior);
 }
 
+void RemoteImage::forget() const {
+	if (amLoading()) {
+		_loader->cancelImageDecoding();
+	}
+	Image::forget();
+}
+
 RemoteImage::~RemoteImage() {
 	if (!_data.isNull()) {
-		globalAcquiredSize -= int64(_data.width()) * _data.height() * 4;
+		releaseData();
 	}
 	if (amLoading()) {
 		destroyLoaderDelayed();
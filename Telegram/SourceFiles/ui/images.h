@@ -275,7 +275,11 @@ public:
 
 	bool isNull() const;
 
-	void forget() const;
+	virtual void forget() const;
+
+	// Forgets the least recently painted images while all the decoded
+	// and scaled pixmaps take more than the limit.
+	static void forgetUnused(int64 limit);
 
 	QByteArray savedFormat() const {
 		return _format;
@@ -302,6 +306,11 @@ protected:
 	}
 	void invalidateSizeCache() const;
 
+	// Account the _data pixmap in the global size and recency list.
+	void acquireData() const;
+	void releaseData() const;
+	void markUsed() const;
+
 	virtual int32 countWidth() const {
 		restore();
 		return _data.width();
@@ -317,9 +326,27 @@ protected:
 	mutable QPixmap _data;
 
 private:
-	using Sizes = QMap<uint64, QPixmap>;
+	// Returns the pixmap cached by key, calling prepare() on a cache miss.
+	// If size is not empty a cached pixmap of another size is prepared again.
+	template <typename Prepare>
+	const QPixmap &cachedPix(uint64 key, Prepare prepare, QSize size = QSize()) const;
+	void forgetCachedPix(uint64 key) const;
+	static void shrinkScaledCache();
+
+	struct CachedPix {
+		QPixmap pix;
+		uint64 lastUsed = 0;
+	};
+	using Sizes = QMap<uint64, CachedPix>;
 	mutable Sizes _sizesCache;
 
+	// Images with acquired _data, from the least recently used one.
+	mutable const Image *_usedPrev = nullptr;
+	mutable const Image *_usedNext = nullptr;
+	mutable bool _acquired = false;
+	mutable int64 _acquiredSize = 0;
+	mutable TimeMs _lastUsed = 0;
+
 };
 
 typedef QPair<uint64, uint64> StorageKey;
@@ -360,6 +387,9 @@ public:
 	void load(bool loadFirst = false, bool prior = true);
 	void loadEvenCancelled(bool loadFirst = false, bool prior = true);
 
+	// Also drops the pending background decoding of the loaded image.
+	void forget() const override;
+
 	~RemoteImage();
 
 protected:
@@ -542,6 +572,13 @@ void clearStorageImages();
 void clearAllImages();
 int64 imageCacheSize();
 
+struct ScaledPixmapsStats {
+	int64 size = 0;
+	int64 hits = 0;
+	int64 misses = 0;
+};
+ScaledPixmapsStats scaledPixmapsStats();
+
 class PsFileBookmark;
 class ReadAccessEnabler {
 public:
@@ -2411,7 +2411,8 @@ Text::Text(const Text &other)
 , _st(other._st)
 , _blocks(other._blocks.size())
 , _links(other._links)
-, _startDir(other._startDir) {
+, _startDir(other._startDir)
+, _heightCache(other._heightCache) {
 	for (int32 i = 0, l = _blocks.size(); i < l; ++i) {
 		_blocks[i] = other._blocks.at(i)->clone();
 	}
@@ -2425,7 +2426,8 @@ Text::Text(Text &&other)
 , _st(other._st)
 , _blocks(other._blocks)
 , _links(other._links)
-, _startDir(other._startDir) {
+, _startDir(other._startDir)
+, _heightCache(other._heightCache) {
 	other.clearFields();
 }
 
@@ -2438,6 +2440,7 @@ Text &Text::operator=(const Text &other) {
 	_blocks = TextBlocks(other._blocks.size());
 	_links = other._links;
 	_startDir = other._startDir;
+	_heightCache = other._heightCache;
 	for (int32 i = 0, l = _blocks.size(); i < l; ++i) {
 		_blocks[i] = other._blocks.at(i)->clone();
 	}
@@ -2453,6 +2456,7 @@ Text &Text::operator=(Text &&other) {
 	_blocks = other._blocks;
 	_links = other._links;
 	_startDir = other._startDir;
+	_heightCache = other._heightCache;
 	other.clearFields();
 	return *this;
 }
@@ -2467,6 +2471,8 @@ void Text::setText(const style::TextStyle &st, const QString &text, const TextPa
 }
 
 void Text::recountNaturalSize(bool initial, Qt::LayoutDirection optionsDir) {
+	_heightCache = LinesLayout();
+
 	NewlineBlock *lastNewline = 0;
 
 	_maxWidth = _minHeight = 0;
@@ -2703,10 +2709,15 @@ int Text::countHeight(int width) const {
 	if (QFixed(width) >= _maxWidth) {
 		return _minHeight;
 	}
+	auto layoutWidth = qMax(QFixed(width), _minResizeWidth);
+	if (layoutWidth >= _heightCache.from && layoutWidth < _heightCache.till) {
+		return _heightCache.height;
+	}
 	int result = 0;
 	enumerateLines(width, [&result](QFixed lineWidth, int lineHeight) {
 		result += lineHeight;
-	});
+	}, &_heightCache);
+	_heightCache.height = result;
 	return result;
 }
 
@@ -2717,10 +2728,24 @@ void Text::countLineWidths(int width, QVector<int> *lineWidths) const {
 }
 
 template <typename Callback>
-void Text::enumerateLines(int w, Callback callback) const {
+void Text::enumerateLines(int w, Callback callback, LinesLayout *layout) const {
 	QFixed width = w;
 	if (width < _minResizeWidth) width = _minResizeWidth;
 
+	// Each fit check is "width >= required" with required not depending
+	// on width, so the lines stay the same between the largest required
+	// width that fitted and the smallest one that did not.
+	auto fitFrom = QFixed(0), fitTill = QFixed(QFIXED_MAX);
+	auto checkFits = [width, &fitFrom, &fitTill](QFixed newWidthLeft) {
+		auto required = width - newWidthLeft;
+		if (newWidthLeft >= 0) {
+			accumulate_max(fitFrom, required);
+			return true;
+		}
+		accumulate_min(fitTill, required);
+		return false;
+	};
+
 	int lineHeight = 0;
 	QFixed widthLeft = width, last_rBearing = 0, last_rPadding = 0;
 	bool longWordLine = true;
@@ -2742,7 +2767,7 @@ void Text::enumerateLines(int w, Callback callback) const {
 		}
 		auto b__f_rbearing = b->f_rbearing();
 		auto newWidthLeft = widthLeft - last_rBearing - (last_rPadding + b->f_width() - b__f_rbearing);
-		if (newWidthLeft >= 0) {
+		if (checkFits(newWidthLeft)) {
 			last_rBearing = b__f_rbearing;
 			last_rPadding = b->f_rpadding();
 			widthLeft = newWidthLeft;
@@ -2771,7 +2796,7 @@ void Text::enumerateLines(int w, Callback callback) const {
 				auto j_width = wordEndsHere ? j->f_width() : -j->f_width();
 
 				auto newWidthLeft = widthLeft - last_rBearing - (last_rPadding + j_width - j->f_rbearing());
-				if (newWidthLeft >= 0) {
+				if (checkFits(newWidthLeft)) {
 					last_rBearing = j->f_rbearing();
 					last_rPadding = j->f_rpadding();
 					widthLeft = newWidthLeft;
@@ -2824,6 +2849,10 @@ void Text::enumerateLines(int w, Callback callback) const {
 	if (widthLeft < width) {
 		callback(width - widthLeft, lineHeight);
 	}
+	if (layout) {
+		layout->from = fitFrom;
+		layout->till = fitTill;
+	}
 }
 
 void Text::draw(Painter &painter, int32 left, int32 top, int32 w, style::align align, int32 yFrom, int32 yTo, TextSelection selection, bool fullWidthSelection) const {
@@ -2891,6 +2920,24 @@ bool Text::isEmpty() const {
 	return _blocks.empty() || _blocks[0]->type() == TextBlockTSkip;
 }
 
+int Text::memoryUsage() const {
+	auto result = int(_text.capacity() * sizeof(QChar));
+	result += _blocks.capacity() * sizeof(ITextBlock*);
+	result += _links.capacity() * sizeof(ClickHandlerPtr);
+	for_const (auto block, _blocks) {
+		switch (block->type()) {
+		case TextBlockTNewline: result += sizeof(NewlineBlock); break;
+		case TextBlockTText: {
+			auto text = static_cast<const TextBlock*>(block);
+			result += sizeof(TextBlock) + text->_words.capacity() * sizeof(TextWord);
+		} break;
+		case TextBlockTEmoji: result += sizeof(EmojiBlock); break;
+		case TextBlockTSkip: result += sizeof(SkipBlock); break;
+		}
+	}
+	return result;
+}
+
 uint16 Text::countBlockEnd(const TextBlocks::const_iterator &i, const TextBlocks::const_iterator &e) const {
 	return (i + 1 == e) ? _text.size() : (*(i + 1))->from();
 }
@@ -3042,6 +3089,7 @@ void Text::clearFields() {
 	_links.clear();
 	_maxWidth = _minHeight = 0;
 	_startDir = Qt::LayoutDirectionAuto;
+	_heightCache = LinesLayout();
 }
 
 void emojiDraw(QPainter &p, EmojiPtr e, int x, int y) {
@@ -176,6 +176,9 @@ public:
 		return _text.size();
 	}
 
+	// Approximate count of heap bytes held by the parsed text and its layout.
+	int memoryUsage() const;
+
 	TextWithEntities originalTextWithEntities(TextSelection selection = AllTextSelection, ExpandLinksMode mode = ExpandLinksShortened) const;
 	QString originalText(TextSelection selection = AllTextSelection, ExpandLinksMode mode = ExpandLinksShortened) const;
 
@@ -214,11 +217,19 @@ private:
 	template <typename AppendPartCallback, typename ClickHandlerStartCallback, typename ClickHandlerFinishCallback, typename FlagsChangeCallback>
 	void enumerateText(TextSelection selection, AppendPartCallback appendPartCallback, ClickHandlerStartCallback clickHandlerStartCallback, ClickHandlerFinishCallback clickHandlerFinishCallback, FlagsChangeCallback flagsChangeCallback) const;
 
+	// Widths range [from, till) where the lines are broken the same way.
+	struct LinesLayout {
+		QFixed from = QFIXED_MAX;
+		QFixed till = 0;
+		int height = 0;
+	};
+
 	// Template method for countWidth(), countHeight(), countLineWidths().
 	// callback(lineWidth, lineHeight) will be called for all lines with:
 	// QFixed lineWidth, int lineHeight
+	// If layout is passed it receives the widths range with the same lines.
 	template <typename Callback>
-	void enumerateLines(int w, Callback callback) const;
+	void enumerateLines(int w, Callback callback, LinesLayout *layout = nullptr) const;
 
 	void recountNaturalSize(bool initial, Qt::LayoutDirection optionsDir = Qt::LayoutDirectionAuto);
 
@@ -238,6 +249,9 @@ private:
 
 	Qt::LayoutDirection _startDir = Qt::LayoutDirectionAuto;
 
+	// Last countHeight() result, reused while resizing within its range.
+	mutable LinesLayout _heightCache;
+
 	friend class TextParser;
 	friend class TextPainter;
 